@@ -0,0 +1,435 @@
+// Checks.cpp : Checks KickoffBench runs instead of benchmarks (see Checks.h).
+
+#include "Kickoff/Precomp.h"
+#include "Checks.h"
+#include "Crust/AllocationCounter.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+typedef std::chrono::steady_clock CheckClock;
+
+// How many clients send requests throughout the handoff check, each waiting for a reply before sending its next request
+static const int HANDOFF_CHECK_CLIENTS = 8;
+
+// How long the clients run before the second server takes over, and how long they keep running once the first one is
+// gone (so they also reconnect to the second one)
+static const int HANDOFF_CHECK_WARMUP_MS = 500;
+static const int HANDOFF_CHECK_AFTERMATH_MS = 1000;
+
+// How long the check waits for the clients' last requests to be answered before concluding they never will be. Nothing
+// is answered while the second server waits for the port, so this has to outlast that.
+static const int HANDOFF_CHECK_TIMEOUT_MS = HANDOFF_BIND_TIMEOUT_MS + 5000;
+
+
+int checkHandOff(int port)
+{
+    TextHeader::make("Handoff Check")->print();
+
+    std::atomic<bool> stopClients(false);
+    std::atomic<int> numStoppedClients(0);
+    std::atomic<uint64_t> numCreated(0), numFailed(0);
+    std::atomic<int64_t> longestWaitUS(0);
+
+    std::thread oldServerThread([port]() {
+        TaskServer server(port);
+        server.run();
+    });
+
+    // Each client creates a task, then checks that the server knows it, so tasks created before the handoff are looked
+    // up after it
+    std::vector<std::thread> clientThreads;
+    for (int i = 0; i < HANDOFF_CHECK_CLIENTS; ++i) {
+        clientThreads.push_back(std::thread([&]() {
+            TaskClient client("127.0.0.1", port);
+            TaskCreateInfo info;
+            info.command = "handoff-check";
+
+            while (!stopClients) {
+                auto startTime = CheckClock::now();
+                auto id = client.createTask(info);
+                const TaskID* idPtr = id.ptrOrNull();
+                bool found = idPtr && client.getTaskStatus(*idPtr).hasValue();
+
+                int64_t waitUS = std::chrono::duration_cast<std::chrono::microseconds>(CheckClock::now() - startTime).count();
+                int64_t longest = longestWaitUS;
+                while (waitUS > longest && !longestWaitUS.compare_exchange_weak(longest, waitUS)) {}
+
+                if (idPtr) { numCreated++; }
+                if (!found) { numFailed++; }
+            }
+            numStoppedClients++;
+        }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(HANDOFF_CHECK_WARMUP_MS));
+    TaskServer newServer(port);
+    newServer.takeOver();
+    std::thread newServerThread([&]() { newServer.run(); });
+
+    // The old server's run() returns once it has relayed its last requests and released the port
+    oldServerThread.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(HANDOFF_CHECK_AFTERMATH_MS));
+    stopClients = true;
+
+    auto giveUpTime = CheckClock::now() + std::chrono::milliseconds(HANDOFF_CHECK_TIMEOUT_MS);
+    while (numStoppedClients < HANDOFF_CHECK_CLIENTS) {
+        if (CheckClock::now() >= giveUpTime) {
+            // The stuck clients can't be stopped, so there's no cleaning up after them
+            printError(std::to_string(HANDOFF_CHECK_CLIENTS - numStoppedClients) + " clients never got a reply to their last request; the handoff lost it.");
+            exit(-1);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (auto& thread : clientThreads) {
+        thread.join();
+    }
+
+    newServer.shutdown();
+    newServerThread.join();
+
+    uint64_t numTasks = (uint64_t)newServer.getDatabase().getTotalTaskCount();
+    ColoredString(std::to_string(numCreated) + " tasks created, " + std::to_string(numTasks) + " held by the new server, " +
+        std::to_string(numFailed) + " failed requests, longest wait for a reply " + std::to_string(longestWaitUS / 1000) + "ms\n",
+        TextColor::Cyan).print();
+
+    if (numFailed > 0 || numTasks != numCreated) {
+        printError("Handoff check failed: requests failed, or tasks were lost in the handoff.");
+        return -1;
+    }
+    ColoredString("Handoff check passed.\n", TextColor::LightGreen).print();
+    return 0;
+}
+
+
+// How many pending tasks the server holds throughout the allocations check. Listing tasks fails beyond
+// MAX_STATUS_TASKS, so this stays below it.
+static const int ALLOCATION_CHECK_PENDING_TASKS = 64;
+
+// How many times each request is handled before counting (so pools, arenas and containers have grown to fit), and then
+// how many times it's handled while counting
+static const int ALLOCATION_CHECK_WARMUP_REQUESTS = 1000;
+static const int ALLOCATION_CHECK_REQUESTS = 10000;
+
+// How many tasks the batched requests create, take or finish each
+static const int ALLOCATION_CHECK_BATCH_SIZE = 16;
+
+// Where the heap allocations the check allows come from (per request in the steady state, once warmed up). Every
+// request's reply goes into a vector of frames that handleRequest() returns (run() makes the same vector). The check's
+// server has no data directory and no standby, so it doesn't log changes at all.
+static const uint64_t REPLY_ALLOCATIONS = 1;
+
+// Each task created copies its command into the command store, makes the Task (one allocation, with its control
+// block) and its copy of the required tags, a node in the ID map and one in its bucket's queue, and a temporary for the
+// schedule's signature that finds the bucket
+static const uint64_t CREATE_TASK_ALLOCATIONS = 6;
+
+// Each task taken within a session gets a node in the session's running tasks. Finishing or canceling a task doesn't
+// allocate.
+static const uint64_t TAKE_TASK_IN_SESSION_ALLOCATIONS = 1;
+
+// Opening a session reads its machine name and tags into strings, looks its tags up as a profile, and makes the
+// session's node
+static const uint64_t OPEN_SESSION_ALLOCATIONS = 4;
+
+// Listing workers builds the vectors of workers and profiles to encode, with a copy of each profile's tags, and counts
+// the running tasks of each profile in a map. The check's server has one session and one profile.
+static const uint64_t GET_WORKERS_ALLOCATIONS = 5;
+
+
+// A server for the allocations check to drive one type of request through: it holds some pending tasks, and a worker
+// session to take them in
+struct AllocationCheckServer
+{
+    AllocationCheckServer();
+
+    TaskServer server;
+    WorkerSessionID sessionID;
+    TaskID taskID; // a task for requests to look up
+};
+
+// A request type the allocations check drives, and the most heap allocations handling one may make
+struct AllocationCheck
+{
+    TaskRequestType type;
+    uint64_t budget;
+
+    // Sets up what the request needs (e.g. a task for it to finish) directly in the database, where it isn't counted,
+    // then returns the request
+    std::function<BlobStreamWriter(AllocationCheckServer& check)> makeRequest;
+};
+
+
+static BlobStreamWriter newCheckRequest(TaskRequestType type)
+{
+    // Tagged with the latest protocol version, as current clients send requests
+    BlobStreamWriter request;
+    request << TaskRequestType::Versioned << PROTOCOL_VERSION;
+    request.setCompact(true);
+    request << type;
+    return request;
+}
+
+
+static TaskCreateInfo makeCheckTaskInfo()
+{
+    TaskCreateInfo info;
+    info.command = "allocation-check";
+    info.schedule.requiredResources.push_back(Symbol("cpu"));
+    return info;
+}
+
+
+AllocationCheckServer::AllocationCheckServer()
+    : server(HANDOFF_CHECK_PORT) // never bound, since requests are handed to handleRequest()
+{
+    TaskDatabase& db = server.getDatabase();
+    sessionID = db.openWorkerSession("allocation-check-machine", { "cpu" });
+    taskID = db.createTask(makeCheckTaskInfo());
+    for (int i = 1; i < ALLOCATION_CHECK_PENDING_TASKS; ++i) {
+        db.createTask(makeCheckTaskInfo());
+    }
+}
+
+
+// Creates a task and takes it to run in the check's worker session, without a request
+static TaskID takeCheckTask(AllocationCheckServer& check)
+{
+    TaskDatabase& db = check.server.getDatabase();
+    db.createTask(makeCheckTaskInfo());
+
+    Arena arena;
+    ArenaVector<TaskPtr> tasks(arena);
+    db.takeTasksToRun(check.sessionID, 1, tasks);
+    return tasks[0]->getID();
+}
+
+
+// Takes tasks to run in the check's worker session and finishes them right away, without a request
+static void takeCheckTasks(AllocationCheckServer& check, int count)
+{
+    TaskDatabase& db = check.server.getDatabase();
+    Arena arena;
+    ArenaVector<TaskPtr> tasks(arena);
+    db.takeTasksToRun(check.sessionID, count, tasks);
+    for (const auto& task : tasks) {
+        db.markTaskFinished(task);
+    }
+}
+
+
+// Finishes every task running in the check's worker session, without a request. Renewing a session visits each of its
+// running tasks, so requests that renew it would otherwise get slower and slower.
+static void finishCheckTasks(AllocationCheckServer& check)
+{
+    TaskDatabase& db = check.server.getDatabase();
+    std::set<TaskID> runningTasks = db.getWorkerSessions().at(check.sessionID).runningTasks;
+    for (TaskID id : runningTasks) {
+        db.markTaskFinished(db.getTaskByID(id));
+    }
+}
+
+
+// Closes every worker session but the check's own, without a request
+static void closeOtherCheckSessions(AllocationCheckServer& check)
+{
+    TaskDatabase& db = check.server.getDatabase();
+    std::vector<WorkerSessionID> sessionIDs;
+    for (const auto& entry : db.getWorkerSessions()) {
+        if (entry.first != check.sessionID) { sessionIDs.push_back(entry.first); }
+    }
+    for (WorkerSessionID id : sessionIDs) {
+        db.closeWorkerSession(id);
+    }
+}
+
+
+static std::vector<AllocationCheck> getAllocationChecks()
+{
+    std::vector<AllocationCheck> checks;
+    const uint64_t batch = ALLOCATION_CHECK_BATCH_SIZE;
+
+    auto addLookup = [&](TaskRequestType type) {
+        checks.push_back({ type, REPLY_ALLOCATIONS, [type](AllocationCheckServer& check) {
+            auto request = newCheckRequest(type);
+            request << varInt(check.taskID);
+            return request;
+        }});
+    };
+
+    checks.push_back({ TaskRequestType::Hello, REPLY_ALLOCATIONS, [](AllocationCheckServer&) {
+        auto request = newCheckRequest(TaskRequestType::Hello);
+        request << PROTOCOL_VERSION;
+        return request;
+    }});
+    addLookup(TaskRequestType::GetCommand);
+    addLookup(TaskRequestType::GetSchedule);
+    addLookup(TaskRequestType::GetStatus);
+    addLookup(TaskRequestType::HeartbeatAndCheckWasTaskCanceled);
+    checks.push_back({ TaskRequestType::GetStats, REPLY_ALLOCATIONS, [](AllocationCheckServer&) {
+        return newCheckRequest(TaskRequestType::GetStats);
+    }});
+    // The listed tasks are gathered in the request arena, so listing allocates nothing per task
+    checks.push_back({ TaskRequestType::GetTasksByStates, REPLY_ALLOCATIONS, [](AllocationCheckServer&) {
+        auto request = newCheckRequest(TaskRequestType::GetTasksByStates);
+        request << TaskState::Pending << TaskState::Running;
+        return request;
+    }});
+
+    // Created tasks are taken and finished outside the count, so the database stays the same size throughout
+    checks.push_back({ TaskRequestType::Create, REPLY_ALLOCATIONS + CREATE_TASK_ALLOCATIONS,
+        [](AllocationCheckServer& check) {
+        takeCheckTasks(check, 1);
+        auto request = newCheckRequest(TaskRequestType::Create);
+        request << makeCheckTaskInfo();
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::CreateMany,
+        REPLY_ALLOCATIONS + CREATE_TASK_ALLOCATIONS * batch,
+        [batch](AllocationCheckServer& check) {
+        takeCheckTasks(check, (int)batch);
+        auto request = newCheckRequest(TaskRequestType::CreateMany);
+        request << varInt(batch);
+        for (uint64_t i = 0; i < batch; ++i) {
+            request << makeCheckTaskInfo();
+        }
+        return request;
+    }});
+
+    // Taken tasks are replaced outside the count
+    checks.push_back({ TaskRequestType::TakeToRun, REPLY_ALLOCATIONS,
+        [](AllocationCheckServer& check) {
+        check.server.getDatabase().createTask(makeCheckTaskInfo());
+        auto request = newCheckRequest(TaskRequestType::TakeToRun);
+        request << std::string("cpu");
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::TakeToRunInSession,
+        REPLY_ALLOCATIONS + TAKE_TASK_IN_SESSION_ALLOCATIONS,
+        [](AllocationCheckServer& check) {
+        finishCheckTasks(check);
+        check.server.getDatabase().createTask(makeCheckTaskInfo());
+        auto request = newCheckRequest(TaskRequestType::TakeToRunInSession);
+        request << varInt(check.sessionID);
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::TakeManyToRunInSession,
+        REPLY_ALLOCATIONS + TAKE_TASK_IN_SESSION_ALLOCATIONS * batch,
+        [batch](AllocationCheckServer& check) {
+        finishCheckTasks(check);
+        for (uint64_t i = 0; i < batch; ++i) {
+            check.server.getDatabase().createTask(makeCheckTaskInfo());
+        }
+        auto request = newCheckRequest(TaskRequestType::TakeManyToRunInSession);
+        request << varInt(check.sessionID) << varInt((int)batch);
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::FinishAndTakeToRunInSession,
+        REPLY_ALLOCATIONS + TAKE_TASK_IN_SESSION_ALLOCATIONS * batch,
+        [batch](AllocationCheckServer& check) {
+        finishCheckTasks(check);
+        auto request = newCheckRequest(TaskRequestType::FinishAndTakeToRunInSession);
+        request << varInt(check.sessionID) << varInt(batch);
+        for (uint64_t i = 0; i < batch; ++i) {
+            request << varInt(takeCheckTask(check));
+            check.server.getDatabase().createTask(makeCheckTaskInfo());
+        }
+        request << varInt((int)batch);
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::MarkFinished, REPLY_ALLOCATIONS,
+        [](AllocationCheckServer& check) {
+        auto request = newCheckRequest(TaskRequestType::MarkFinished);
+        request << varInt(takeCheckTask(check));
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::MarkShouldCancel, REPLY_ALLOCATIONS,
+        [](AllocationCheckServer& check) {
+        auto request = newCheckRequest(TaskRequestType::MarkShouldCancel);
+        request << varInt(takeCheckTask(check));
+        return request;
+    }});
+
+    // Sessions opened by earlier requests are closed outside the count
+    checks.push_back({ TaskRequestType::OpenWorkerSession,
+        REPLY_ALLOCATIONS + OPEN_SESSION_ALLOCATIONS,
+        [](AllocationCheckServer& check) {
+        closeOtherCheckSessions(check);
+        auto request = newCheckRequest(TaskRequestType::OpenWorkerSession);
+        request << std::string("allocation-check-machine") << std::string("cpu");
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::RenewWorkerSession, REPLY_ALLOCATIONS, [](AllocationCheckServer& check) {
+        auto request = newCheckRequest(TaskRequestType::RenewWorkerSession);
+        request << varInt(check.sessionID);
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::CloseWorkerSession, REPLY_ALLOCATIONS,
+        [](AllocationCheckServer& check) {
+        auto request = newCheckRequest(TaskRequestType::CloseWorkerSession);
+        request << varInt(check.server.getDatabase().openWorkerSession("allocation-check-machine", { "cpu" }));
+        return request;
+    }});
+    checks.push_back({ TaskRequestType::GetWorkers, REPLY_ALLOCATIONS + GET_WORKERS_ALLOCATIONS,
+        [](AllocationCheckServer&) {
+        return newCheckRequest(TaskRequestType::GetWorkers);
+    }});
+
+    return checks;
+}
+
+
+int checkAllocations()
+{
+    TextHeader::make("Allocations Check")->print();
+
+    // Parsing the command line has allocated, if anything is counted
+    if (getThreadAllocationCount() == 0) {
+        printError("Allocations aren't counted in this build; build it with KICKOFF_COUNT_ALLOCATIONS defined.");
+        return -1;
+    }
+
+    char header[256];
+    snprintf(header, sizeof(header), "%-36s %14s %10s\n", "Request", "allocs/request", "budget");
+    ColoredString(header, TextColor::White).print();
+
+    bool passed = true;
+    for (const auto& check : getAllocationChecks()) {
+        AllocationCheckServer checkServer;
+
+        uint64_t allocations = 0;
+        bool succeeded = true;
+        for (int i = 0; i < ALLOCATION_CHECK_WARMUP_REQUESTS + ALLOCATION_CHECK_REQUESTS; ++i) {
+            BlobStreamWriter request = check.makeRequest(checkServer);
+
+            uint64_t startAllocations = getThreadAllocationCount();
+            auto frames = checkServer.server.handleRequest(request.data());
+            if (i >= ALLOCATION_CHECK_WARMUP_REQUESTS) {
+                allocations += getThreadAllocationCount() - startAllocations;
+            }
+
+            // A request that failed may well be cheaper than one that did its work, so it fails the check
+            BlobStreamReader reply(frames[0].data());
+            reply.setCompact(true);
+            TaskReplyType replyType;
+            succeeded = succeeded && (reply >> replyType) && replyType == TaskReplyType::Success;
+        }
+
+        double perRequest = double(allocations) / ALLOCATION_CHECK_REQUESTS;
+        bool withinBudget = succeeded && perRequest <= (double)check.budget;
+        passed = passed && withinBudget;
+
+        char line[256];
+        snprintf(line, sizeof(line), "%-36s %14.2f %10llu%s\n", getRequestTypeName(check.type), perRequest,
+            (unsigned long long)check.budget, succeeded ? "" : "  (requests failed)");
+        ColoredString(line, withinBudget ? TextColor::LightCyan : TextColor::LightRed).print();
+    }
+
+    if (!passed) {
+        printError("Allocations check failed: some requests failed, or made more heap allocations than their budget.");
+        return -1;
+    }
+    ColoredString("Allocations check passed.\n", TextColor::LightGreen).print();
+    return 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// The port the handoff check runs its servers on, unless given another with -port
+static const int HANDOFF_CHECK_PORT = 27931;
+
+
+// Checks that KickoffBench runs (with -check <name>) instead of timing anything. Each prints what it found, and returns
+// the process's exit code, which is nonzero if the check failed.
+
+// Runs a server with clients sending it requests nonstop, and has a second server take it over in the meantime (as
+// `kickoff server -takeover` does). Passes if every request got its reply, and the second server ends up with every
+// task the clients were told was created.
+int checkHandOff(int port);
+
+// Drives each type of request a busy server handles through TaskServer::handleRequest, once the server has warmed up,
+// and counts the heap allocations handling it makes. Fails if any type makes more per request than its budget. Needs
+// KICKOFF_COUNT_ALLOCATIONS (which KickoffBench is built with), since otherwise nothing is counted.
+int checkAllocations();
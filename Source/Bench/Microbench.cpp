@@ -0,0 +1,372 @@
+// Microbench.cpp : Times the scheduler and Crust primitives one operation type at a time, and reports what each costs in
+// nanoseconds and heap allocations per operation. This target is built with KICKOFF_COUNT_ALLOCATIONS defined, so every
+// allocation is counted (see Crust/AllocationCounter.h).
+//
+// Usage: KickoffBench [-filter <text that benchmark names must contain>]
+//        KickoffBench -check handoff [-port <portnum>]
+//        KickoffBench -check allocations
+
+#include "Kickoff/Precomp.h"
+#include "Checks.h"
+#include "Crust/AllocationCounter.h"
+#include "Crust/PooledBlob.h"
+#include <chrono>
+#include <functional>
+
+typedef std::chrono::steady_clock BenchClock;
+
+// The numbers of pending tasks taking a task is timed with
+static const int BENCH_PENDING_TASK_COUNTS[] = { 1000, 100000, 1000000 };
+
+// The numbers of distinct resource tags (and so of pending task buckets) tasks are spread over
+static const int BENCH_TAG_CARDINALITIES[] = { 1, 16, 256 };
+
+// How many operations each benchmark times, unless it has fewer to do
+static const int BENCH_OPS = 100000;
+
+// How many running tasks cleanupZombieTasks sweeps, and how many sweeps are timed
+static const int BENCH_RUNNING_TASK_COUNT = 100000;
+static const int BENCH_CLEANUP_SWEEPS = 100;
+
+
+// Accumulates the time and allocations of the operations a benchmark times. Setup done outside of start() and stop()
+// isn't counted.
+class BenchTimer
+{
+public:
+    BenchTimer() : m_ops(0), m_nanoseconds(0), m_allocations(0), m_startAllocations(0) {}
+
+    void start()
+    {
+        m_startAllocations = getThreadAllocationCount();
+        m_startTime = BenchClock::now();
+    }
+
+    void stop(uint64_t ops)
+    {
+        auto elapsed = BenchClock::now() - m_startTime;
+        m_allocations += getThreadAllocationCount() - m_startAllocations;
+        m_nanoseconds += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        m_ops += ops;
+    }
+
+    uint64_t getOps() const { return m_ops; }
+    double getNanosecondsPerOp() const { return m_ops > 0 ? double(m_nanoseconds) / m_ops : 0.0; }
+    double getAllocationsPerOp() const { return m_ops > 0 ? double(m_allocations) / m_ops : 0.0; }
+
+private:
+    uint64_t m_ops;
+    uint64_t m_nanoseconds;
+    uint64_t m_allocations;
+    uint64_t m_startAllocations;
+    BenchClock::time_point m_startTime;
+};
+
+
+struct Benchmark
+{
+    std::string name;
+    std::function<void(BenchTimer&)> run;
+};
+
+
+static TaskCreateInfo makeBenchTask(int index, int tagCardinality)
+{
+    TaskCreateInfo info;
+    info.command = "payload.exe --input data/" + std::to_string(index) + ".bin --output results/" + std::to_string(index) + ".bin";
+    info.schedule.requiredResources.push_back(Symbol("tag" + std::to_string(index % tagCardinality)));
+    return info;
+}
+
+
+// A worker that has every tag the tasks are spread over, so it can take any of them
+static ResourceTags makeBenchResources(int tagCardinality)
+{
+    std::vector<Symbol> tags;
+    for (int i = 0; i < tagCardinality; ++i) {
+        tags.push_back(Symbol("tag" + std::to_string(i)));
+    }
+    return makeResourceTags(std::move(tags));
+}
+
+
+static void createBenchTasks(TaskDatabase& db, int count, int tagCardinality)
+{
+    for (int i = 0; i < count; ++i) {
+        db.createTask(makeBenchTask(i, tagCardinality));
+    }
+}
+
+
+static std::vector<TaskPtr> takeAllBenchTasks(TaskDatabase& db, int tagCardinality)
+{
+    ResourceTags resources = makeBenchResources(tagCardinality);
+
+    Arena arena;
+    ArenaVector<TaskPtr> tasks(arena);
+    db.takeTasksToRun(resources, INT_MAX, NO_WORKER_SESSION, tasks);
+    return std::vector<TaskPtr>(tasks.begin(), tasks.end());
+}
+
+
+// Takes tasks one at a time the way the server does, with a fresh arena for each, while half the tasks are still pending
+static void benchTakeTaskToRun(BenchTimer& timer, int pendingCount, int tagCardinality)
+{
+    TaskDatabase db;
+    createBenchTasks(db, pendingCount, tagCardinality);
+    ResourceTags resources = makeBenchResources(tagCardinality);
+
+    int ops = std::min(BENCH_OPS, pendingCount / 2);
+    Arena arena;
+    timer.start();
+    for (int i = 0; i < ops; ++i) {
+        arena.reset();
+        ArenaVector<TaskPtr> tasks(arena);
+        db.takeTasksToRun(resources, 1, NO_WORKER_SESSION, tasks);
+        if (tasks.empty()) { fail("Benchmark ran out of pending tasks"); }
+    }
+    timer.stop(ops);
+}
+
+
+static void benchCreateTask(BenchTimer& timer)
+{
+    std::vector<TaskCreateInfo> infos;
+    for (int i = 0; i < BENCH_OPS; ++i) {
+        infos.push_back(makeBenchTask(i, 16));
+    }
+
+    TaskDatabase db;
+    timer.start();
+    for (const auto& info : infos) {
+        db.createTask(info);
+    }
+    timer.stop(infos.size());
+}
+
+
+static void benchMarkTaskFinished(BenchTimer& timer)
+{
+    TaskDatabase db;
+    createBenchTasks(db, BENCH_OPS, 16);
+    std::vector<TaskPtr> tasks = takeAllBenchTasks(db, 16);
+
+    timer.start();
+    for (const auto& task : tasks) {
+        db.markTaskFinished(task);
+    }
+    timer.stop(tasks.size());
+}
+
+
+// Sweeps a database whose running tasks are all alive, which is what almost every sweep finds
+static void benchCleanupZombieTasks(BenchTimer& timer)
+{
+    TaskDatabase db;
+    createBenchTasks(db, BENCH_RUNNING_TASK_COUNT, 16);
+    std::vector<TaskPtr> tasks = takeAllBenchTasks(db, 16);
+
+    timer.start();
+    for (int i = 0; i < BENCH_CLEANUP_SWEEPS; ++i) {
+        db.cleanupZombieTasks(60 * 60);
+    }
+    timer.stop(BENCH_CLEANUP_SWEEPS);
+}
+
+
+// Pools BENCH_OPS distinct values (each missing from the pool), then pools them all again (each found in the pool)
+template<class Pooled, class Value>
+static void benchPooling(BenchTimer& missTimer, BenchTimer& hitTimer, const std::vector<Value>& values)
+{
+    std::vector<Pooled> pooled;
+    pooled.reserve(values.size() * 2);
+
+    missTimer.start();
+    for (const auto& value : values) {
+        pooled.push_back(Pooled(value));
+    }
+    missTimer.stop(values.size());
+
+    hitTimer.start();
+    for (const auto& value : values) {
+        pooled.push_back(Pooled(value));
+    }
+    hitTimer.stop(values.size());
+}
+
+
+static std::vector<std::string> makeBenchStrings()
+{
+    std::vector<std::string> strings;
+    for (int i = 0; i < BENCH_OPS; ++i) {
+        strings.push_back("machine-" + std::to_string(i) + ".cluster.example.com");
+    }
+    return strings;
+}
+
+
+static std::vector<std::vector<uint8_t>> makeBenchBlobs()
+{
+    std::vector<std::vector<uint8_t>> blobs;
+    for (int i = 0; i < BENCH_OPS; ++i) {
+        std::vector<uint8_t> blob(64);
+        for (size_t j = 0; j < blob.size(); ++j) {
+            blob[j] = uint8_t(i >> (j % 4 * 8)) ^ uint8_t(j);
+        }
+        blobs.push_back(std::move(blob));
+    }
+    return blobs;
+}
+
+
+template<class T>
+static void benchEncode(BenchTimer& timer, const T& value, bool compact)
+{
+    timer.start();
+    for (int i = 0; i < BENCH_OPS; ++i) {
+        BlobStreamWriter writer;
+        writer.setCompact(compact);
+        writer << value;
+    }
+    timer.stop(BENCH_OPS);
+}
+
+
+// Decodes into the same value every time, as the server does with the requests it decodes
+template<class T>
+static void benchDecode(BenchTimer& timer, const T& value, bool compact)
+{
+    BlobStreamWriter writer;
+    writer.setCompact(compact);
+    writer << value;
+
+    T decoded;
+    timer.start();
+    for (int i = 0; i < BENCH_OPS; ++i) {
+        BlobStreamReader reader(writer.data());
+        reader.setCompact(compact);
+        if (!(reader >> decoded)) { fail("Benchmark failed to decode what it encoded"); }
+    }
+    timer.stop(BENCH_OPS);
+}
+
+
+template<class T>
+static void addCodecBenchmarks(std::vector<Benchmark>& benchmarks, const std::string& typeName, const T& value)
+{
+    for (bool compact : { false, true }) {
+        std::string suffix = typeName + (compact ? "/compact" : "/fixed");
+        benchmarks.push_back({ "encode/" + suffix, [=](BenchTimer& timer) { benchEncode(timer, value, compact); } });
+        benchmarks.push_back({ "decode/" + suffix, [=](BenchTimer& timer) { benchDecode(timer, value, compact); } });
+    }
+}
+
+
+static std::vector<Benchmark> getBenchmarks()
+{
+    std::vector<Benchmark> benchmarks;
+
+    for (int pendingCount : BENCH_PENDING_TASK_COUNTS) {
+        for (int tagCardinality : BENCH_TAG_CARDINALITIES) {
+            benchmarks.push_back({
+                "takeTaskToRun/pending=" + std::to_string(pendingCount) + "/tags=" + std::to_string(tagCardinality),
+                [=](BenchTimer& timer) { benchTakeTaskToRun(timer, pendingCount, tagCardinality); }
+            });
+        }
+    }
+    benchmarks.push_back({ "createTask", benchCreateTask });
+    benchmarks.push_back({ "markTaskFinished", benchMarkTaskFinished });
+    benchmarks.push_back({ "cleanupZombieTasks/running=" + std::to_string(BENCH_RUNNING_TASK_COUNT), benchCleanupZombieTasks });
+
+    // Hits are timed on values that an untimed pass has just pooled
+    benchmarks.push_back({ "PooledString/miss", [](BenchTimer& timer) { BenchTimer hits; benchPooling<PooledString>(timer, hits, makeBenchStrings()); } });
+    benchmarks.push_back({ "PooledString/hit", [](BenchTimer& timer) { BenchTimer misses; benchPooling<PooledString>(misses, timer, makeBenchStrings()); } });
+    benchmarks.push_back({ "PooledBlob/miss", [](BenchTimer& timer) { BenchTimer hits; benchPooling<PooledBlob>(timer, hits, makeBenchBlobs()); } });
+    benchmarks.push_back({ "PooledBlob/hit", [](BenchTimer& timer) { BenchTimer misses; benchPooling<PooledBlob>(misses, timer, makeBenchBlobs()); } });
+
+    TaskCreateInfo createInfo = makeBenchTask(12345, 16);
+    createInfo.schedule.optionalResources.push_back(Symbol("gpu"));
+
+    TaskStatus status;
+    status.createTime = std::time(nullptr);
+    TaskRunStatus runStatus;
+    runStatus.wasCanceled = false;
+    runStatus.startTime = status.createTime + 5;
+    runStatus.heartbeatTime = status.createTime + 65;
+    status.runStatus = runStatus;
+
+    TaskRunInfo runInfo;
+    runInfo.id = 0x1234567890abcdefULL;
+    runInfo.command = createInfo.command;
+
+    TaskBriefInfo briefInfo;
+    briefInfo.id = runInfo.id;
+    briefInfo.status = status;
+
+    WorkerRegistryInfo registry;
+    for (int i = 0; i < 8; ++i) {
+        WorkerProfileInfo profile;
+        profile.id = i;
+        profile.resources = makeBenchResources(i + 1);
+        profile.numWorkers = 4;
+        profile.numRunningTasks = 3;
+        registry.profiles.push_back(profile);
+
+        for (int j = 0; j < profile.numWorkers; ++j) {
+            WorkerInfo worker;
+            worker.id = uint64_t(i) * 1000 + j;
+            worker.profileID = profile.id;
+            worker.machineName = PooledString("machine-" + std::to_string(worker.id));
+            worker.openTime = status.createTime;
+            worker.lastSeenTime = status.createTime + 30;
+            worker.numRunningTasks = 1;
+            registry.workers.push_back(worker);
+        }
+    }
+
+    addCodecBenchmarks(benchmarks, "TaskCreateInfo", createInfo);
+    addCodecBenchmarks(benchmarks, "TaskSchedule", createInfo.schedule);
+    addCodecBenchmarks(benchmarks, "TaskStatus", status);
+    addCodecBenchmarks(benchmarks, "TaskRunInfo", runInfo);
+    addCodecBenchmarks(benchmarks, "TaskBriefInfo", briefInfo);
+    addCodecBenchmarks(benchmarks, "WorkerRegistryInfo", registry);
+
+    return benchmarks;
+}
+
+
+int main(int argc, char* argv[])
+{
+    CommandArgs args(argc, argv);
+
+    // Checks verify behavior rather than time it, and exit with a nonzero code if it's wrong
+    std::string check = args.getOptionValue("check");
+    if (check == "handoff") {
+        return checkHandOff(parseInt(args.getOptionValue("port", std::to_string(HANDOFF_CHECK_PORT))));
+    }
+    else if (check == "allocations") {
+        return checkAllocations();
+    }
+    else if (!check.empty()) {
+        printError("Unknown check \"" + check + "\"");
+        return -1;
+    }
+
+    std::string filter = args.getOptionValue("filter");
+
+    char header[256];
+    snprintf(header, sizeof(header), "%-44s %12s %13s\n", "Benchmark", "ns/op", "allocs/op");
+    ColoredString(header, TextColor::White).print();
+
+    for (const auto& benchmark : getBenchmarks()) {
+        if (benchmark.name.find(filter) == std::string::npos) { continue; }
+
+        BenchTimer timer;
+        benchmark.run(timer);
+
+        char line[256];
+        snprintf(line, sizeof(line), "%-44s %12.1f %13.2f\n", benchmark.name.c_str(), timer.getNanosecondsPerOp(), timer.getAllocationsPerOp());
+        ColoredString(line, TextColor::LightCyan).print();
+    }
+    return 0;
+}
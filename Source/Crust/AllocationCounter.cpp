@@ -0,0 +1,51 @@
+#include "AllocationCounter.h"
+#include <cstdlib>
+#include <new>
+
+
+#ifdef KICKOFF_COUNT_ALLOCATIONS
+
+static thread_local uint64_t t_allocationCount = 0;
+
+
+void* operator new(size_t size)
+{
+    t_allocationCount++;
+    if (void* ptr = malloc(size > 0 ? size : 1)) { return ptr; }
+    throw std::bad_alloc();
+}
+
+
+void* operator new[](size_t size)
+{
+    t_allocationCount++;
+    if (void* ptr = malloc(size > 0 ? size : 1)) { return ptr; }
+    throw std::bad_alloc();
+}
+
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+
+uint64_t getThreadAllocationCount()
+{
+    return t_allocationCount;
+}
+
+#else
+
+uint64_t getThreadAllocationCount()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+#include <cstdint>
+
+
+// Building with KICKOFF_COUNT_ALLOCATIONS defined replaces the global operator new and delete with ones that count how
+// many heap allocations each thread makes. Without it, none of this costs anything.
+
+uint64_t getThreadAllocationCount(); // always 0 unless KICKOFF_COUNT_ALLOCATIONS is defined
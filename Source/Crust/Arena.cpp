@@ -0,0 +1,68 @@
+#include "Arena.h"
+#include <cstdlib>
+
+
+Arena::Arena()
+    : m_blockIndex(0)
+    , m_blockUsed(0)
+{
+}
+
+
+Arena::~Arena()
+{
+    for (const auto& block : m_blocks) {
+        free(block.data);
+    }
+}
+
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+    // Blocks come from malloc, so they're aligned for any type, and offsets within them only need aligning
+    if (m_blockIndex < m_blocks.size()) {
+        size_t offset = (m_blockUsed + alignment - 1) & ~(alignment - 1);
+        if (offset <= m_blocks[m_blockIndex].size && size <= m_blocks[m_blockIndex].size - offset) {
+            m_blockUsed = offset + size;
+            return m_blocks[m_blockIndex].data + offset;
+        }
+    }
+
+    // Move on to the next block that's large enough, skipping the rest of the current one. Blocks retained from before
+    // the last reset come first, then new ones are added.
+    size_t nextIndex = (m_blockIndex < m_blocks.size()) ? m_blockIndex + 1 : m_blocks.size();
+    while (nextIndex < m_blocks.size() && m_blocks[nextIndex].size < size) {
+        nextIndex++;
+    }
+
+    if (nextIndex == m_blocks.size()) {
+        Block block;
+        block.size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block.data = static_cast<uint8_t*>(malloc(block.size));
+        if (!block.data) { throw std::bad_alloc(); }
+        m_blocks.push_back(block);
+    }
+
+    m_blockIndex = nextIndex;
+    m_blockUsed = size;
+    return m_blocks[m_blockIndex].data;
+}
+
+
+void Arena::reset()
+{
+    // Oversized blocks were for one-off allocations, so only standard blocks are worth keeping
+    size_t retainedCount = 0;
+    for (const auto& block : m_blocks) {
+        if (block.size == ARENA_BLOCK_SIZE && retainedCount < ARENA_MAX_RETAINED_BLOCKS) {
+            m_blocks[retainedCount++] = block;
+        }
+        else {
+            free(block.data);
+        }
+    }
+    m_blocks.resize(retainedCount);
+
+    m_blockIndex = 0;
+    m_blockUsed = 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+
+// Arena memory is carved out of blocks of this size (allocations that don't fit in one get a block of their own)
+static const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+// How many blocks of ARENA_BLOCK_SIZE an arena keeps for reuse when it's reset; any more are freed
+static const size_t ARENA_MAX_RETAINED_BLOCKS = 16;
+
+
+// A monotonic allocator for short-lived temporaries: allocating just bumps a pointer through the current block, nothing
+// is freed individually, and reset() frees everything at once. Blocks are kept across resets, so code that resets an
+// arena after each unit of work (e.g. each request) stops allocating from the heap once the arena has warmed up.
+class Arena
+{
+public:
+    Arena();
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment);
+    void reset(); // everything allocated from the arena so far must no longer be in use
+
+private:
+    struct Block
+    {
+        uint8_t* data;
+        size_t size;
+    };
+
+    std::vector<Block> m_blocks;
+    size_t m_blockIndex; // the block allocations are currently carved from
+    size_t m_blockUsed; // how much of that block is taken
+};
+
+
+// Lets standard containers allocate from an arena. Freeing is a no-op, so containers that grow repeatedly leave their
+// old buffers behind until the arena is reset.
+template<class T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    ArenaAllocator(Arena& arena) : m_arena(&arena) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.getArena()) {}
+
+    T* allocate(size_t count)
+    {
+        if (count > SIZE_MAX / sizeof(T)) { throw std::bad_alloc(); }
+        return static_cast<T*>(m_arena->allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t count) {}
+
+    Arena* getArena() const { return m_arena; }
+
+    template<class U> bool operator== (const ArenaAllocator<U>& other) const { return m_arena == other.getArena(); }
+    template<class U> bool operator!= (const ArenaAllocator<U>& other) const { return m_arena != other.getArena(); }
+
+private:
+    Arena* m_arena;
+};
+
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
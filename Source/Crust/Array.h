@@ -35,7 +35,8 @@ public:
         , m_size(numElements)
     {}
 
-    ArrayView(const std::vector<T> &vec)
+    template<class Alloc>
+    ArrayView(const std::vector<T, Alloc> &vec)
     {
         m_data = vec.data();
         assert(vec.size() < (size_t)INT_MAX);
@@ -69,14 +70,14 @@ public:
     {
         std::vector<T> vec(m_size);
         memcpy(vec.data(), m_data, sizeof(T) * m_size);
-        return std::move(vec);
+        return vec;
     }
 
     ArrayView<T> subView(int start, int count) const
     {
         ArrayView sub = *this;
         sub.applySubView(start, count);
-        return std::move(sub);
+        return sub;
     }
 
     class ConstIterator
@@ -151,7 +152,7 @@ public:
     {
         MutableArrayView sub = *this;
         sub.applySubView(start, count);
-        return std::move(sub);
+        return sub;
     }
 
     void copyFrom(ArrayView<T> other)
@@ -0,0 +1,307 @@
+#pragma once
+#include <tuple>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include "BlobStream.h"
+#include "Optional.h"
+
+
+// A blob schema describes how a struct is serialized as the list of its fields, so that writing and reading it (and so
+// sizing it, with BlobStreamWriter::makeCounter) are all generated from a single declaration:
+//
+//     static auto getSchema() { return makeBlobSchema(varIntField(&Foo::id), blobField(&Foo::name), listField(&Foo::tags)); }
+//
+// The struct then gets its stream operators from writeBlobSchema and readBlobSchema. Fields are written in order, each
+// exactly as writing it to the stream by hand would. Consecutive fields that are always written at their full width
+// (plain numbers and enums, plus VarInts in non-compact streams) are packed together and copied with a single write.
+
+enum class BlobFieldEncoding
+{
+    Plain, // written with the stream operators of its type (Optionals as a presence flag, then the value if any)
+    VarInt, // see varInt()
+    DeltaVarInt, // see deltaVarInt()
+    List // a std::vector, written as a VarInt count followed by its elements
+};
+
+
+template<class S, class T, BlobFieldEncoding Encoding>
+struct BlobField
+{
+    typedef T Type;
+
+    BlobField(T S::*member) : member(member) {}
+
+    static constexpr bool isFixedSize(bool compact)
+    {
+        return (std::is_arithmetic<T>::value || std::is_enum<T>::value) &&
+            (Encoding == BlobFieldEncoding::Plain || (!compact && Encoding != BlobFieldEncoding::List));
+    }
+
+    T S::*member;
+};
+
+
+template<class S, class T> BlobField<S, T, BlobFieldEncoding::Plain> blobField(T S::*member) { return member; }
+template<class S, class T> BlobField<S, T, BlobFieldEncoding::VarInt> varIntField(T S::*member) { return member; }
+template<class S, class T> BlobField<S, T, BlobFieldEncoding::DeltaVarInt> deltaVarIntField(T S::*member) { return member; }
+template<class S, class T> BlobField<S, T, BlobFieldEncoding::List> listField(T S::*member) { return member; }
+
+template<class... Fields>
+std::tuple<Fields...> makeBlobSchema(Fields... fields) { return std::tuple<Fields...>(fields...); }
+
+
+template<class T>
+void writeBlobValue(BlobStreamWriter& writer, const T& value)
+{
+    writer << value;
+}
+
+template<class T>
+void writeBlobValue(BlobStreamWriter& writer, const Optional<T>& value)
+{
+    if (const T* valuePtr = value.ptrOrNull()) {
+        writer << true;
+        writeBlobValue(writer, *valuePtr);
+    }
+    else {
+        writer << false;
+    }
+}
+
+template<class T>
+bool readBlobValue(BlobStreamReader& reader, T& value)
+{
+    return (reader >> value);
+}
+
+template<class T>
+bool readBlobValue(BlobStreamReader& reader, Optional<T>& value)
+{
+    bool hasValue;
+    if (!(reader >> hasValue)) { return false; }
+    if (!hasValue) {
+        value = Nothing();
+        return true;
+    }
+
+    T val;
+    if (!readBlobValue(reader, val)) { return false; }
+    value = std::move(val);
+    return true;
+}
+
+
+template<BlobFieldEncoding Encoding>
+struct BlobFieldCodec
+{
+    template<class T> static void write(BlobStreamWriter& writer, const T& value) { writeBlobValue(writer, value); }
+    template<class T> static bool read(BlobStreamReader& reader, T& value) { return readBlobValue(reader, value); }
+};
+
+template<>
+struct BlobFieldCodec<BlobFieldEncoding::VarInt>
+{
+    template<class T> static void write(BlobStreamWriter& writer, const T& value) { writer << varInt(value); }
+    template<class T> static bool read(BlobStreamReader& reader, T& value) { return (reader >> varInt(value)); }
+};
+
+template<>
+struct BlobFieldCodec<BlobFieldEncoding::DeltaVarInt>
+{
+    template<class T> static void write(BlobStreamWriter& writer, const T& value) { writer << deltaVarInt(value); }
+    template<class T> static bool read(BlobStreamReader& reader, T& value) { return (reader >> deltaVarInt(value)); }
+};
+
+template<>
+struct BlobFieldCodec<BlobFieldEncoding::List>
+{
+    template<class T>
+    static void write(BlobStreamWriter& writer, const std::vector<T>& values)
+    {
+        writer << varInt(values.size());
+        for (const auto& value : values) {
+            writeBlobValue(writer, value);
+        }
+    }
+
+    template<class T>
+    static bool read(BlobStreamReader& reader, std::vector<T>& values)
+    {
+        // Every element takes at least a byte, so a corrupt count can't make this allocate more than the stream's size
+        size_t count;
+        if (!(reader >> varInt(count))) { return false; }
+        if (count > reader.getRemainingSize()) { return false; }
+
+        values.resize(count);
+        for (auto& value : values) {
+            if (!readBlobValue(reader, value)) { return false; }
+        }
+        return true;
+    }
+};
+
+
+// Stands in for the fields past the end of a schema
+struct BlobSchemaEnd
+{
+    static constexpr bool isFixedSize(bool compact) { return false; }
+};
+
+template<class Fields, size_t I, bool InSchema = (I < std::tuple_size<Fields>::value)>
+struct BlobFieldAt
+{
+    typedef typename std::tuple_element<I, Fields>::type Type;
+};
+
+template<class Fields, size_t I>
+struct BlobFieldAt<Fields, I, false>
+{
+    typedef BlobSchemaEnd Type;
+};
+
+
+// The run of fixed-size fields starting at field I (which is empty if field I isn't fixed-size)
+template<class Fields, bool Compact, size_t I, bool Fixed = BlobFieldAt<Fields, I>::Type::isFixedSize(Compact)>
+struct BlobFixedRun
+{
+    static const size_t end = I;
+    static const size_t size = 0;
+};
+
+template<class Fields, bool Compact, size_t I>
+struct BlobFixedRun<Fields, Compact, I, true>
+{
+    typedef BlobFixedRun<Fields, Compact, I + 1> Rest;
+    static const size_t end = Rest::end;
+    static const size_t size = sizeof(typename BlobFieldAt<Fields, I>::Type::Type) + Rest::size;
+};
+
+
+template<size_t I, size_t End>
+struct BlobFieldPacker
+{
+    template<class S, class Fields>
+    static void pack(uint8_t* bytes, const S& val, const Fields& fields)
+    {
+        const auto& value = val.*(std::get<I>(fields).member);
+        memcpy(bytes, &value, sizeof(value));
+        BlobFieldPacker<I + 1, End>::pack(bytes + sizeof(value), val, fields);
+    }
+
+    template<class S, class Fields>
+    static void unpack(const uint8_t* bytes, S& val, const Fields& fields)
+    {
+        auto& value = val.*(std::get<I>(fields).member);
+        memcpy(&value, bytes, sizeof(value));
+        BlobFieldPacker<I + 1, End>::unpack(bytes + sizeof(value), val, fields);
+    }
+};
+
+template<size_t End>
+struct BlobFieldPacker<End, End>
+{
+    template<class S, class Fields> static void pack(uint8_t* bytes, const S& val, const Fields& fields) {}
+    template<class S, class Fields> static void unpack(const uint8_t* bytes, S& val, const Fields& fields) {}
+};
+
+
+// Writes and reads the fields from I on: 0 once past the last field, 1 for a run of fixed-size fields, 2 for a single
+// field with a variable size
+template<bool Compact, size_t I, class Fields>
+struct BlobFieldStep
+{
+    static const int kind = (I == std::tuple_size<Fields>::value) ? 0 : (BlobFixedRun<Fields, Compact, I>::end > I ? 1 : 2);
+};
+
+template<bool Compact, size_t I, class Fields, int Kind = BlobFieldStep<Compact, I, Fields>::kind>
+struct BlobFields;
+
+template<bool Compact, size_t I, class Fields>
+struct BlobFields<Compact, I, Fields, 0>
+{
+    template<class S> static void write(BlobStreamWriter& writer, const S& val, const Fields& fields) {}
+    template<class S> static bool read(BlobStreamReader& reader, S& val, const Fields& fields) { return true; }
+};
+
+template<bool Compact, size_t I, class Fields>
+struct BlobFields<Compact, I, Fields, 1>
+{
+    typedef BlobFixedRun<Fields, Compact, I> Run;
+
+    template<class S>
+    static void write(BlobStreamWriter& writer, const S& val, const Fields& fields)
+    {
+        uint8_t bytes[Run::size];
+        BlobFieldPacker<I, Run::end>::pack(bytes, val, fields);
+        writer << ArrayView<uint8_t>(bytes, (int)Run::size);
+        BlobFields<Compact, Run::end, Fields>::write(writer, val, fields);
+    }
+
+    template<class S>
+    static bool read(BlobStreamReader& reader, S& val, const Fields& fields)
+    {
+        uint8_t bytes[Run::size];
+        if (!(reader >> MutableArrayView<uint8_t>(bytes, (int)Run::size))) { return false; }
+        BlobFieldPacker<I, Run::end>::unpack(bytes, val, fields);
+        return BlobFields<Compact, Run::end, Fields>::read(reader, val, fields);
+    }
+};
+
+template<bool Compact, size_t I, class Fields>
+struct BlobFields<Compact, I, Fields, 2>
+{
+    template<class S, class T, BlobFieldEncoding Encoding>
+    static void writeField(BlobStreamWriter& writer, const S& val, const BlobField<S, T, Encoding>& field)
+    {
+        BlobFieldCodec<Encoding>::write(writer, val.*(field.member));
+    }
+
+    template<class S, class T, BlobFieldEncoding Encoding>
+    static bool readField(BlobStreamReader& reader, S& val, const BlobField<S, T, Encoding>& field)
+    {
+        return BlobFieldCodec<Encoding>::read(reader, val.*(field.member));
+    }
+
+    template<class S>
+    static void write(BlobStreamWriter& writer, const S& val, const Fields& fields)
+    {
+        writeField(writer, val, std::get<I>(fields));
+        BlobFields<Compact, I + 1, Fields>::write(writer, val, fields);
+    }
+
+    template<class S>
+    static bool read(BlobStreamReader& reader, S& val, const Fields& fields)
+    {
+        if (!readField(reader, val, std::get<I>(fields))) { return false; }
+        return BlobFields<Compact, I + 1, Fields>::read(reader, val, fields);
+    }
+};
+
+
+template<class S>
+BlobStreamWriter& writeBlobSchema(BlobStreamWriter& writer, const S& val)
+{
+    auto fields = S::getSchema();
+    typedef decltype(fields) Fields;
+    if (writer.isCompact()) {
+        BlobFields<true, 0, Fields>::write(writer, val, fields);
+    }
+    else {
+        BlobFields<false, 0, Fields>::write(writer, val, fields);
+    }
+    return writer;
+}
+
+template<class S>
+bool readBlobSchema(BlobStreamReader& reader, S& val)
+{
+    auto fields = S::getSchema();
+    typedef decltype(fields) Fields;
+    if (reader.isCompact()) {
+        return BlobFields<true, 0, Fields>::read(reader, val, fields);
+    }
+    else {
+        return BlobFields<false, 0, Fields>::read(reader, val, fields);
+    }
+}
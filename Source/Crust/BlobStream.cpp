@@ -1,42 +1,213 @@
 #include "BlobStream.h"
 #include "Error.h"
+#include <mutex>
+
+
+// Buffers of destroyed writers are kept for new ones to reuse, up to these limits
+static const size_t BUFFER_POOL_MAX_BUFFERS = 256;
+static const size_t BUFFER_POOL_MAX_BUFFER_CAPACITY = 1024 * 1024; // larger buffers (e.g. snapshot chunks) are freed instead
+
+
+class BufferPool
+{
+public:
+    std::vector<uint8_t>* acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_buffers.empty()) {
+                auto buffer = m_buffers.back();
+                m_buffers.pop_back();
+                return buffer;
+            }
+        }
+        return new std::vector<uint8_t>();
+    }
+
+    void recycle(std::vector<uint8_t>* buffer)
+    {
+        if (buffer->capacity() <= BUFFER_POOL_MAX_BUFFER_CAPACITY) {
+            buffer->clear();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_buffers.size() < BUFFER_POOL_MAX_BUFFERS) {
+                m_buffers.push_back(buffer);
+                return;
+            }
+        }
+        delete buffer;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::vector<std::vector<uint8_t>*> m_buffers;
+};
+
+
+static BufferPool& getBufferPool()
+{
+    // Never destroyed, since zmq may still be releasing message buffers while the process exits
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+
+BlobStreamWriter::BlobStreamWriter()
+    : m_buffer(nullptr)
+    , m_countedSize(0)
+    , m_countingOnly(false)
+    , m_compact(false)
+    , m_deltaBase(0)
+{
+}
+
+
+BlobStreamWriter::BlobStreamWriter(BlobStreamWriter&& other) noexcept
+    : m_buffer(other.m_buffer)
+    , m_countedSize(other.m_countedSize)
+    , m_countingOnly(other.m_countingOnly)
+    , m_compact(other.m_compact)
+    , m_deltaBase(other.m_deltaBase)
+{
+    other.m_buffer = nullptr;
+    other.m_countedSize = 0;
+}
+
+
+BlobStreamWriter& BlobStreamWriter::operator=(BlobStreamWriter&& other) noexcept
+{
+    if (this != &other) {
+        if (m_buffer) {
+            recycleBuffer(m_buffer);
+        }
+        m_buffer = other.m_buffer;
+        m_countedSize = other.m_countedSize;
+        m_countingOnly = other.m_countingOnly;
+        m_compact = other.m_compact;
+        m_deltaBase = other.m_deltaBase;
+        other.m_buffer = nullptr;
+        other.m_countedSize = 0;
+    }
+    return *this;
+}
+
+
+BlobStreamWriter::~BlobStreamWriter()
+{
+    if (m_buffer) {
+        recycleBuffer(m_buffer);
+    }
+}
+
+
+BlobStreamWriter BlobStreamWriter::makeCounter() const
+{
+    BlobStreamWriter counter;
+    counter.m_countingOnly = true;
+    counter.m_compact = m_compact;
+    counter.m_deltaBase = m_deltaBase;
+    return counter;
+}
 
 
 void BlobStreamWriter::reserve(size_t bytes)
 {
-    m_data.reserve(bytes);
+    if (m_countingOnly) { return; }
+    if (!m_buffer) {
+        m_buffer = getBufferPool().acquire();
+    }
+    m_buffer->reserve(bytes);
 }
 
+
+size_t BlobStreamWriter::size() const
+{
+    if (m_countingOnly) { return m_countedSize; }
+    return m_buffer ? m_buffer->size() : 0;
+}
+
+
+ArrayView<uint8_t> BlobStreamWriter::data() const
+{
+    if (!m_buffer) { return ArrayView<uint8_t>(); }
+    return ArrayView<uint8_t>(*m_buffer);
+}
+
+
+std::vector<uint8_t>* BlobStreamWriter::releaseBuffer()
+{
+    auto buffer = m_buffer ? m_buffer : getBufferPool().acquire();
+    m_buffer = nullptr;
+    return buffer;
+}
+
+
+void BlobStreamWriter::recycleBuffer(std::vector<uint8_t>* buffer)
+{
+    getBufferPool().recycle(buffer);
+}
+
+
 BlobStreamWriter& BlobStreamWriter::operator<<(ArrayView<uint8_t> blob)
 {
-    if (blob.size() > 0) {
-        size_t startOffset = m_data.size();
-        size_t endOffset = startOffset + (size_t)blob.size();
+    if (m_countingOnly) {
+        m_countedSize += (size_t)blob.size();
+        return *this;
+    }
 
-        m_data.resize(endOffset);
-        if (blob.size() > 0) {
-            memcpy(&m_data[startOffset], &blob.first(), blob.size());
+    if (blob.size() > 0) {
+        if (!m_buffer) {
+            m_buffer = getBufferPool().acquire();
         }
+        m_buffer->insert(m_buffer->end(), &blob.first(), &blob.first() + blob.size());
     }
 
     return *this;
 }
 
+void BlobStreamWriter::writeVarInt(uint64_t value)
+{
+    uint8_t bytes[10];
+    int size = 0;
+    do {
+        bytes[size] = uint8_t(value & 0x7F);
+        value >>= 7;
+        if (value != 0) {
+            bytes[size] |= 0x80;
+        }
+        size++;
+    } while (value != 0);
+
+    *this << ArrayView<uint8_t>(bytes, size);
+}
+
+
+void BlobStreamWriter::writeSignedVarInt(int64_t value)
+{
+    // Zigzag encoding keeps small negative values small: 0, -1, 1, -2, 2... map to 0, 1, 2, 3, 4...
+    writeVarInt((uint64_t(value) << 1) ^ uint64_t(value >> 63));
+}
+
 BlobStreamWriter& BlobStreamWriter::operator<<(const PooledBlob& blob)
 {
-    *this << (int)blob.get().size();
+    *this << varInt((uint32_t)blob.get().size());
     return (*this << blob.get());
 }
 
 BlobStreamWriter& BlobStreamWriter::operator<<(const PooledString& blob)
 {
-    *this << (int)blob.get().size();
+    *this << varInt((uint32_t)blob.get().size());
+    return (*this << blob.getBytes());
+}
+
+BlobStreamWriter& BlobStreamWriter::operator<<(Symbol blob)
+{
+    *this << varInt(blob.getSize());
     return (*this << blob.getBytes());
 }
 
 BlobStreamWriter& BlobStreamWriter::operator<<(const std::string& blob)
 {
-    *this << (int)blob.size();
+    *this << varInt((uint32_t)blob.size());
     ArrayView<uint8_t> bytes((const uint8_t*)blob.data(), int(blob.size() * sizeof(blob[1])));
     return (*this << bytes);
 }
@@ -52,26 +223,73 @@ bool BlobStreamReader::operator>>(MutableArrayView<uint8_t> outBlob)
     return true;
 }
 
+bool BlobStreamReader::readVarInt(uint64_t& outValue)
+{
+    outValue = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (m_data.size() < 1) { return false; }
+        uint8_t byte = m_data.first();
+        m_data = m_data.subView(1, m_data.size() - 1);
+
+        outValue |= uint64_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) { return true; }
+    }
+    return false;
+}
+
+
+bool BlobStreamReader::readSignedVarInt(int64_t& outValue)
+{
+    uint64_t value;
+    if (!readVarInt(value)) { return false; }
+    outValue = int64_t(value >> 1) ^ -int64_t(value & 1);
+    return true;
+}
+
+bool BlobStreamReader::readView(ArrayView<uint8_t>& outBlob)
+{
+    // Lengths are written as unsigned, so the lengths of plain streams (written as ints) that are negative are too large
+    uint32_t size = 0;
+    if (!(*this >> varInt(size))) { return false; }
+    if (size > (uint32_t)m_data.size()) { return false; }
+
+    outBlob = m_data.subView(0, (int)size);
+    m_data = m_data.subView((int)size, m_data.size() - (int)size);
+    return true;
+}
+
 bool BlobStreamReader::operator>>(std::string& outBlob)
 {
-    std::vector<char> strVec;
-    if (!(*this >> strVec)) { return false; }
-    outBlob = std::string(strVec.data(), strVec.size());
+    ArrayView<uint8_t> bytes;
+    if (!readView(bytes)) { return false; }
+    outBlob.assign(bytes.size() > 0 ? (const char*)&bytes.first() : "", (size_t)bytes.size());
     return true;
 }
 
 bool BlobStreamReader::operator>> (PooledString& outBlob)
 {
-    std::string blobStr;
-    if (!(*this >> blobStr)) { return false; }
-    outBlob = PooledString(std::move(blobStr));
+    // Strings that are already pooled are found straight from the request bytes, without allocating anything
+    ArrayView<uint8_t> bytes;
+    if (!readView(bytes)) { return false; }
+    outBlob = PooledString(bytes);
     return true;
 }
 
 bool BlobStreamReader::operator>> (PooledBlob& outBlob)
 {
-    std::vector<uint8_t> blobVec;
-    if (!(*this >> blobVec)) { return false; }
-    outBlob = PooledBlob(std::move(blobVec));
+    ArrayView<uint8_t> bytes;
+    if (!readView(bytes)) { return false; }
+    outBlob = PooledBlob(bytes);
+    return true;
+}
+
+bool BlobStreamReader::operator>> (Symbol& outBlob)
+{
+    ArrayView<uint8_t> bytes;
+    if (!readView(bytes)) { return false; }
+    if (m_untrusted) {
+        return Symbol::tryCreate(bytes, outBlob);
+    }
+    outBlob = Symbol(bytes);
     return true;
 }
@@ -1,27 +1,67 @@
 #pragma once
 #include <cstdint>
+#include <type_traits>
 #include "Array.h"
 #include "Optional.h"
 #include "PooledString.h"
 #include "PooledBlob.h"
+#include "Symbol.h"
+
+
+// An integer that's usually small (a count, length or ID), or a timestamp close to the one written before it. Compact
+// streams write these as LEB128 varints (zigzag-encoded if signed, and relative to the previous delta-encoded value of
+// the stream if delta is set). Other streams write them as plain values, so the same serialization code handles both.
+template<class T>
+struct VarInt
+{
+    VarInt(T& value, bool delta) : value(value), delta(delta) {}
+
+    T& value;
+    bool delta;
+};
+
+template<class T> VarInt<T> varInt(T& value) { return VarInt<T>(value, false); }
+template<class T> VarInt<const T> varInt(const T& value) { return VarInt<const T>(value, false); }
+template<class T> VarInt<T> deltaVarInt(T& value) { return VarInt<T>(value, true); }
+template<class T> VarInt<const T> deltaVarInt(const T& value) { return VarInt<const T>(value, true); }
 
 
 class BlobStreamWriter
 {
 public:
+    BlobStreamWriter();
+    BlobStreamWriter(BlobStreamWriter&& other) noexcept;
+    BlobStreamWriter& operator=(BlobStreamWriter&& other) noexcept;
+    ~BlobStreamWriter();
+
+    // A writer that only counts the bytes written to it, in the same format (and state) as this one. Writing something
+    // to the counter first gives the exact size to reserve for writing it here.
+    BlobStreamWriter makeCounter() const;
+
+    // Compact streams write VarInts and blob lengths as varints (only for peers that know to read them that way)
+    void setCompact(bool compact) { m_compact = compact; }
+    bool isCompact() const { return m_compact; }
+
     void reserve(size_t bytes);
-    ArrayView<uint8_t> data() const { return ArrayView<uint8_t>(m_data); }
+    size_t size() const;
+    ArrayView<uint8_t> data() const;
+
+    // Gives up the writer's buffer (leaving the writer empty), e.g. so a zmq message can send it without copying it. The
+    // buffer comes from a pool shared by all writers, and should be handed back to it with recycleBuffer() once it's done.
+    std::vector<uint8_t>* releaseBuffer();
+    static void recycleBuffer(std::vector<uint8_t>* buffer); // thread-safe, so zmq can call it from its I/O threads
 
     BlobStreamWriter& operator<< (ArrayView<uint8_t> blob);
 
     BlobStreamWriter& operator<< (const std::string& blob);
     BlobStreamWriter& operator<< (const PooledString& blob);
     BlobStreamWriter& operator<< (const PooledBlob& blob);
+    BlobStreamWriter& operator<< (Symbol blob); // written as its text, like strings
 
     template<class T>
     BlobStreamWriter& operator<< (ArrayView<T> blob)
     {
-        ArrayView<uint8_t> bytes(&blob.first(), blob.size() * sizeof(T));
+        ArrayView<uint8_t> bytes((const uint8_t*)&blob.first(), int(blob.size() * sizeof(T)));
         return (*this << bytes);
     }
 
@@ -39,22 +79,67 @@ public:
         return (*this << blob);
     }
 
+    template<class T>
+    BlobStreamWriter& operator<< (VarInt<T> val)
+    {
+        if (!m_compact) {
+            return (*this << val.value);
+        }
+
+        typedef typename std::remove_const<T>::type Value;
+        if (val.delta) {
+            int64_t value = (int64_t)val.value;
+            writeSignedVarInt(value - m_deltaBase);
+            m_deltaBase = value;
+        }
+        else if (std::is_signed<Value>::value) {
+            writeSignedVarInt((int64_t)val.value);
+        }
+        else {
+            writeVarInt((uint64_t)val.value);
+        }
+        return *this;
+    }
+
 private:
-    std::vector<uint8_t> m_data;
+    void writeVarInt(uint64_t value);
+    void writeSignedVarInt(int64_t value);
+
+    BlobStreamWriter(const BlobStreamWriter& other) = delete;
+    BlobStreamWriter& operator=(const BlobStreamWriter& other) = delete;
+
+    std::vector<uint8_t>* m_buffer; // taken from the pool on the first write
+    size_t m_countedSize;
+    bool m_countingOnly;
+    bool m_compact;
+    int64_t m_deltaBase; // the last delta-encoded value written
 };
 
 
 class BlobStreamReader
 {
 public:
-    BlobStreamReader() {}
-    BlobStreamReader(ArrayView<uint8_t> data) : m_data(data) {}
+    BlobStreamReader() : m_compact(false), m_untrusted(false), m_deltaBase(0) {}
+    BlobStreamReader(ArrayView<uint8_t> data) : m_data(data), m_compact(false), m_untrusted(false), m_deltaBase(0) {}
+
+    // Must match how the stream was written; see BlobStreamWriter::setCompact
+    void setCompact(bool compact) { m_compact = compact; }
+    bool isCompact() const { return m_compact; }
+
+    // Streams from untrusted sources (e.g. requests) can only create so many symbols; reading one past that fails (see
+    // Symbol::tryCreate)
+    void setUntrusted(bool untrusted) { m_untrusted = untrusted; }
 
     bool operator>> (MutableArrayView<uint8_t> outBlob);
 
+    // Reads a length-prefixed blob (as strings, PooledStrings and PooledBlobs are written) without copying it. The view
+    // points into the reader's data, so it's only valid as long as that data is.
+    bool readView(ArrayView<uint8_t>& outBlob);
+
     bool operator>> (std::string& outBlob);
     bool operator>> (PooledString& outBlob);
     bool operator>> (PooledBlob& outBlob);
+    bool operator>> (Symbol& outBlob);
 
     template<class T>
     bool operator>> (std::vector<T>& outBlob)
@@ -83,8 +168,44 @@ public:
         return (*this >> bytes);
     }
 
+    template<class T>
+    bool operator>> (VarInt<T> val)
+    {
+        if (!m_compact) {
+            return (*this >> val.value);
+        }
+
+        // Values that don't fit the type they're read into mean the stream is corrupt
+        int64_t signedValue;
+        uint64_t value;
+        if (val.delta) {
+            if (!readSignedVarInt(signedValue)) { return false; }
+            signedValue += m_deltaBase;
+            m_deltaBase = signedValue;
+            val.value = (T)signedValue;
+            return (int64_t)val.value == signedValue;
+        }
+        else if (std::is_signed<T>::value) {
+            if (!readSignedVarInt(signedValue)) { return false; }
+            val.value = (T)signedValue;
+            return (int64_t)val.value == signedValue;
+        }
+        else {
+            if (!readVarInt(value)) { return false; }
+            val.value = (T)value;
+            return (uint64_t)val.value == value;
+        }
+    }
+
     bool hasMore() const { return m_data.size() > 0; }
+    size_t getRemainingSize() const { return (size_t)m_data.size(); }
 
 private:
+    bool readVarInt(uint64_t& outValue);
+    bool readSignedVarInt(int64_t& outValue);
+
     ArrayView<uint8_t> m_data;
+    bool m_compact;
+    bool m_untrusted;
+    int64_t m_deltaBase; // the last delta-encoded value read
 };
@@ -13,6 +13,12 @@ CommandArgs::CommandArgs(int argc, char* argv[])
     parse(std::move(words));
 }
 
+CommandArgs::CommandArgs(std::vector<std::string>&& words)
+    : m_popCount(0)
+{
+    parse(std::move(words));
+}
+
 void CommandArgs::parse(std::vector<std::string>&& words)
 {
     std::string optionName;
@@ -8,6 +8,7 @@ class CommandArgs
 {
 public:
     CommandArgs(int argc, char* argv[]);
+    CommandArgs(std::vector<std::string>&& words); // parses already split words, e.g. a line read from a file
 
     // Returns the value of the specified option, including possibly an empty string if the option wasn't specified
     std::string getOptionValue(const std::string& optionName, const std::string& defaultValue = "") const;
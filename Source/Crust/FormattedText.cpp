@@ -89,7 +89,7 @@ ColoredString ColoredString::operator+(const ColoredString& other) const
 {
     ColoredString copy(*this);
     copy += other;
-    return std::move(copy);
+    return copy;
 }
 
 
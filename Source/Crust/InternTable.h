@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Array.h"
+
+
+// The table is split into 2^INTERN_TABLE_SHARD_BITS independently locked shards (picked by the top bits of the hash), so
+// threads pooling values concurrently rarely contend for the same lock
+static const int INTERN_TABLE_SHARD_BITS = 4;
+
+// Every insert also checks this many slots of its shard for values nothing references anymore, and frees them. A whole
+// shard is swept over the course of (capacity / this) inserts, instead of stopping to scan it all at once.
+static const int INTERN_TABLE_SWEEP_SLOTS_PER_INSERT = 4;
+
+// The smallest number of slots a shard starts with (or shrinks back to)
+static const size_t INTERN_TABLE_MIN_SHARD_CAPACITY = 64;
+
+
+// Pools immutable values (strings, byte vectors) by content, so that equal values share a single copy. Entries are
+// found by hash but matched by content, so values whose hashes collide are still pooled separately. Each shard is an
+// open-addressing hash table with linear probing, where freed entries leave tombstones until the shard is rehashed.
+// T must be constructible from a range of bytes, and have data() and size().
+template<class T>
+class InternTable
+{
+public:
+    // Gets the pooled value with these contents (hash must be hashData() of them), adding one if there isn't one yet
+    std::shared_ptr<T> get(ArrayView<uint8_t> bytes, uint64_t hash)
+    {
+        Shard& shard = m_shards[hash >> (64 - INTERN_TABLE_SHARD_BITS)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.slots.empty()) {
+            shard.slots.resize(INTERN_TABLE_MIN_SHARD_CAPACITY);
+        }
+
+        // Probe until an empty slot, which ends the run of slots the value could be in, remembering the first slot it
+        // could be added to. Shards are never more than 3/4 full, so there always is an empty slot.
+        size_t mask = shard.slots.size() - 1;
+        size_t freeIndex = SIZE_MAX;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            Slot& slot = shard.slots[i];
+            if (slot.state == SlotState::Live) {
+                if (matches(slot, hash, bytes)) { return slot.value; }
+                continue;
+            }
+
+            if (freeIndex == SIZE_MAX) {
+                freeIndex = i;
+            }
+            if (slot.state == SlotState::Empty) { break; }
+        }
+
+        const uint8_t* first = bytes.size() > 0 ? &bytes.first() : nullptr;
+        auto value = std::make_shared<T>(first, first + bytes.size());
+
+        Slot& slot = shard.slots[freeIndex];
+        if (slot.state == SlotState::Dead) {
+            shard.numDead--;
+        }
+        slot.hash = hash;
+        slot.value = value;
+        slot.state = SlotState::Live;
+        shard.numLive++;
+
+        sweep(shard);
+        if ((shard.numLive + shard.numDead) * 4 > shard.slots.size() * 3) {
+            rehash(shard);
+        }
+        return value;
+    }
+
+private:
+    enum class SlotState : uint8_t
+    {
+        Empty, Live,
+        Dead // a freed entry, which lookups have to probe past
+    };
+
+    struct Slot
+    {
+        Slot() : hash(0), state(SlotState::Empty) {}
+
+        uint64_t hash;
+        std::shared_ptr<T> value;
+        SlotState state;
+    };
+
+    struct Shard
+    {
+        Shard() : numLive(0), numDead(0), sweepCursor(0) {}
+
+        std::mutex mutex;
+        std::vector<Slot> slots; // the capacity is always a power of 2
+        size_t numLive;
+        size_t numDead;
+        size_t sweepCursor;
+    };
+
+    static bool matches(const Slot& slot, uint64_t hash, ArrayView<uint8_t> bytes)
+    {
+        if (slot.hash != hash || slot.value->size() != (size_t)bytes.size()) { return false; }
+        return bytes.size() == 0 || memcmp(slot.value->data(), &bytes.first(), bytes.size()) == 0;
+    }
+
+    // Only the table can hand out new references to a value, so one that only the table references stays unreferenced
+    static bool isUnreferenced(const Slot& slot)
+    {
+        return slot.value.use_count() == 1;
+    }
+
+    static void sweep(Shard& shard)
+    {
+        size_t mask = shard.slots.size() - 1;
+        for (int i = 0; i < INTERN_TABLE_SWEEP_SLOTS_PER_INSERT; ++i) {
+            Slot& slot = shard.slots[shard.sweepCursor];
+            shard.sweepCursor = (shard.sweepCursor + 1) & mask;
+
+            if (slot.state == SlotState::Live && isUnreferenced(slot)) {
+                slot.value.reset();
+                slot.state = SlotState::Dead;
+                shard.numLive--;
+                shard.numDead++;
+            }
+        }
+    }
+
+    // Moves every value that's still referenced into a new set of slots that's at most half full, dropping tombstones
+    static void rehash(Shard& shard)
+    {
+        std::vector<Slot> oldSlots;
+        oldSlots.swap(shard.slots);
+
+        size_t numLive = 0;
+        for (const auto& slot : oldSlots) {
+            if (slot.state == SlotState::Live && !isUnreferenced(slot)) {
+                numLive++;
+            }
+        }
+
+        size_t capacity = INTERN_TABLE_MIN_SHARD_CAPACITY;
+        while (capacity < numLive * 2) {
+            capacity *= 2;
+        }
+
+        shard.slots.resize(capacity);
+        size_t mask = capacity - 1;
+        for (auto& oldSlot : oldSlots) {
+            if (oldSlot.state != SlotState::Live || isUnreferenced(oldSlot)) { continue; }
+
+            size_t i = oldSlot.hash & mask;
+            while (shard.slots[i].state != SlotState::Empty) {
+                i = (i + 1) & mask;
+            }
+            shard.slots[i].hash = oldSlot.hash;
+            shard.slots[i].value = std::move(oldSlot.value);
+            shard.slots[i].state = SlotState::Live;
+        }
+
+        shard.numLive = numLive;
+        shard.numDead = 0;
+        shard.sweepCursor = 0;
+    }
+
+    Shard m_shards[1 << INTERN_TABLE_SHARD_BITS];
+};
@@ -0,0 +1,75 @@
+#include "MappedFile.h"
+#include "Util.h"
+
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+MappedFile::MappedFile()
+    : m_file(nullptr)
+    , m_mapping(nullptr)
+    , m_data(nullptr)
+    , m_size(0)
+{
+}
+
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+    HANDLE file = CreateFile(stringToWstring(path).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) { return false; }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        CloseHandle(file);
+        return false;
+    }
+    m_file = file;
+    m_size = (uint64_t)fileSize.QuadPart;
+
+    // Empty files can't be mapped, but there's nothing to read from them anyway
+    if (m_size == 0) { return true; }
+
+    HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        close();
+        return false;
+    }
+    m_mapping = mapping;
+
+    m_data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+
+void MappedFile::close()
+{
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+        m_data = nullptr;
+    }
+    if (m_mapping) {
+        CloseHandle((HANDLE)m_mapping);
+        m_mapping = nullptr;
+    }
+    if (m_file) {
+        CloseHandle((HANDLE)m_file);
+        m_file = nullptr;
+    }
+    m_size = 0;
+}
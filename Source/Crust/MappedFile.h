@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+
+// A read-only memory mapping of an entire file. Pages are loaded lazily by the OS as they're touched, so even very large
+// files can be opened instantly and read sequentially without first copying them into memory.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    bool isOpen() const { return m_file != nullptr; }
+
+    const uint8_t* data() const { return m_data; } // null for empty files
+    uint64_t size() const { return m_size; }
+
+private:
+    void* m_file;
+    void* m_mapping;
+    const uint8_t* m_data;
+    uint64_t m_size;
+};
@@ -3,22 +3,73 @@
 #include <functional>
 #include <assert.h>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 struct Nothing { };
 
+// The value is constructed in place inside the Optional (only when there is one), so T doesn't need a default
+// constructor, and moving an Optional moves its value instead of copying it
 template<class T>
 class Optional
 {
 public:
     Optional() : m_hasValue(false) {}
     Optional(Nothing) : m_hasValue(false) {}
-    Optional(const T& val) : m_value(val), m_hasValue(true) {}
-    Optional(T&& val) : m_value(val), m_hasValue(true) {}
+    Optional(const T& val) : m_hasValue(false) { emplace(val); }
+    Optional(T&& val) : m_hasValue(false) { emplace(std::move(val)); }
 
-    void operator= (const Optional& other)
+    Optional(const Optional& other) : m_hasValue(false)
     {
-        m_value = other.m_value;
-        m_hasValue = other.m_hasValue;
+        if (other.m_hasValue) { emplace(other.m_value); }
+    }
+
+    Optional(Optional&& other) noexcept(std::is_nothrow_move_constructible<T>::value) : m_hasValue(false)
+    {
+        if (other.m_hasValue) { emplace(std::move(other.m_value)); }
+    }
+
+    ~Optional() { reset(); }
+
+    Optional& operator= (const Optional& other)
+    {
+        if (this == &other) { return *this; }
+        if (other.m_hasValue) { assign(other.m_value); }
+        else { reset(); }
+        return *this;
+    }
+
+    Optional& operator= (Optional&& other)
+    {
+        if (this == &other) { return *this; }
+        if (other.m_hasValue) { assign(std::move(other.m_value)); }
+        else { reset(); }
+        return *this;
+    }
+
+    Optional& operator= (Nothing)
+    {
+        reset();
+        return *this;
+    }
+
+    // Replaces the value (if any) with one constructed in place from args
+    template<class... Args>
+    T& emplace(Args&&... args)
+    {
+        reset();
+        new (&m_value) T(std::forward<Args>(args)...);
+        m_hasValue = true;
+        return m_value;
+    }
+
+    void reset()
+    {
+        if (m_hasValue) {
+            m_value.~T();
+            m_hasValue = false;
+        }
     }
 
     bool hasValue() const { return m_hasValue; }
@@ -35,12 +86,18 @@ public:
         return nullptr;
     }
 
-    T orDefault(const T& defaultVal = T()) const
+    T orDefault(const T& defaultVal = T()) const &
     {
         if (m_hasValue) { return m_value; }
         return defaultVal;
     }
 
+    T orDefault(const T& defaultVal = T()) &&
+    {
+        if (m_hasValue) { return std::move(m_value); }
+        return defaultVal;
+    }
+
     const T& refOrFail(const std::string& errorMessage) const
     {
         if (!m_hasValue) { fail(errorMessage); }
@@ -53,21 +110,36 @@ public:
         return m_value;
     }
 
-    T orFail(const std::string& errorMessage) const
+    T orFail(const std::string& errorMessage) const &
     {
         if (!m_hasValue) { fail(errorMessage); }
         return m_value;
     }
 
-    T&& moveContentsOrFail(const std::string& errorMessage)
+    // Called on a temporary (e.g. straight on a function's result), so the value is moved out rather than copied
+    T orFail(const std::string& errorMessage) &&
     {
         if (!m_hasValue) { fail(errorMessage); }
-        m_hasValue = false;
         return std::move(m_value);
     }
 
+    T moveContentsOrFail(const std::string& errorMessage)
+    {
+        if (!m_hasValue) { fail(errorMessage); }
+        T val(std::move(m_value));
+        reset();
+        return val;
+    }
+
 private:
-    T m_value;
+    template<class U>
+    void assign(U&& val)
+    {
+        if (m_hasValue) { m_value = std::forward<U>(val); }
+        else { emplace(std::forward<U>(val)); }
+    }
+
+    union { T m_value; }; // only constructed while m_hasValue is set
     bool m_hasValue;
 };
 
@@ -1,79 +1,29 @@
 #include "PooledString.h"
+#include "InternTable.h"
 #include "Util.h"
+#include <cstring>
 
 
-class StringTable
+// Function-local, so strings can be pooled while other translation units' statics are being constructed
+static InternTable<std::string>& getStringTable()
 {
-public:
-    StringTable() : m_autoCleanupCounter(0) {}
-
-    static StringTable& singleton();
-    std::pair<uint64_t, std::shared_ptr<std::string>> get(const std::string& str);
-    void cleanup();
-
-private:
-    std::map<uint64_t, std::shared_ptr<std::string>> m_trackedStrings;
-    int m_autoCleanupCounter;
-};
-
-static StringTable gSingleton;
-static const int AUTO_CLEANUP_COUNT_THRESHOLD = 100;
-
-
-StringTable& StringTable::singleton()
-{
-    return gSingleton;
+    static InternTable<std::string> table;
+    return table;
 }
 
-std::pair<uint64_t, std::shared_ptr<std::string>> StringTable::get(const std::string& str)
-{
-    std::hash<std::string> strHash;
-    uint64_t hash = strHash(str);
-    auto it = m_trackedStrings.find(hash);
-    if (it == m_trackedStrings.end()) {
-        m_autoCleanupCounter++;
-        if (m_autoCleanupCounter > AUTO_CLEANUP_COUNT_THRESHOLD) {
-            cleanup();
-        }
-
-        auto strPtr = std::make_shared<std::string>(str);
-        m_trackedStrings[hash] = strPtr;
-        return std::make_pair(hash, strPtr);
-    }
-    else {
-        return std::make_pair(hash, it->second);
-    }
-}
 
-void StringTable::cleanup()
+PooledString::PooledString(const std::string& val)
+    : PooledString(ArrayView<uint8_t>((const uint8_t*)val.data(), (int)val.size()))
 {
-    std::vector<uint64_t> deadStrings;
-
-    for (auto& entry : m_trackedStrings) {
-        auto& ptr = entry.second;
-        if (ptr.unique()) {
-            deadStrings.push_back(entry.first);
-        }
-    }
-
-    for (uint64_t hash : deadStrings) {
-        m_trackedStrings.erase(hash);
-    }
-
-    m_autoCleanupCounter = 0;
 }
 
-
-PooledString::PooledString(const std::string& val)
+PooledString::PooledString(const char* cstr)
+    : PooledString(ArrayView<uint8_t>((const uint8_t*)cstr, (int)strlen(cstr)))
 {
-    auto r = StringTable::singleton().get(val);
-    m_hash = r.first;
-    m_str = r.second;
 }
 
-PooledString::PooledString(const char* cstr)
+PooledString::PooledString(ArrayView<uint8_t> bytes)
 {
-    auto r = StringTable::singleton().get(std::string(cstr));
-    m_hash = r.first;
-    m_str = r.second;
+    m_hash = hashData(bytes);
+    m_str = getStringTable().get(bytes, m_hash);
 }
@@ -19,6 +19,7 @@ class PooledString
 public:
     PooledString(const std::string& val = "");
     PooledString(const char* cstr);
+    explicit PooledString(ArrayView<uint8_t> bytes); // only allocates if no matching string is pooled yet
 
     std::string get() { return *m_str; }
     const std::string& get() const { return *m_str; }
@@ -0,0 +1,244 @@
+#include "Symbol.h"
+#include "Error.h"
+#include "Util.h"
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+// Symbol entries are stored in fixed-size blocks that never move once allocated, so looking one up by ID doesn't need
+// the table's lock: each block is published with a release store and read with an acquire load, and a Symbol can only be
+// seen after its entry was written
+static const uint32_t SYMBOL_BLOCK_SIZE = 4096;
+static const uint32_t SYMBOL_MAX_BLOCKS = 4096;
+
+// The text of symbols is packed into chunks of this size (longer strings get a chunk of their own)
+static const size_t SYMBOL_ARENA_CHUNK_SIZE = 64 * 1024;
+
+// Symbols are only created from untrusted input while the table holds fewer than this many, with less than this much
+// text in all. That's far more tags than any cluster has, but keeps a client sending made-up tags from growing the table
+// (which is never freed) until the process runs out of memory, or of symbol IDs. Once the limit is reached, new strings
+// from untrusted input are refused until the process restarts, which is logged the first time it happens.
+static const uint32_t SYMBOL_MAX_UNTRUSTED_COUNT = 64 * 1024;
+static const size_t SYMBOL_MAX_UNTRUSTED_BYTES = 16 * 1024 * 1024;
+
+
+class SymbolTable
+{
+public:
+    SymbolTable();
+    ~SymbolTable();
+
+    enum class Lookup { Create, CreateUntrusted, Find };
+    bool get(ArrayView<uint8_t> bytes, Lookup lookup, uint32_t& outID); // false if the symbol doesn't exist and wasn't created
+
+    struct Entry
+    {
+        const char* chars;
+        uint32_t size;
+        uint64_t hash;
+    };
+
+    const Entry& getEntry(uint32_t id) const
+    {
+        return m_blocks[id / SYMBOL_BLOCK_SIZE].load(std::memory_order_acquire)[id % SYMBOL_BLOCK_SIZE];
+    }
+    size_t getCount();
+
+private:
+    const char* storeChars(ArrayView<uint8_t> bytes);
+    void growIndex();
+
+    std::mutex m_mutex;
+    std::atomic<Entry*> m_blocks[SYMBOL_MAX_BLOCKS]; // owned by the table
+    uint32_t m_count;
+    size_t m_textBytes; // of every symbol's text
+    bool m_reachedUntrustedLimit;
+    std::vector<std::unique_ptr<char[]>> m_arena;
+    char* m_chunk; // the arena chunk strings are currently added to
+    size_t m_chunkUsed;
+    std::vector<uint32_t> m_index; // open-addressing hash index of symbol IDs plus one (0 marks an empty slot)
+};
+
+
+SymbolTable::SymbolTable()
+    : m_count(0)
+    , m_textBytes(0)
+    , m_reachedUntrustedLimit(false)
+    , m_chunk(nullptr)
+    , m_chunkUsed(0)
+{
+    for (auto& block : m_blocks) {
+        block.store(nullptr, std::memory_order_relaxed);
+    }
+    m_index.resize(1024);
+    uint32_t emptyID;
+    get(ArrayView<uint8_t>(), Lookup::Create, emptyID); // makes the empty string symbol 0
+}
+
+
+SymbolTable::~SymbolTable()
+{
+    for (auto& block : m_blocks) {
+        delete[] block.load(std::memory_order_relaxed);
+    }
+}
+
+
+bool SymbolTable::get(ArrayView<uint8_t> bytes, Lookup lookup, uint32_t& outID)
+{
+    uint64_t hash = hashData(bytes);
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    size_t mask = m_index.size() - 1;
+    size_t i = hash & mask;
+    for (; m_index[i] != 0; i = (i + 1) & mask) {
+        const Entry& entry = getEntry(m_index[i] - 1);
+        if (entry.hash == hash && entry.size == (uint32_t)bytes.size() &&
+            (bytes.size() == 0 || memcmp(entry.chars, &bytes.first(), bytes.size()) == 0)) {
+            outID = m_index[i] - 1;
+            return true;
+        }
+    }
+
+    if (lookup == Lookup::Find) { return false; }
+    if (lookup == Lookup::CreateUntrusted &&
+        (m_count >= SYMBOL_MAX_UNTRUSTED_COUNT || m_textBytes + (size_t)bytes.size() > SYMBOL_MAX_UNTRUSTED_BYTES)) {
+        if (!m_reachedUntrustedLimit) {
+            m_reachedUntrustedLimit = true;
+            printWarning("The symbol table reached its limit for untrusted input (" + std::to_string(m_count) + " symbols, " +
+                std::to_string(m_textBytes) + " bytes); new strings from it, like resource tags, are refused until restart.");
+        }
+        return false;
+    }
+
+    uint32_t id = m_count;
+    uint32_t block = id / SYMBOL_BLOCK_SIZE;
+    if (block >= SYMBOL_MAX_BLOCKS) {
+        fail("Too many distinct symbols (" + std::to_string(id) + ") were created.");
+    }
+    Entry* entries = m_blocks[block].load(std::memory_order_relaxed);
+    if (!entries) {
+        entries = new Entry[SYMBOL_BLOCK_SIZE];
+        m_blocks[block].store(entries, std::memory_order_release);
+    }
+
+    Entry& entry = entries[id % SYMBOL_BLOCK_SIZE];
+    entry.chars = storeChars(bytes);
+    entry.size = (uint32_t)bytes.size();
+    entry.hash = hash;
+    m_count++;
+    m_textBytes += (size_t)bytes.size();
+
+    m_index[i] = id + 1;
+    if (m_count * 2 > m_index.size()) {
+        growIndex();
+    }
+    outID = id;
+    return true;
+}
+
+
+size_t SymbolTable::getCount()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_count;
+}
+
+
+const char* SymbolTable::storeChars(ArrayView<uint8_t> bytes)
+{
+    size_t size = (size_t)bytes.size();
+    if (size == 0) { return ""; }
+
+    char* chars;
+    if (size > SYMBOL_ARENA_CHUNK_SIZE / 4) {
+        // Long strings get a chunk of their own, so they don't waste the rest of the current one
+        m_arena.emplace_back(new char[size]);
+        chars = m_arena.back().get();
+    }
+    else {
+        if (!m_chunk || m_chunkUsed + size > SYMBOL_ARENA_CHUNK_SIZE) {
+            m_arena.emplace_back(new char[SYMBOL_ARENA_CHUNK_SIZE]);
+            m_chunk = m_arena.back().get();
+            m_chunkUsed = 0;
+        }
+        chars = m_chunk + m_chunkUsed;
+        m_chunkUsed += size;
+    }
+
+    memcpy(chars, &bytes.first(), size);
+    return chars;
+}
+
+
+void SymbolTable::growIndex()
+{
+    std::vector<uint32_t> index(m_index.size() * 2, 0);
+    size_t mask = index.size() - 1;
+    for (uint32_t id = 0; id < m_count; ++id) {
+        size_t i = getEntry(id).hash & mask;
+        while (index[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        index[i] = id + 1;
+    }
+    m_index.swap(index);
+}
+
+
+// Function-local, so symbols can be created while other translation units' statics are being constructed
+static SymbolTable& getSymbolTable()
+{
+    static SymbolTable table;
+    return table;
+}
+
+
+Symbol::Symbol(const std::string& val)
+    : Symbol(ArrayView<uint8_t>((const uint8_t*)val.data(), (int)val.size()))
+{
+}
+
+Symbol::Symbol(const char* cstr)
+    : Symbol(ArrayView<uint8_t>((const uint8_t*)cstr, (int)strlen(cstr)))
+{
+}
+
+Symbol::Symbol(ArrayView<uint8_t> bytes)
+    : m_id(0)
+{
+    getSymbolTable().get(bytes, SymbolTable::Lookup::Create, m_id);
+}
+
+const char* Symbol::getChars() const
+{
+    return getSymbolTable().getEntry(m_id).chars;
+}
+
+uint32_t Symbol::getSize() const
+{
+    return getSymbolTable().getEntry(m_id).size;
+}
+
+uint64_t Symbol::getHash() const
+{
+    return getSymbolTable().getEntry(m_id).hash;
+}
+
+size_t Symbol::getSymbolCount()
+{
+    return getSymbolTable().getCount();
+}
+
+bool Symbol::find(ArrayView<uint8_t> bytes, Symbol& outSymbol)
+{
+    return getSymbolTable().get(bytes, SymbolTable::Lookup::Find, outSymbol.m_id);
+}
+
+bool Symbol::tryCreate(ArrayView<uint8_t> bytes, Symbol& outSymbol)
+{
+    return getSymbolTable().get(bytes, SymbolTable::Lookup::CreateUntrusted, outSymbol.m_id);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include "Array.h"
+
+
+// A Symbol is a 4-byte ID for a string in a process-wide, append-only symbol table. Copying one is copying an integer,
+// and comparing or hashing one is constant time (equal symbols have equal IDs), with no reference counting at all.
+//
+// The flip side is that symbols are never freed: every distinct string ever made into a Symbol is kept until the process
+// exits. So they're meant for small vocabularies that are matched often, like resource tags, and not for values that keep
+// changing, like commands (which are PooledStrings, freed once unused). IDs are only meaningful within one process, so
+// anything persisted or sent stores a symbol's text (which is how Symbols are serialized), and a restarted server, such
+// as one that took over from another, starts with a table holding only the symbols still in use.
+class Symbol
+{
+public:
+    Symbol() : m_id(0) {} // the empty string
+    Symbol(const std::string& val);
+    Symbol(const char* cstr);
+    explicit Symbol(ArrayView<uint8_t> bytes); // only allocates if the string isn't a symbol yet
+
+    std::string get() const { return std::string(getChars(), getSize()); }
+    ArrayView<uint8_t> getBytes() const { return ArrayView<uint8_t>((const uint8_t*)getChars(), (int)getSize()); }
+    const char* getChars() const; // not null-terminated
+    uint32_t getSize() const;
+
+    uint32_t getID() const { return m_id; }
+    uint64_t getHash() const; // the hash of the symbol's text, the same across processes
+
+    // Symbols are ordered by ID, i.e. in the order they were first created, not alphabetically
+    bool operator< (const Symbol& other) const { return m_id < other.m_id; }
+    bool operator== (const Symbol& other) const { return m_id == other.m_id; }
+    bool operator!= (const Symbol& other) const { return m_id != other.m_id; }
+
+    static size_t getSymbolCount(); // how many distinct symbols the process has created
+
+    // For strings from untrusted input, which would otherwise grow the table without bound. find() only looks a string
+    // up (one that isn't a symbol yet can't match anything). tryCreate() creates it if need be, unless the table has
+    // already reached its limit for untrusted symbols (see Symbol.cpp). Both return false rather than create it. The limit
+    // is process-wide and symbols are never freed, so once it's reached, tryCreate() only returns existing symbols.
+    static bool find(ArrayView<uint8_t> bytes, Symbol& outSymbol);
+    static bool tryCreate(ArrayView<uint8_t> bytes, Symbol& outSymbol);
+
+private:
+    uint32_t m_id;
+};
+
+namespace std {
+    template <> struct hash<Symbol>
+    {
+        size_t operator()(const Symbol& x) const { return (size_t)x.getHash(); }
+    };
+}
@@ -7,6 +7,7 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
 #define _NO_OLDNAMES
 #endif
 
@@ -62,7 +63,7 @@ std::vector<std::string> splitString(const std::string& str, const std::string&
         word = "";
     }
 
-    return std::move(words);
+    return words;
 }
 
 Optional<uint64_t> hexStringToUint64(const std::string& str)
@@ -94,7 +95,7 @@ Optional<uint64_t> hexStringToUint64(const std::string& str)
 
 uint64_t hashData(ArrayView<uint8_t> data)
 {
-    return MurmurHash64A(&data.first(), data.size(), 123);
+    return MurmurHash64A(data.size() > 0 ? &data.first() : nullptr, data.size(), 123);
 }
 
 Optional<std::vector<uint8_t>> readFileData(const std::string& filename)
@@ -133,6 +134,51 @@ bool writeFileData(ArrayView<uint8_t> data, const std::string& filename)
     return true;
 }
 
+bool fileExists(const std::string& filePath)
+{
+    return GetFileAttributes(stringToWstring(filePath).c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+Optional<uint64_t> getFileSize(const std::string& filePath)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesEx(stringToWstring(filePath).c_str(), GetFileExInfoStandard, &attributes)) {
+        return Nothing();
+    }
+    return (uint64_t(attributes.nFileSizeHigh) << 32) | uint64_t(attributes.nFileSizeLow);
+}
+
+bool flushFileToDisk(FILE* file)
+{
+    if (fflush(file) != 0) { return false; }
+    return _commit(_fileno(file)) == 0;
+}
+
+bool truncateFile(FILE* file, uint64_t size)
+{
+    if (fflush(file) != 0) { return false; }
+    return _chsize_s(_fileno(file), (__int64)size) == 0;
+}
+
+FILE* openTemporaryFile(const std::string& filePath)
+{
+    HANDLE handle = CreateFileA(filePath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) { return nullptr; }
+
+    int fd = _open_osfhandle((intptr_t)handle, 0);
+    if (fd == -1) {
+        CloseHandle(handle);
+        return nullptr;
+    }
+
+    FILE* file = _fdopen(fd, "w+b");
+    if (!file) {
+        _close(fd);
+    }
+    return file;
+}
+
 std::string getFileExtension(const std::string& path)
 {
     for (int i = (int)path.size() - 1; i >= 0; --i) {
@@ -170,6 +216,16 @@ std::string getMachineName()
     return "";
 }
 
+double getThreadCPUSeconds()
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime)) { return 0.0; }
+
+    // FILETIMEs count 100ns intervals
+    auto toSeconds = [](const FILETIME& time) { return double((uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime) * 1e-7; };
+    return toSeconds(kernelTime) + toSeconds(userTime);
+}
+
 bool makeDirectory(const std::string& dirPath)
 {
     return CreateDirectory(stringToWstring(dirPath).c_str(), NULL) == TRUE;
@@ -200,3 +256,9 @@ bool deleteFile(const std::string& filePath)
 {
     return DeleteFile(stringToWstring(filePath).c_str()) == TRUE;
 }
+
+bool renameFile(const std::string& fromPath, const std::string& toPath)
+{
+    DWORD flags = MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH;
+    return MoveFileEx(stringToWstring(fromPath).c_str(), stringToWstring(toPath).c_str(), flags) == TRUE;
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <cstdint>
+#include <cstdio>
 #include "Array.h"
 #include "Optional.h"
 
@@ -21,16 +22,23 @@ uint64_t hashData(ArrayView<uint8_t> data);
 
 Optional<std::vector<uint8_t>> readFileData(const std::string& filename);
 bool writeFileData(ArrayView<uint8_t> data, const std::string& filename);
+bool fileExists(const std::string& filePath);
+Optional<uint64_t> getFileSize(const std::string& filePath);
+bool flushFileToDisk(FILE* file); // flushes stdio buffers, then waits until the OS has written the file to disk
+bool truncateFile(FILE* file, uint64_t size);
+FILE* openTemporaryFile(const std::string& filePath); // creates (or replaces) a file that's deleted once closed, even by a crash
 
 std::string getFileExtension(const std::string& path);
 
 int parseInt(const std::string& str);
 
 std::string getMachineName();
+double getThreadCPUSeconds(); // the user and kernel time the calling thread has used so far
 
 bool makeDirectory(const std::string& dirPath);
 bool deleteDirectory(const std::string& dirPath, bool recursive = false);
 bool deleteFile(const std::string& filePath);
+bool renameFile(const std::string& fromPath, const std::string& toPath); // atomically replaces toPath if it exists
 
 template<class T>
 T clamp(const T& val, const T& min, const T& max)
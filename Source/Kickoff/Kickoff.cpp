@@ -50,15 +50,48 @@ static TextContainer::Ptr helpMessage()
         "new <command to execute> [args] -server <database address>\n"
         "  -require <required resource tags separated by space or comma>\n"
         "  -want <optional resource tags separated by space or comma>\n");
+    *doc += usageMessage(
+        "new -batch <file, or - for stdin> -server <database address>\n"
+        "  Creates one task per line of the file; each line is formatted like the arguments of a single \"new\" command:\n"
+        "  <command to execute> [args] [-require <tags>] [-want <tags>]\n");
     *doc += usageMessage("wait <task id> [id 2] [...] -server <database address>");
     *doc += usageMessage("cancel <task id> -server <database address");
     *doc += usageMessage("info <task id> -server <database address>");
     *doc += usageMessage("list -server <database address>");
     *doc += usageMessage("stats -server <database address>");
-    *doc += usageMessage("worker -server <database address> [-have <resource tags>]");
-    *doc += usageMessage("server [-port <portnum>]");
+    *doc += usageMessage("workers -server <database address>");
+    *doc += usageMessage("worker -server <database address> [-have <resource tags>] [-slots <concurrent tasks>]");
+    *doc += usageMessage(
+        "server [-port <portnum>] [-data <directory>] [-memory-tasks <count>] [-follow <primary server address>] [-takeover]\n"
+        "  [-trace <file>]\n"
+        "  -data <directory to persist tasks in, so they survive server restarts>\n"
+        "  -memory-tasks <most pending tasks to keep in memory; the rest wait on disk in the data directory>\n"
+        "  -follow <run as a hot standby that mirrors the given primary server, until promoted>\n"
+        "  -takeover: replace the server already running on this machine and port (e.g. after upgrading Kickoff), taking\n"
+        "    over its tasks and data directory without interrupting clients\n"
+        "  -trace <file to record every request into, for the replay command>\n");
+    *doc += usageMessage("promote -server <standby server address>");
+    *doc += usageMessage(
+        "bench [-server <address>] [-port <portnum>] [-submitters <count>] [-workers <count>] [-slots <tasks per worker>]\n"
+        "  [-tasks <count>] [-batch <tasks per request>] [-rate <tasks per second>] [-tags <count>] [-tag-skew <exponent>]\n"
+        "  [-worker-tags <count>] [-duration <ms, or min-max ms>]\n"
+        "  Load tests a server with simulated submitters and workers running no-op tasks, then reports throughput and\n"
+        "  create-to-start latency. Without -server, it runs its own server on -port and also reports its CPU per request.\n"
+        "  -tag-skew <0 spreads tasks evenly over the tags; higher values make the first tags more popular>\n");
+    *doc += usageMessage(
+        "simulate [-pools <count>:<tags>,...] [-tasks <tasks per second>:<required tags>:<mean seconds>,...]\n"
+        "  [-slots <tasks per worker>] [-hours <simulated hours>] [-diurnal <amplitude>] [-starved <seconds>] [-seed <number>]\n"
+        "  Simulates a cluster scheduled by a real task database on a virtual clock, then reports each worker pool's\n"
+        "  utilization, and queue wait percentiles and starved tasks for each set of required tags. Tags are joined by '+'.\n"
+        "  By default, 10000 workers run a day of work a little beyond what their GPU and Windows workers keep up with.\n"
+        "  -diurnal <0 keeps task arrival rates steady; up to 1, they swing by that fraction over each simulated day>\n"
+        "  -starved <tasks waiting at least this long to start count as starved>\n");
+    *doc += usageMessage(
+        "replay <trace file> [-paced]\n"
+        "  Replays the requests recorded by a server's -trace into a fresh in-memory server, and reports how long each type\n"
+        "  of request took. Without -paced, requests are handled back to back rather than at their recorded times.\n");
 
-    return std::move(doc);
+    return doc;
 }
 
 
@@ -69,14 +102,74 @@ std::vector<std::string> parseResourceTags(const std::string& listStr)
 }
 
 
-std::vector<PooledString> toPooledStrings(std::vector<std::string>&& strings)
+std::vector<Symbol> toSymbols(const std::vector<std::string>& strings)
 {
-    std::vector<PooledString> pooledStrings;
-    for (auto& str : strings) {
-        pooledStrings.push_back(str);
+    return std::vector<Symbol>(strings.begin(), strings.end());
+}
+
+
+TaskCreateInfo parseTaskCreateInfo(CommandArgs& args)
+{
+    std::string command = args.popUnnamedArg();
+    while (args.getUnnamedArgCount() > 0) {
+        if (command != "") { command += " "; }
+        command += args.popUnnamedArg();
     }
 
-    return std::move(pooledStrings);
+    TaskCreateInfo info;
+    info.schedule.requiredResources = toSymbols(parseResourceTags(args.getOptionValue("require")));
+    info.schedule.optionalResources = toSymbols(parseResourceTags(args.getOptionValue("want")));
+    info.command = command;
+    return info;
+}
+
+
+// Creates one task per (non-empty) line of the stream, sending them to the server in large batches. Every line is
+// parsed before anything is sent, so a bad line creates no tasks at all. Each created task's ID is printed on its own
+// line of stdout, in the same order as the lines of the stream; everything else is printed to stderr.
+int createTaskBatch(TaskClient& client, std::istream& stream)
+{
+    std::vector<TaskCreateInfo> infos;
+    int badLineCount = 0;
+
+    std::string line;
+    for (int lineNumber = 1; std::getline(stream, line); ++lineNumber) {
+        auto words = splitString(line, " \t\r", false);
+        if (words.empty() || words[0][0] == '#') { continue; }
+
+        CommandArgs lineArgs(std::move(words));
+        if (lineArgs.getUnnamedArgCount() == 0) {
+            fprintf(stderr, "Line %d has no command to execute: %s\n", lineNumber, line.c_str());
+            badLineCount++;
+            continue;
+        }
+        infos.push_back(parseTaskCreateInfo(lineArgs));
+    }
+
+    if (badLineCount > 0) {
+        fprintf(stderr, "No tasks were created, since %d line(s) are invalid.\n", badLineCount);
+        return -1;
+    }
+
+    size_t createdCount = 0;
+    while (createdCount < infos.size()) {
+        int count = (int)std::min(infos.size() - createdCount, (size_t)MAX_TASKS_CREATED_PER_REQUEST);
+        auto result = client.createTasks(ArrayView<TaskCreateInfo>(&infos[createdCount], count));
+        const auto* ids = result.ptrOrNull();
+        if (!ids) {
+            fprintf(stderr, "Failed to create tasks; only the first %s were created (their IDs are printed above).\n",
+                std::to_string(createdCount).c_str());
+            return -1;
+        }
+
+        for (TaskID id : *ids) {
+            printf("%s\n", toHexString(id).c_str());
+        }
+        createdCount += count;
+    }
+
+    fprintf(stderr, "Success! Created %s tasks.\n", std::to_string(createdCount).c_str());
+    return 0;
 }
 
 
@@ -142,16 +235,20 @@ int main(int argc, char* argv[])
         auto address = parseConnectionString(args.expectOptionValue("server"), DEFAULT_TASK_SERVER_PORT);
         TaskClient client(address.ip, address.port);
 
-        std::string command = args.popUnnamedArg();
-        while (args.getUnnamedArgCount() > 0) {
-            if (command != "") { command += " "; }
-            command += args.popUnnamedArg();
+        std::string batchPath = args.getOptionValue("batch");
+        if (batchPath == "-") {
+            return createTaskBatch(client, std::cin);
+        }
+        else if (batchPath != "") {
+            std::ifstream batchFile(batchPath);
+            if (!batchFile) {
+                printError("Failed to open task batch file: \"" + batchPath + "\"");
+                return -1;
+            }
+            return createTaskBatch(client, batchFile);
         }
 
-        TaskCreateInfo info;
-        info.schedule.requiredResources = toPooledStrings(parseResourceTags(args.getOptionValue("require")));
-        info.schedule.optionalResources = toPooledStrings(parseResourceTags(args.getOptionValue("want")));
-        info.command = command;
+        TaskCreateInfo info = parseTaskCreateInfo(args);
 
         ColoredString("Creating task\n", TextColor::Cyan).print();
         auto result = client.createTask(info);
@@ -278,13 +375,148 @@ int main(int argc, char* argv[])
         (ColoredString(std::to_string(stats.numRunning), TextColor::LightGreen) + ColoredString(" tasks running\n", TextColor::Green)).print();
         (ColoredString(std::to_string(stats.numCanceling), TextColor::LightRed) + ColoredString(" tasks canceling\n", TextColor::Red)).print();
         (ColoredString(std::to_string(stats.numFinished), TextColor::LightMagenta) + ColoredString(" tasks finished.\n", TextColor::Magenta)).print();
+        (ColoredString(std::to_string(stats.numWorkers), TextColor::LightYellow) + ColoredString(" workers connected.\n", TextColor::Yellow)).print();
+    }
+    else if (command == "workers") {
+        auto address = parseConnectionString(args.expectOptionValue("server"), DEFAULT_TASK_SERVER_PORT);
+
+        TaskClient client(address.ip, address.port);
+        auto optWorkers = client.getWorkers();
+        const auto& workers = optWorkers.refOrFail("Failed to retrieve the worker registry. Server may not be responding.");
+
+        TextHeader::make("Worker Profiles")->print();
+        for (const auto& profile : workers.profiles) {
+            std::string resourcesStr;
+            for (const auto& resource : profile.resources) {
+                if (!resourcesStr.empty()) { resourcesStr += ", "; }
+                resourcesStr += resource.get();
+            }
+            if (resourcesStr.empty()) { resourcesStr = "[None]"; }
+
+            (ColoredString("Profile " + std::to_string(profile.id), TextColor::LightCyan) +
+                ColoredString(": " + std::to_string(profile.numWorkers) + " workers, " + std::to_string(profile.numRunningTasks) + " tasks running; resources: ", TextColor::Cyan) +
+                ColoredString(resourcesStr + "\n", TextColor::LightCyan)).print();
+        }
+        if (workers.profiles.empty()) {
+            ColoredString("No workers.\n", TextColor::LightCyan).print();
+        }
+
+        TextHeader::make("Workers")->print();
+        std::time_t nowTime = std::time(nullptr);
+        for (const auto& worker : workers.workers) {
+            (ColoredString(toHexString(worker.id), TextColor::LightGreen) +
+                ColoredString(": " + worker.machineName.get() + " (profile " + std::to_string(worker.profileID) + "); " +
+                    std::to_string(worker.numRunningTasks) + " tasks running; connected " + intervalToString(nowTime - worker.openTime) +
+                    "; last seen " + intervalToString(nowTime - worker.lastSeenTime) + " ago\n", TextColor::Green)).print();
+        }
+    }
+    else if (command == "promote") {
+        auto address = parseConnectionString(args.expectOptionValue("server"), DEFAULT_TASK_SERVER_PORT);
+
+        TaskClient client(address.ip, address.port);
+        if (!client.promoteToPrimary()) {
+            printError("Failed to promote the server; it must be a standby that has synced with its primary.");
+            return -1;
+        }
+        ColoredString("The server is now the primary.\n", TextColor::LightGreen).print();
+    }
+    else if (command == "bench") {
+        TaskBenchConfig config;
+        config.numSubmitters = parseInt(args.getOptionValue("submitters", std::to_string(config.numSubmitters)));
+        config.numWorkers = parseInt(args.getOptionValue("workers", std::to_string(config.numWorkers)));
+        config.slotsPerWorker = parseInt(args.getOptionValue("slots", std::to_string(config.slotsPerWorker)));
+        config.numTasks = parseInt(args.getOptionValue("tasks", std::to_string(config.numTasks)));
+        config.batchSize = parseInt(args.getOptionValue("batch", std::to_string(config.batchSize)));
+        config.tasksPerSecond = parseInt(args.getOptionValue("rate", "0"));
+        config.numTags = parseInt(args.getOptionValue("tags", std::to_string(config.numTags)));
+        config.tagSkew = atof(args.getOptionValue("tag-skew", "0").c_str());
+        config.tagsPerWorker = parseInt(args.getOptionValue("worker-tags", std::to_string(config.tagsPerWorker)));
+
+        auto durations = splitString(args.getOptionValue("duration", "0"), "-", false);
+        if (durations.size() == 1 || durations.size() == 2) {
+            config.minDurationMS = parseInt(durations.front());
+            config.maxDurationMS = parseInt(durations.back());
+        }
+
+        if (config.numSubmitters < 1 || config.numWorkers < 1 || config.slotsPerWorker < 1 ||
+            config.slotsPerWorker > MAX_TASKS_TAKEN_PER_REQUEST || config.numTasks < 1 ||
+            config.batchSize < 1 || config.batchSize > MAX_TASKS_CREATED_PER_REQUEST || config.tasksPerSecond < 0 ||
+            config.numTags < 1 || config.tagSkew < 0.0 || config.tagsPerWorker < 1 || config.tagsPerWorker > config.numTags ||
+            durations.empty() || durations.size() > 2 || config.minDurationMS < 0 || config.maxDurationMS < config.minDurationMS) {
+            printError("Invalid bench options.");
+            return -1;
+        }
+        if (config.numWorkers * config.tagsPerWorker < config.numTags) {
+            printError("Every tag must be given to some worker (i.e. -workers times -worker-tags must be at least -tags).");
+            return -1;
+        }
+
+        TaskBench bench(config);
+        std::string serverStr = args.getOptionValue("server");
+        if (!serverStr.empty()) {
+            auto address = parseConnectionString(serverStr, DEFAULT_TASK_SERVER_PORT);
+            bench.run(address.ip, address.port, false);
+        }
+        else {
+            int port = parseInt(args.getOptionValue("port", std::to_string(DEFAULT_TASK_SERVER_PORT)));
+            if (port == 0) {
+                printError("Invalid port number.");
+                return -1;
+            }
+            bench.run("127.0.0.1", port, true);
+        }
+        return 0;
+    }
+    else if (command == "simulate") {
+        TaskSimulatorConfig config;
+        std::string poolsStr = args.getOptionValue("pools");
+        if (!poolsStr.empty() && !config.parseWorkerPools(poolsStr)) {
+            printError("Invalid worker pools; expected <count>:<tag>+<tag>,...");
+            return -1;
+        }
+        std::string tasksStr = args.getOptionValue("tasks");
+        if (!tasksStr.empty() && !config.parseTaskClasses(tasksStr)) {
+            printError("Invalid tasks; expected <tasks per second>:<tag>+<tag>:<mean seconds>,...");
+            return -1;
+        }
+        config.slotsPerWorker = parseInt(args.getOptionValue("slots", std::to_string(config.slotsPerWorker)));
+        config.simulatedSeconds = atof(args.getOptionValue("hours", "24").c_str()) * 60.0 * 60.0;
+        config.diurnalAmplitude = atof(args.getOptionValue("diurnal", std::to_string(config.diurnalAmplitude)).c_str());
+        config.starvationSeconds = atof(args.getOptionValue("starved", std::to_string(config.starvationSeconds)).c_str());
+        config.seed = (uint64_t)parseInt(args.getOptionValue("seed", std::to_string(config.seed)));
+
+        if (config.slotsPerWorker < 1 || !(config.simulatedSeconds > 0.0) || config.diurnalAmplitude < 0.0 ||
+            config.diurnalAmplitude > 1.0 || !(config.starvationSeconds > 0.0)) {
+            printError("Invalid simulation options.");
+            return -1;
+        }
+
+        TaskSimulator simulator(config);
+        simulator.run();
+        return 0;
+    }
+    else if (command == "replay") {
+        if (args.getUnnamedArgCount() != 1) {
+            printError("Expected the path of a request trace to replay.");
+            return -1;
+        }
+
+        TaskReplay replay(args.hasSwitchEnabled("paced"));
+        replay.run(args.popUnnamedArg());
+        return 0;
     }
     else if (command == "worker") {
         auto address = parseConnectionString(args.expectOptionValue("server"), DEFAULT_TASK_SERVER_PORT);
         auto affinities = parseResourceTags(args.getOptionValue("have"));
+        int numSlots = parseInt(args.getOptionValue("slots", "1"));
+        if (numSlots < 1 || numSlots > MAX_TASKS_TAKEN_PER_REQUEST) {
+            // A worker reports every task it finished in one request, which the server caps at this many
+            printError("Invalid number of worker slots (must be between 1 and " + std::to_string(MAX_TASKS_TAKEN_PER_REQUEST) + ").");
+            return -1;
+        }
 
         TaskClient client(address.ip, address.port);
-        TaskWorker worker(std::move(client), std::move(affinities));
+        TaskWorker worker(client, std::move(affinities), numSlots);
 
         gWorkerForInterruptHandler = &worker;
         signal(SIGINT, interruptHandler);
@@ -302,7 +534,29 @@ int main(int argc, char* argv[])
             return -1;
         }
 
-        TaskServer server(port);
+        std::string dataDir = args.getOptionValue("data");
+        TaskServer server(port, dataDir);
+        std::string memoryTasksStr = args.getOptionValue("memory-tasks");
+        if (!memoryTasksStr.empty()) {
+            int memoryTasks = parseInt(memoryTasksStr);
+            if (memoryTasks <= 0 || dataDir.empty()) {
+                printError("-memory-tasks must be a positive number of tasks, and requires a -data directory.");
+                return -1;
+            }
+            server.setMaxResidentPendingTasks((size_t)memoryTasks);
+        }
+        std::string primaryStr = args.getOptionValue("follow");
+        if (!primaryStr.empty()) {
+            auto primaryAddress = parseConnectionString(primaryStr, DEFAULT_TASK_SERVER_PORT);
+            server.follow(primaryAddress.ip, primaryAddress.port);
+        }
+        if (args.hasSwitchEnabled("takeover")) {
+            server.takeOver();
+        }
+        std::string tracePath = args.getOptionValue("trace");
+        if (!tracePath.empty()) {
+            server.setTraceFile(tracePath);
+        }
         server.run();
 
         ColoredString("Server was gracefully shut down!\n", TextColor::LightGreen).print();
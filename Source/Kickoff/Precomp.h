@@ -3,15 +3,20 @@
 #include <stdio.h>
 #include <tchar.h>
 #include <signal.h>
+#include <iostream>
+#include <fstream>
 
 #include "Crust/Optional.h"
 #include "Crust/Array.h"
 #include "Crust/Error.h"
 #include "Crust/FormattedText.h"
 #include "Crust/PooledString.h"
+#include "Crust/Symbol.h"
 #include "Crust/Util.h"
 #include "Crust/CommandArgs.h"
 
 #include "TaskDatabase.h"
 #include "TaskServer.h"
 #include "TaskWorker.h"
+#include "TaskBench.h"
+#include "TaskSimulator.h"
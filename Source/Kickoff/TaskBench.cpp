@@ -0,0 +1,253 @@
+#include "TaskBench.h"
+#include "Crust/Error.h"
+#include "Crust/Util.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+// How long a worker with free slots waits before asking for tasks again after getting none
+static const int BENCH_WORKER_IDLE_POLL_MS = 1;
+
+// Bench tasks' commands start with this, followed by the task's duration in ms and its creation time in microseconds
+static const char* BENCH_TASK_COMMAND = "noop";
+
+
+TaskBenchConfig::TaskBenchConfig()
+    : numSubmitters(1)
+    , numWorkers(4)
+    , slotsPerWorker(4)
+    , numTasks(100000)
+    , batchSize(100)
+    , tasksPerSecond(0)
+    , numTags(1)
+    , tagSkew(0.0)
+    , tagsPerWorker(1)
+    , minDurationMS(0)
+    , maxDurationMS(0)
+{
+}
+
+
+TaskBench::TaskBench(const TaskBenchConfig& config)
+    : m_config(config)
+    , m_serverPort(0)
+    , m_numRequests(0)
+    , m_numFinished(0)
+{
+    double weightSum = 0.0;
+    for (int i = 0; i < m_config.numTags; ++i) {
+        m_tags.push_back(Symbol("bench" + std::to_string(i)));
+        weightSum += 1.0 / std::pow(double(i + 1), m_config.tagSkew);
+        m_tagWeightSums.push_back(weightSum);
+    }
+}
+
+
+Symbol TaskBench::pickTag(std::mt19937_64& random) const
+{
+    std::uniform_real_distribution<double> distribution(0.0, m_tagWeightSums.back());
+    auto it = std::lower_bound(m_tagWeightSums.begin(), m_tagWeightSums.end(), distribution(random));
+    size_t index = std::min((size_t)(it - m_tagWeightSums.begin()), m_tags.size() - 1);
+    return m_tags[index];
+}
+
+
+void TaskBench::runSubmitter(int index)
+{
+    TaskClient client(m_serverIP, m_serverPort);
+    std::mt19937_64 random(index);
+    std::uniform_int_distribution<int> durations(m_config.minDurationMS, m_config.maxDurationMS);
+
+    int firstTask = int(int64_t(m_config.numTasks) * index / m_config.numSubmitters);
+    int lastTask = int(int64_t(m_config.numTasks) * (index + 1) / m_config.numSubmitters);
+
+    // Each submitter creates its share of the total rate, one batch at a time
+    Clock::duration batchInterval = Clock::duration::zero();
+    if (m_config.tasksPerSecond > 0) {
+        batchInterval = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(double(m_config.batchSize) * m_config.numSubmitters / m_config.tasksPerSecond));
+    }
+
+    std::vector<TaskCreateInfo> batch;
+    auto nextBatchTime = Clock::now();
+    for (int i = firstTask; i < lastTask; i += (int)batch.size()) {
+        if (batchInterval > Clock::duration::zero()) {
+            std::this_thread::sleep_until(nextBatchTime);
+            nextBatchTime += batchInterval;
+        }
+
+        int64_t createTimeUS = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+        batch.resize(std::min(m_config.batchSize, lastTask - i));
+        for (auto& info : batch) {
+            info.command = std::string(BENCH_TASK_COMMAND) + " " + std::to_string(durations(random)) + " " + std::to_string(createTimeUS);
+            info.schedule.requiredResources.assign(1, pickTag(random));
+        }
+
+        client.createTasks(batch).orFail("Bench submitter failed to create tasks.");
+        m_numRequests++;
+    }
+}
+
+
+void TaskBench::runWorker(int index)
+{
+    TaskClient client(m_serverIP, m_serverPort);
+
+    std::vector<std::string> resources;
+    for (int i = 0; i < m_config.tagsPerWorker; ++i) {
+        resources.push_back(m_tags[(index * m_config.tagsPerWorker + i) % m_tags.size()].get());
+    }
+    WorkerSessionID sessionID = client.openWorkerSession("bench-worker-" + std::to_string(index), resources).orFail(
+        "Bench worker failed to open a worker session.");
+    m_numRequests++;
+
+    struct RunningTask
+    {
+        TaskID id;
+        Clock::time_point finishTime;
+    };
+    std::vector<RunningTask> running;
+    std::vector<TaskID> finished;
+    std::vector<double> latenciesMS;
+
+    while (m_numFinished < m_config.numTasks) {
+        auto now = Clock::now();
+        finished.clear();
+        for (size_t i = 0; i < running.size(); ) {
+            if (running[i].finishTime <= now) {
+                finished.push_back(running[i].id);
+                running[i] = running.back();
+                running.pop_back();
+            }
+            else {
+                ++i;
+            }
+        }
+
+        int freeSlots = m_config.slotsPerWorker - (int)running.size();
+        if (finished.empty() && freeSlots == 0) {
+            auto firstFinish = std::min_element(running.begin(), running.end(),
+                [](const RunningTask& a, const RunningTask& b) { return a.finishTime < b.finishTime; });
+            std::this_thread::sleep_until(firstFinish->finishTime);
+            continue;
+        }
+
+        bool unknownSession = false;
+        int numFinished = 0;
+        auto taken = client.finishAndTakeTasksToRun(sessionID, finished, freeSlots, &unknownSession, &numFinished).orFail(
+            "Bench worker failed to finish and take tasks.");
+        m_numRequests++;
+        m_numFinished += numFinished;
+        if (unknownSession) {
+            fail("Bench worker's session expired.");
+        }
+
+        now = Clock::now();
+        int64_t nowUS = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+        for (const auto& info : taken) {
+            auto words = splitString(info.command, " ", false);
+            if (words.size() != 3 || words[0] != BENCH_TASK_COMMAND) {
+                fail("Bench worker took a task that wasn't created by the bench: " + info.command);
+            }
+
+            RunningTask task;
+            task.id = info.id;
+            task.finishTime = now + std::chrono::milliseconds(parseInt(words[1]));
+            running.push_back(task);
+            latenciesMS.push_back(double(nowUS - std::stoll(words[2])) / 1000.0);
+        }
+
+        if (taken.empty() && finished.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_WORKER_IDLE_POLL_MS));
+        }
+    }
+
+    client.closeWorkerSession(sessionID);
+    m_numRequests++;
+
+    std::lock_guard<std::mutex> lock(m_latenciesMutex);
+    m_latenciesMS.insert(m_latenciesMS.end(), latenciesMS.begin(), latenciesMS.end());
+}
+
+
+void TaskBench::run(const std::string& serverIP, int serverPort, bool runServer)
+{
+    m_serverIP = serverIP;
+    m_serverPort = serverPort;
+
+    std::unique_ptr<TaskServer> server;
+    std::thread serverThread;
+    double serverCPUSeconds = 0.0;
+    if (runServer) {
+        server.reset(new TaskServer(serverPort));
+        serverThread = std::thread([&]() {
+            server->run();
+            serverCPUSeconds = getThreadCPUSeconds();
+        });
+    }
+
+    ColoredString("Running " + std::to_string(m_config.numTasks) + " tasks with " + std::to_string(m_config.numSubmitters) +
+        " submitters and " + std::to_string(m_config.numWorkers) + " workers\n", TextColor::Cyan).print();
+
+    auto startTime = Clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < m_config.numSubmitters; ++i) {
+        threads.push_back(std::thread([this, i]() { runSubmitter(i); }));
+    }
+    for (int i = 0; i < m_config.numWorkers; ++i) {
+        threads.push_back(std::thread([this, i]() { runWorker(i); }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+
+    uint64_t serverRequests = 0;
+    if (server) {
+        server->shutdown();
+        serverThread.join();
+
+        const auto& stats = server->getStats();
+        serverRequests = stats.succeededRequests + stats.failedRequests + stats.badRequests;
+    }
+
+    printReport(seconds, serverCPUSeconds, serverRequests);
+}
+
+
+void TaskBench::printReport(double seconds, double serverCPUSeconds, uint64_t serverRequests) const
+{
+    auto printValue = [](const std::string& value, const std::string& label) {
+        (ColoredString(value, TextColor::LightGreen) + ColoredString(" " + label + "\n", TextColor::Green)).print();
+    };
+    auto formatNumber = [](double value) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.1f", value);
+        return std::string(buf);
+    };
+
+    TextHeader::make("Bench Results")->print();
+    printValue(formatNumber(seconds), "seconds");
+    printValue(std::to_string(m_numRequests.load()), "requests");
+    printValue(formatNumber(m_numRequests / seconds), "requests per second");
+    printValue(formatNumber(m_config.numTasks / seconds), "tasks per second");
+
+    // Percentiles of the latency from creating a task to a worker taking it
+    std::vector<double> latencies = m_latenciesMS;
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty()) {
+        for (int percentile : { 50, 90, 99, 100 }) {
+            size_t index = std::min(latencies.size() - 1, size_t(percentile / 100.0 * (latencies.size() - 1) + 0.5));
+            std::string name = (percentile == 100) ? "max" : "p" + std::to_string(percentile);
+            printValue(formatNumber(latencies[index]), "ms " + name + " create-to-start latency");
+        }
+    }
+
+    if (serverRequests > 0) {
+        printValue(formatNumber(serverCPUSeconds * 1e6 / serverRequests), "microseconds of server CPU per request");
+    }
+    else {
+        ColoredString("Server CPU per request is only measured for servers run by the bench (i.e. without -server)\n",
+            TextColor::Yellow).print();
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include "TaskDatabase.h"
+#include "TaskServer.h"
+
+
+struct TaskBenchConfig
+{
+    TaskBenchConfig();
+
+    int numSubmitters;
+    int numWorkers;
+    int slotsPerWorker; // how many tasks each worker runs at once
+    int numTasks; // the bench ends once this many tasks have been created and finished
+    int batchSize; // how many tasks each create request carries
+    int tasksPerSecond; // the total rate the submitters create tasks at; 0 creates them as fast as the server takes them
+    int numTags; // each task requires one of this many resource tags
+    double tagSkew; // tags are picked with a Zipf distribution with this exponent; 0 picks them uniformly
+    int tagsPerWorker; // workers are handed tags round-robin, this many each; every tag must go to some worker
+    int minDurationMS; // each task runs for a uniformly random time between these
+    int maxDurationMS;
+};
+
+
+// Drives a task server with simulated submitters and workers, each a thread of this process with its own connection.
+// Workers run no-op tasks that just take up a slot for the task's duration. Tasks carry their creation time in their
+// command, so workers measure the latency from creating a task to starting it without asking anyone.
+class TaskBench
+{
+public:
+    TaskBench(const TaskBenchConfig& config);
+
+    // Without a server address, a TaskServer is run in this process on the given port, so that the report also includes
+    // the server's CPU time per request
+    void run(const std::string& serverIP, int serverPort, bool runServer);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void runSubmitter(int index);
+    void runWorker(int index);
+    Symbol pickTag(std::mt19937_64& random) const;
+    void printReport(double seconds, double serverCPUSeconds, uint64_t serverRequests) const;
+
+    TaskBenchConfig m_config;
+    std::string m_serverIP;
+    int m_serverPort;
+    std::vector<Symbol> m_tags;
+    std::vector<double> m_tagWeightSums; // the running total of the tags' weights, for picking them by weight
+    std::atomic<uint64_t> m_numRequests;
+    std::atomic<int> m_numFinished;
+    std::mutex m_latenciesMutex;
+    std::vector<double> m_latenciesMS; // from creating each task to a worker taking it
+};
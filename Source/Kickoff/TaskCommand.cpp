@@ -0,0 +1,33 @@
+#include "TaskCommand.h"
+#include <algorithm>
+
+
+BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskCommand& val)
+{
+    writer << varInt((uint32_t)val.getSize());
+    writer << val.m_prefix.getBytes();
+    return (writer << ArrayView<uint8_t>((const uint8_t*)val.m_suffix.data(), (int)val.m_suffix.size()));
+}
+
+
+TaskCommand TaskCommandStore::store(const std::string& command)
+{
+    size_t sharedSize = 0;
+    size_t maxSharedSize = std::min(command.size(), m_lastCommand.size());
+    while (sharedSize < maxSharedSize && command[sharedSize] == m_lastCommand[sharedSize]) {
+        sharedSize++;
+    }
+
+    // The previous command starts with the current prefix, so this one does too if it shares at least that much with it
+    size_t prefixSize = m_lastPrefix.get().size();
+    if (sharedSize < prefixSize || sharedSize >= prefixSize + TASK_COMMAND_MIN_PREFIX_GAIN) {
+        m_lastPrefix = (sharedSize >= TASK_COMMAND_MIN_PREFIX_GAIN) ? PooledString(command.substr(0, sharedSize)) : PooledString();
+        prefixSize = m_lastPrefix.get().size();
+    }
+    m_lastCommand = command;
+
+    TaskCommand stored;
+    stored.m_prefix = m_lastPrefix;
+    stored.m_suffix = command.substr(prefixSize);
+    return stored;
+}
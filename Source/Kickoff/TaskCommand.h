@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include "Crust/PooledString.h"
+#include "Crust/BlobStream.h"
+
+
+// A command only starts a new shared prefix if that prefix would cover at least this many more of its bytes than the
+// current one does (so a few matching characters aren't worth a prefix of their own)
+static const size_t TASK_COMMAND_MIN_PREFIX_GAIN = 16;
+
+
+// A task's command line, stored as a prefix shared with similar commands plus the rest of it. Tasks are typically
+// created in batches of commands that only differ in their last argument, so each task keeps a short suffix of its own
+// (usually short enough for std::string to store inline), and the full command is only rebuilt when it's sent out.
+class TaskCommand
+{
+public:
+    std::string get() const { return m_prefix.get() + m_suffix; }
+    size_t getSize() const { return m_prefix.get().size() + m_suffix.size(); }
+
+private:
+    friend class TaskCommandStore;
+    friend BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskCommand& val);
+
+    PooledString m_prefix;
+    std::string m_suffix;
+};
+
+// Writes the command exactly as writing the std::string it stands for would, without rebuilding it
+BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskCommand& val);
+
+
+// Front codes commands against the command stored just before them: a command that shares a long enough prefix with the
+// previous one shares that prefix's pooled copy too, which stays in use for as long as commands keep starting with it.
+class TaskCommandStore
+{
+public:
+    TaskCommand store(const std::string& command);
+
+private:
+    std::string m_lastCommand;
+    PooledString m_lastPrefix; // m_lastCommand always starts with this
+};
@@ -1,6 +1,9 @@
 #include "TaskDatabase.h"
+#include "TaskLog.h"
+#include "TaskSpill.h"
 #include "Crust/Util.h"
 #include "Crust/Error.h"
+#include <algorithm>
 
 
 TaskStats::TaskStats()
@@ -8,13 +11,32 @@ TaskStats::TaskStats()
     , numRunning(0)
     , numCanceling(0)
     , numFinished(0)
+    , numWorkers(0)
 {}
 
 
-Task::Task(TaskID id, const TaskCreateInfo& startInfo)
+TaskDatabase::TaskDatabase()
+    : m_nextPendingOrder(0)
+    , m_nextWorkerProfileID(1)
+    , m_log(nullptr)
+    , m_spill(nullptr)
+    , m_maxResidentPendingTasks(0)
+    , m_seededIDs(false)
+    , m_snapshotPhase(SnapshotPhase::Idle)
+    , m_snapshotCursor(0)
+    , m_snapshotEndOrder(0)
+    , m_snapshotCopyCount(0)
+{}
+
+
+Task::Task(TaskID id, TaskCommand&& command, const TaskSchedule& schedule)
     : m_id(id)
-    , m_command(startInfo.command)
-    , m_schedule(startInfo.schedule)
+    , m_command(std::move(command))
+    , m_schedule(schedule)
+    , m_sessionID(NO_WORKER_SESSION)
+    , m_pendingBucket(nullptr)
+    , m_pendingOrder(0)
+    , m_slot(0)
 {
     m_status.createTime = std::time(nullptr);
 }
@@ -26,12 +48,12 @@ std::string Task::getHexID() const
 }
 
 
-void Task::markStarted()
+void Task::markStarted(std::time_t startTime)
 {
     if (!m_status.runStatus.hasValue()) {
         TaskRunStatus runStatus;
-        runStatus.startTime = std::time(nullptr);
-        runStatus.heartbeatTime = std::time(nullptr);
+        runStatus.startTime = startTime;
+        runStatus.heartbeatTime = startTime;
         runStatus.wasCanceled = false;
         m_status.runStatus = runStatus;
     }
@@ -48,41 +70,85 @@ bool Task::markShouldCancel()
 }
 
 
-void Task::heartbeat()
+void Task::heartbeat(std::time_t now)
 {
     // Update a running task's heartbeat timestamp
     if (auto* runStatus = m_status.runStatus.ptrOrNull()) {
-        runStatus->heartbeatTime = std::time(nullptr);
+        runStatus->heartbeatTime = now;
     }
 }
 
 
-TaskPtr TaskDatabase::getTaskByID(TaskID id) const
+bool TaskDatabase::hasTask(TaskID id) const
 {
-    auto it = m_allTasksByID.find(id);
-    if (it != m_allTasksByID.end()) {
-        return it->second;
+    return m_allTasksByID.find(id) != m_allTasksByID.end() || m_spilledTasks.find(id) != nullptr;
+}
+
+
+TaskPtr TaskDatabase::getTaskByID(TaskID id)
+{
+    if (auto task = getResidentTask(id)) {
+        return task;
+    }
+    if (m_spilledTasks.find(id)) {
+        return pageInTask(id);
     }
     return TaskPtr();
 }
 
 
-std::vector<TaskPtr> TaskDatabase::getTasksByStates(const std::set<TaskState>& states) const
+TaskPtr TaskDatabase::getResidentTask(TaskID id) const
+{
+    auto it = m_allTasksByID.find(id);
+    return (it != m_allTasksByID.end()) ? it->second : TaskPtr();
+}
+
+
+bool TaskDatabase::readSpilledTask(TaskID id, TaskCreateInfo& outInfo, TaskStatus& outStatus) const
 {
-    std::vector<TaskPtr> results;
-    for (const auto& entry : m_allTasksByID) {
-        TaskPtr task = entry.second;
-        if (states.find(task->getStatus().getState()) != states.end()) {
-            results.push_back(task);
+    const auto* entry = m_spilledTasks.find(id);
+    if (!entry) { return false; }
+
+    // Spilled tasks are all pending, so their status is just their creation time
+    outStatus = TaskStatus();
+    readSpilledTask(*entry->bucket->findSpilledTask(entry->pendingOrder), outStatus.createTime, outInfo);
+    return true;
+}
+
+
+void TaskDatabase::getTasksByStates(TaskStateMask states, ArenaVector<TaskPtr>& outTasks)
+{
+    ArenaVector<TaskID> ids(outTasks.get_allocator());
+    m_table.find(states, ids);
+    for (TaskID id : ids) {
+        outTasks.push_back(m_allTasksByID.find(id)->second);
+    }
+}
+
+
+void TaskDatabase::getSpilledTasks(ArenaVector<std::pair<TaskID, std::time_t>>& outTasks) const
+{
+    // Only the creation time is decoded, from a buffer reused for every record
+    std::vector<uint8_t> recordBytes;
+    for (const auto& entry : m_pendingBuckets) {
+        for (const auto& spilled : entry.second.spilledTasks) {
+            if (spilled.spillOffset == PAGED_IN_SPILL_OFFSET) { continue; }
+            m_spill->read(spilled.spillOffset, recordBytes);
+
+            BlobStreamReader record(recordBytes);
+            std::time_t createTime;
+            if (!(record >> createTime)) {
+                fail("A task in the spill file is corrupt");
+            }
+            outTasks.push_back(std::make_pair(spilled.id, createTime));
         }
     }
-    return std::move(results);
 }
 
 
 int TaskDatabase::getTotalTaskCount() const
 {
-    return (int)m_allTasksByID.size();
+    return (int)(m_allTasksByID.size() + m_spilledTasks.size());
 }
 
 
@@ -96,13 +162,33 @@ static uint64_t fastRand64()
 }
 
 
+void TaskDatabase::seedIDs(uint64_t seed)
+{
+    m_idRandom.seed(seed);
+    m_seededIDs = true;
+}
+
+
+uint64_t TaskDatabase::getRandomID() const
+{
+    return m_seededIDs ? m_idRandom() : fastRand64();
+}
+
+
+std::time_t TaskDatabase::getTime() const
+{
+    if (const std::time_t* virtualTime = m_virtualTime.ptrOrNull()) { return *virtualTime; }
+    return std::time(nullptr);
+}
+
+
 TaskID TaskDatabase::getUnusedTaskID() const
 {
-    TaskID randID = fastRand64();
+    TaskID randID = getRandomID();
     
     int sanityCount = 0;
-    while (getTaskByID(randID)) {
-        randID = fastRand64();
+    while (hasTask(randID)) {
+        randID = getRandomID();
 
         sanityCount++;
         if (sanityCount > 10) {
@@ -116,29 +202,414 @@ TaskID TaskDatabase::getUnusedTaskID() const
 }
 
 
-TaskPtr TaskDatabase::createTask(const TaskCreateInfo& info)
+WorkerSessionID TaskDatabase::getUnusedWorkerSessionID() const
+{
+    WorkerSessionID randID = getRandomID();
+
+    int sanityCount = 0;
+    while (randID == NO_WORKER_SESSION || hasWorkerSession(randID)) {
+        randID = getRandomID();
+
+        sanityCount++;
+        if (sanityCount > 1000) {
+            fail("TaskDatabase::getUnusedWorkerSessionID failed to find an empty slot after 1000 iterations!");
+        }
+    }
+    return randID;
+}
+
+
+TaskID TaskDatabase::createTask(const TaskCreateInfo& info)
 {
     TaskID id = getUnusedTaskID();
-    TaskPtr task = std::make_shared<Task>(id, info);
-    m_allTasksByID[id] = task;
-    m_pendingTasks.insert(task);
+    std::time_t createTime = getTime();
+
+    if (isLogging()) {
+        BlobStreamWriter record;
+        record << TaskLogRecordType::CreateTask << id << createTime << info;
+        logRecord(record);
+    }
+    applyCreateTask(id, createTime, info);
+    return id;
+}
+
+
+void TaskDatabase::applyCreateTask(TaskID id, std::time_t createTime, const TaskCreateInfo& info)
+{
+    uint64_t pendingOrder = m_nextPendingOrder++;
+    if (shouldSpillPendingTask()) {
+        spillPendingTask(id, pendingOrder, createTime, info);
+    }
+    else {
+        TaskPtr task = std::make_shared<Task>(id, m_commands.store(info.command), info.schedule);
+        task->m_status.createTime = createTime;
+        addResidentTask(task);
+        addPendingTask(task, pendingOrder);
+    }
     m_stats.numPending++;
+}
+
+
+uint64_t PendingTaskBucket::getOldestOrder() const
+{
+    if (tasksByOrder.empty()) { return spilledTasks.front().pendingOrder; }
+    if (spilledTasks.empty()) { return tasksByOrder.begin()->first; }
+    return std::min(tasksByOrder.begin()->first, spilledTasks.front().pendingOrder);
+}
+
+
+SpilledTask* PendingTaskBucket::findSpilledTask(uint64_t pendingOrder)
+{
+    auto it = std::lower_bound(spilledTasks.begin(), spilledTasks.end(), pendingOrder,
+        [](const SpilledTask& spilled, uint64_t order) { return spilled.pendingOrder < order; });
+    if (it == spilledTasks.end() || it->pendingOrder != pendingOrder || it->spillOffset == PAGED_IN_SPILL_OFFSET) { return nullptr; }
+    return &*it;
+}
+
+
+void PendingTaskBucket::removeSpilledTask(SpilledTask& spilled)
+{
+    spilled.spillOffset = PAGED_IN_SPILL_OFFSET;
+    numSpilledTasks--;
+
+    while (!spilledTasks.empty() && spilledTasks.front().spillOffset == PAGED_IN_SPILL_OFFSET) {
+        spilledTasks.pop_front();
+    }
+
+    // Tasks paged in from the middle of the queue (e.g. to look them up) would otherwise keep their entries for as long
+    // as the tasks ahead of them stay queued
+    if (spilledTasks.size() > numSpilledTasks * 2) {
+        spilledTasks.erase(std::remove_if(spilledTasks.begin(), spilledTasks.end(),
+            [](const SpilledTask& entry) { return entry.spillOffset == PAGED_IN_SPILL_OFFSET; }), spilledTasks.end());
+    }
+}
+
+
+void SpilledTaskIndex::add(TaskID id, PendingTaskBucket* bucket, uint64_t pendingOrder)
+{
+    if ((m_count + 1) * 2 > m_slots.size()) {
+        grow();
+    }
+
+    size_t mask = m_slots.size() - 1;
+    size_t slot = getHomeSlot(id, mask);
+    while (m_slots[slot].bucket) {
+        slot = (slot + 1) & mask;
+    }
+    m_slots[slot].id = id;
+    m_slots[slot].bucket = bucket;
+    m_slots[slot].pendingOrder = pendingOrder;
+    m_count++;
+}
+
+
+const SpilledTaskIndex::Entry* SpilledTaskIndex::find(TaskID id) const
+{
+    if (m_count == 0) { return nullptr; }
+
+    size_t mask = m_slots.size() - 1;
+    for (size_t slot = getHomeSlot(id, mask); m_slots[slot].bucket; slot = (slot + 1) & mask) {
+        if (m_slots[slot].id == id) { return &m_slots[slot]; }
+    }
+    return nullptr;
+}
+
+
+void SpilledTaskIndex::remove(TaskID id)
+{
+    size_t mask = m_slots.size() - 1;
+    size_t slot = getHomeSlot(id, mask);
+    while (m_slots[slot].id != id || !m_slots[slot].bucket) {
+        slot = (slot + 1) & mask;
+    }
+
+    // Shift back each following entry whose probe passed the freed slot, so lookups never stop short of it
+    size_t next = (slot + 1) & mask;
+    while (m_slots[next].bucket) {
+        size_t home = getHomeSlot(m_slots[next].id, mask);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            m_slots[slot] = m_slots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    m_slots[slot].bucket = nullptr;
+
+    // Spills come in bursts, so the slots are given back once the last spilled task is paged in
+    if (--m_count == 0) {
+        clear();
+    }
+}
+
+
+void SpilledTaskIndex::clear()
+{
+    std::vector<Entry>().swap(m_slots);
+    m_count = 0;
+}
+
+
+size_t SpilledTaskIndex::getHomeSlot(TaskID id, size_t mask)
+{
+    // IDs are random unless seeded, but are mixed (by Fibonacci hashing) anyway so the mask never keeps patterned bits
+    return (size_t)((id * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+
+void SpilledTaskIndex::grow()
+{
+    std::vector<Entry> oldSlots(std::max(m_slots.size() * 2, (size_t)1024));
+    oldSlots.swap(m_slots);
+
+    size_t mask = m_slots.size() - 1;
+    for (const auto& entry : oldSlots) {
+        if (!entry.bucket) { continue; }
+        size_t slot = getHomeSlot(entry.id, mask);
+        while (m_slots[slot].bucket) {
+            slot = (slot + 1) & mask;
+        }
+        m_slots[slot] = entry;
+    }
+}
+
+
+PendingTaskBucket& TaskDatabase::getPendingBucket(const TaskSchedule& schedule)
+{
+    std::string signature = schedule.getSignature();
+
+    auto it = m_pendingBuckets.find(signature);
+    if (it == m_pendingBuckets.end()) {
+        it = m_pendingBuckets.insert(std::make_pair(signature, PendingTaskBucket())).first;
+        it->second.signature = signature;
+        it->second.schedule = schedule;
+    }
+    return it->second;
+}
+
+
+void TaskDatabase::addPendingTask(TaskPtr task, uint64_t pendingOrder)
+{
+    auto& bucket = getPendingBucket(task->getSchedule());
+    task->m_pendingBucket = &bucket;
+    task->m_pendingOrder = pendingOrder;
+    bucket.tasksByOrder[task->m_pendingOrder] = task;
+}
+
+
+void TaskDatabase::removePendingTask(TaskPtr task)
+{
+    auto* bucket = task->m_pendingBucket;
+    if (!bucket) { return; }
+
+    bucket->tasksByOrder.erase(task->m_pendingOrder);
+    task->m_pendingBucket = nullptr;
+
+    if (bucket->getTaskCount() == 0) {
+        m_pendingBuckets.erase(bucket->signature);
+    }
+}
+
+
+TaskPtr TaskDatabase::takeOldestPendingTask(PendingTaskBucket& bucket)
+{
+    // Tasks are spilled in the order they're queued, so the oldest one is only on disk once those in memory ran out
+    // (or were queued after it, e.g. after being paged in out of order)
+    if (!bucket.spilledTasks.empty() &&
+        (bucket.tasksByOrder.empty() || bucket.spilledTasks.front().pendingOrder < bucket.tasksByOrder.begin()->first)) {
+        return pageInTask(bucket.spilledTasks.front().id);
+    }
+    return bucket.tasksByOrder.begin()->second;
+}
+
+
+bool TaskDatabase::shouldSpillPendingTask() const
+{
+    if (!m_spill || !m_spill->isOpen()) { return false; }
+    size_t residentPendingCount = (size_t)m_stats.numPending - m_spilledTasks.size();
+    return residentPendingCount >= m_maxResidentPendingTasks;
+}
+
+
+PendingTaskBucket& TaskDatabase::spillPendingTask(TaskID id, uint64_t pendingOrder, std::time_t createTime, const TaskCreateInfo& info)
+{
+    BlobStreamWriter record;
+    record << createTime << info;
+
+    SpilledTask spilled;
+    spilled.pendingOrder = pendingOrder;
+    spilled.id = id;
+    spilled.spillOffset = m_spill->append(record.data());
+
+    // New tasks come last in pending order, so they're simply appended (see applySnapshotChunk for restored ones)
+    auto& bucket = getPendingBucket(info.schedule);
+    bucket.spilledTasks.push_back(spilled);
+    bucket.numSpilledTasks++;
+    m_spilledTasks.add(id, &bucket, pendingOrder);
+    return bucket;
+}
+
+
+size_t TaskDatabase::readSpilledTask(const SpilledTask& spilled, std::time_t& outCreateTime, TaskCreateInfo& outInfo) const
+{
+    std::vector<uint8_t> recordBytes;
+    m_spill->read(spilled.spillOffset, recordBytes);
+
+    BlobStreamReader record(recordBytes);
+    if (!(record >> outCreateTime) || !(record >> outInfo)) {
+        fail("A task in the spill file is corrupt");
+    }
+    return recordBytes.size();
+}
+
+
+TaskPtr TaskDatabase::pageInTask(TaskID id)
+{
+    const auto* entry = m_spilledTasks.find(id);
+    PendingTaskBucket& bucket = *entry->bucket;
+    SpilledTask& queued = *bucket.findSpilledTask(entry->pendingOrder);
+    SpilledTask spilled = queued;
+    copyIntoSnapshot(bucket, spilled);
+
+    std::time_t createTime;
+    TaskCreateInfo info;
+    size_t recordSize = readSpilledTask(spilled, createTime, info);
+    m_spilledTasks.remove(id);
+    bucket.removeSpilledTask(queued);
+    m_spill->release(recordSize);
+
+    // The task goes back into its bucket at the same position, just held in memory now
+    TaskPtr task = std::make_shared<Task>(id, m_commands.store(info.command), info.schedule);
+    task->m_status.createTime = createTime;
+    addResidentTask(task);
+    task->m_pendingBucket = &bucket;
+    task->m_pendingOrder = spilled.pendingOrder;
+    bucket.tasksByOrder[spilled.pendingOrder] = task;
+
+    // Paging in mustn't grow the tasks in memory past their budget either, so another one goes out in its place
+    if ((size_t)m_stats.numPending - m_spilledTasks.size() > m_maxResidentPendingTasks) {
+        spillNewestResidentTask(*task);
+    }
+
+    if (m_spill->shouldCompact()) {
+        compactSpill();
+    }
     return task;
 }
 
 
-TaskPtr TaskDatabase::takeTaskToRun(const std::set<std::string>& haveResources)
+void TaskDatabase::spillNewestResidentTask(const Task& except)
+{
+    // Pending tasks are taken oldest first, so the newest one is needed last
+    TaskPtr newest;
+    for (const auto& entry : m_pendingBuckets) {
+        const auto& tasks = entry.second.tasksByOrder;
+        auto it = tasks.rbegin();
+        if (it != tasks.rend() && it->second.get() == &except) { ++it; }
+        if (it != tasks.rend() && (!newest || it->first > newest->m_pendingOrder)) {
+            newest = it->second;
+        }
+    }
+    if (!newest) { return; }
+
+    // The task moves out of the tasks in memory, where the scan may not have reached it yet, into the spilled ones,
+    // which the scan may reach after it already serialized the task
+    copyIntoSnapshot(*newest);
+    if (m_snapshotPhase == SnapshotPhase::ResidentTasks || m_snapshotPhase == SnapshotPhase::SpilledTasks) {
+        m_snapshotCopiedIDs.insert(newest->m_id);
+    }
+
+    TaskCreateInfo info;
+    info.command = newest->getCommand().get();
+    info.schedule = newest->getSchedule();
+    BlobStreamWriter record;
+    record << newest->getStatus().createTime << info;
+
+    SpilledTask spilled;
+    spilled.pendingOrder = newest->m_pendingOrder;
+    spilled.id = newest->m_id;
+    spilled.spillOffset = m_spill->append(record.data());
+
+    // Tasks spilled when they were created may be queued after it, and its own entry may still be left behind from
+    // when it was paged in
+    PendingTaskBucket& bucket = *newest->m_pendingBucket;
+    auto it = std::lower_bound(bucket.spilledTasks.begin(), bucket.spilledTasks.end(), spilled.pendingOrder,
+        [](const SpilledTask& queued, uint64_t order) { return queued.pendingOrder < order; });
+    if (it != bucket.spilledTasks.end() && it->pendingOrder == spilled.pendingOrder) {
+        *it = spilled;
+    }
+    else {
+        bucket.spilledTasks.insert(it, spilled);
+    }
+    bucket.numSpilledTasks++;
+    m_spilledTasks.add(spilled.id, &bucket, spilled.pendingOrder);
+
+    removePendingTask(newest);
+    m_table.remove(newest->m_slot);
+    m_allTasksByID.erase(spilled.id);
+}
+
+
+void TaskDatabase::compactSpill()
+{
+    // Queues are in pending order, which is mostly the order the records were appended in, so the old file is mostly
+    // read front to back
+    m_spill->beginCompaction();
+    for (auto& entry : m_pendingBuckets) {
+        for (auto& spilled : entry.second.spilledTasks) {
+            if (spilled.spillOffset != PAGED_IN_SPILL_OFFSET) {
+                spilled.spillOffset = m_spill->moveRecord(spilled.spillOffset);
+            }
+        }
+    }
+    m_spill->finishCompaction();
+}
+
+
+void TaskDatabase::addResidentTask(TaskPtr task)
+{
+    m_allTasksByID[task->getID()] = task;
+    task->m_slot = m_table.add(task->getID(), task->getStatus());
+}
+
+
+void TaskDatabase::applyStartTask(TaskPtr task, WorkerSessionID sessionID, std::time_t startTime)
+{
+    if (task->getStatus().runStatus.hasValue()) { return; }
+
+    copyIntoSnapshot(*task);
+    removePendingTask(task);
+    task->markStarted(startTime);
+    m_table.update(task->m_slot, task->getStatus());
+
+    auto sessionIt = m_workerSessions.find(sessionID);
+    if (sessionIt != m_workerSessions.end()) {
+        task->m_sessionID = sessionID;
+        sessionIt->second.runningTasks.insert(task->getID());
+    }
+
+    m_stats.numPending--;
+    m_stats.numRunning++;
+}
+
+
+void TaskDatabase::takeTasksToRun(ArrayView<Symbol> haveResources, int maxCount, WorkerSessionID sessionID, ArenaVector<TaskPtr>& outTasks)
 {
-    // Choose the pending task with the highest "score", which represents what percentage of the optional resources the worker has
-    TaskPtr readyTask;
-    float bestScore = -1.0f;
-    for (const auto& task : m_pendingTasks) {
-        const auto& schedule = task->getSchedule();
+    struct Candidate
+    {
+        float score;
+        PendingTaskBucket* bucket;
+    };
+
+    // Score each bucket by what percentage of the optional resources the worker has
+    ArenaVector<Candidate> candidates(outTasks.get_allocator());
+    for (auto& entry : m_pendingBuckets) {
+        auto& bucket = entry.second;
+        const auto& schedule = bucket.schedule;
 
         // Must have all the required resources to even be considered
         bool matchReq = true;
         for (const auto& res : schedule.requiredResources) {
-            if (haveResources.find(res.get()) == haveResources.end()) {
+            if (!hasResourceTag(haveResources, res)) {
                 matchReq = false;
                 break;
             }
@@ -150,46 +621,86 @@ TaskPtr TaskDatabase::takeTaskToRun(const std::set<std::string>& haveResources)
             if (schedule.optionalResources.size() > 0) {
                 int matchCount = 0;
                 for (const auto& res : schedule.optionalResources) {
-                    if (haveResources.find(res.get()) != haveResources.end()) {
+                    if (hasResourceTag(haveResources, res)) {
                         matchCount++;
                     }
                 }
                 score = float(matchCount) / float(schedule.optionalResources.size());
             }
 
-            if (score > bestScore) {
-                bestScore = score;
-                readyTask = task;
+            Candidate candidate;
+            candidate.score = score;
+            candidate.bucket = &bucket;
+            candidates.push_back(candidate);
+        }
+    }
 
-                if (bestScore >= 0.999f) {
-                    break; // not really possible to get any better than this, so just break out of the search early
-                }
+    // Take from the best scoring buckets first, and among equally good buckets, from the one with the oldest task
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        if (a.score != b.score) { return a.score > b.score; }
+        return a.bucket->getOldestOrder() < b.bucket->getOldestOrder();
+    });
+
+    int takenCount = 0;
+    for (const auto& candidate : candidates) {
+        if (takenCount >= maxCount) { break; }
+
+        // Taking the last task of a bucket destroys it, so check for that before marking the task taken
+        auto* bucket = candidate.bucket;
+        bool bucketEmptied = false;
+        while (!bucketEmptied && takenCount < maxCount) {
+            TaskPtr task = takeOldestPendingTask(*bucket);
+            bucketEmptied = (bucket->getTaskCount() == 1);
+
+            std::time_t startTime = getTime();
+            if (isLogging()) {
+                BlobStreamWriter record;
+                record << TaskLogRecordType::StartTask << task->getID() << sessionID << startTime;
+                logRecord(record);
             }
+            applyStartTask(task, sessionID, startTime);
+            outTasks.push_back(task);
+            takenCount++;
         }
     }
+}
 
-    // If a ready task was found, update its state
-    if (readyTask)
-    {
-        m_pendingTasks.erase(readyTask);
-        readyTask->markStarted();
 
-        m_stats.numPending--;
-        m_stats.numRunning++;
-    }
+void TaskDatabase::takeTasksToRun(WorkerSessionID sessionID, int maxCount, ArenaVector<TaskPtr>& outTasks)
+{
+    const auto* session = getWorkerSession(sessionID);
+    if (!session) { return; }
 
-    return readyTask;
+    const auto* profile = getWorkerProfile(session->profileID);
+    if (!profile) { return; }
+
+    takeTasksToRun(profile->resources, maxCount, sessionID, outTasks);
 }
 
 
 void TaskDatabase::heartbeatTask(TaskPtr task)
 {
-    return task->heartbeat();
+    task->heartbeat(getTime());
+    m_table.update(task->m_slot, task->getStatus());
 }
 
 
 void TaskDatabase::markTaskFinished(TaskPtr task)
 {
+    if (isLogging()) {
+        BlobStreamWriter record;
+        record << TaskLogRecordType::FinishTask << task->getID();
+        logRecord(record);
+    }
+    applyFinishTask(task);
+}
+
+
+void TaskDatabase::applyFinishTask(TaskPtr task)
+{
+    if (!getTaskByID(task->getID())) { return; }
+
+    copyIntoSnapshot(*task);
     if (auto* runStatus = task->getStatus().runStatus.ptrOrNull()) {
         if (runStatus->wasCanceled) {
             m_stats.numCanceling--;
@@ -203,179 +714,782 @@ void TaskDatabase::markTaskFinished(TaskPtr task)
     }
     m_stats.numFinished++;
 
-    m_pendingTasks.erase(task);
+    auto sessionIt = m_workerSessions.find(task->getWorkerSessionID());
+    if (sessionIt != m_workerSessions.end()) {
+        sessionIt->second.runningTasks.erase(task->getID());
+    }
+
+    removePendingTask(task);
+    m_table.remove(task->m_slot);
     m_allTasksByID.erase(task->getID());
 }
 
 
 void TaskDatabase::markTaskShouldCancel(TaskPtr task)
 {
+    if (isLogging()) {
+        BlobStreamWriter record;
+        record << TaskLogRecordType::CancelTask << task->getID();
+        logRecord(record);
+    }
+    applyCancelTask(task);
+}
+
+
+void TaskDatabase::applyCancelTask(TaskPtr task)
+{
+    bool wasAlreadyCanceled = task->getStatus().getState() == TaskState::Canceling;
+    copyIntoSnapshot(*task);
     if (task->markShouldCancel()) {
-        m_stats.numRunning--;
-        m_stats.numCanceling++;
+        m_table.update(task->m_slot, task->getStatus());
+        if (!wasAlreadyCanceled) {
+            m_stats.numRunning--;
+            m_stats.numCanceling++;
+        }
     }
     else {
-        markTaskFinished(task);
+        applyFinishTask(task);
     }
 }
 
 
-void TaskDatabase::cleanupZombieTasks(std::time_t heartbeatTimeoutSeconds)
+WorkerProfileID TaskDatabase::acquireWorkerProfile(const std::vector<std::string>& resources)
 {
-    for (auto item : m_allTasksByID) {
-        auto task = item.second;
-        cleanupIfZombieTask(task, heartbeatTimeoutSeconds);
+    ResourceTags resourceSet = makeResourceTags(std::vector<Symbol>(resources.begin(), resources.end()));
+
+    auto it = m_workerProfileIDsByResources.find(resourceSet);
+    if (it != m_workerProfileIDsByResources.end()) {
+        m_workerProfiles[it->second].numWorkers++;
+        return it->second;
     }
+
+    WorkerProfile profile;
+    profile.id = m_nextWorkerProfileID++;
+    profile.resources = resourceSet;
+    profile.numWorkers = 1;
+    m_workerProfiles[profile.id] = profile;
+    m_workerProfileIDsByResources[resourceSet] = profile.id;
+    return profile.id;
 }
 
 
-bool TaskDatabase::cleanupIfZombieTask(TaskPtr task, std::time_t heartbeatTimeoutSeconds)
+void TaskDatabase::releaseWorkerProfile(WorkerProfileID id)
 {
-    bool died = false;
+    auto it = m_workerProfiles.find(id);
+    if (it == m_workerProfiles.end()) { return; }
 
-    if (auto* runStatus = task->getStatus().runStatus.ptrOrNull()) {
-        std::time_t diff = std::time(nullptr) - runStatus->heartbeatTime;
-        died = (diff >= heartbeatTimeoutSeconds);
+    it->second.numWorkers--;
+    if (it->second.numWorkers <= 0) {
+        m_workerProfileIDsByResources.erase(it->second.resources);
+        m_workerProfiles.erase(it);
     }
+}
 
-    if (died) {
-        markTaskFinished(task);
+
+WorkerSessionID TaskDatabase::openWorkerSession(const std::string& machineName, const std::vector<std::string>& resources)
+{
+    WorkerSessionID id = getUnusedWorkerSessionID();
+    std::time_t openTime = getTime();
+
+    if (isLogging()) {
+        BlobStreamWriter record;
+        record << TaskLogRecordType::OpenWorkerSession << id << machineName << openTime << resources.size();
+        for (const auto& resource : resources) {
+            record << resource;
+        }
+        logRecord(record);
     }
-    return died;
+    applyOpenWorkerSession(id, machineName, resources, openTime);
+    return id;
 }
 
 
-TaskState TaskStatus::getState() const
+void TaskDatabase::applyOpenWorkerSession(WorkerSessionID id, const std::string& machineName, const std::vector<std::string>& resources, std::time_t openTime)
 {
-    if (runStatus.hasValue()) {
-        return runStatus.orDefault().wasCanceled ? TaskState::Canceling : TaskState::Running;
+    if (hasWorkerSession(id)) { return; }
+
+    WorkerSession session;
+    session.id = id;
+    session.profileID = acquireWorkerProfile(resources);
+    session.machineName = machineName;
+    session.openTime = openTime;
+    session.leaseTime = openTime;
+    m_workerSessions[session.id] = session;
+    m_stats.numWorkers++;
+}
+
+
+bool TaskDatabase::hasWorkerSession(WorkerSessionID id) const
+{
+    return m_workerSessions.find(id) != m_workerSessions.end();
+}
+
+
+const WorkerSession* TaskDatabase::getWorkerSession(WorkerSessionID id) const
+{
+    auto it = m_workerSessions.find(id);
+    if (it != m_workerSessions.end()) {
+        return &it->second;
     }
-    else {
-        return TaskState::Pending;
+    return nullptr;
+}
+
+
+const WorkerProfile* TaskDatabase::getWorkerProfile(WorkerProfileID id) const
+{
+    auto it = m_workerProfiles.find(id);
+    if (it != m_workerProfiles.end()) {
+        return &it->second;
     }
+    return nullptr;
 }
 
 
-void TaskSchedule::serialize(BlobStreamWriter& writer) const
+Optional<std::vector<TaskID>> TaskDatabase::renewWorkerSession(WorkerSessionID id)
 {
-    writer << requiredResources.size();
-    for (auto& resource : requiredResources) {
-        writer << resource;
+    auto it = m_workerSessions.find(id);
+    if (it == m_workerSessions.end()) {
+        return Nothing();
     }
-    writer << optionalResources.size();
-    for (auto& resource : optionalResources) {
-        writer << resource;
+
+    // Renewing the lease heartbeats every task running within the session, so their status stays accurate
+    auto& session = it->second;
+    session.leaseTime = getTime();
+
+    std::vector<TaskID> canceledTasks;
+    for (TaskID taskID : session.runningTasks) {
+        auto task = getTaskByID(taskID);
+        if (!task) { continue; }
+
+        heartbeatTask(task);
+        if (const auto* runStatus = task->getStatus().runStatus.ptrOrNull()) {
+            if (runStatus->wasCanceled) { canceledTasks.push_back(taskID); }
+        }
     }
+    return canceledTasks;
 }
 
 
-bool TaskSchedule::deserialize(BlobStreamReader& reader)
+void TaskDatabase::closeWorkerSession(WorkerSessionID id)
 {
-    size_t count;
+    if (isLogging()) {
+        BlobStreamWriter record;
+        record << TaskLogRecordType::CloseWorkerSession << id;
+        logRecord(record);
+    }
+    applyCloseWorkerSession(id);
+}
 
-    if (!(reader >> count)) { return false; }
-    requiredResources.resize(count);
-    for (size_t i = 0; i < count; ++i) {
-        if (!(reader >> requiredResources[i])) { return false; }
+
+void TaskDatabase::applyCloseWorkerSession(WorkerSessionID id)
+{
+    // Any tasks still owned by the session are no longer heartbeated, so they will eventually time out as zombies
+    auto it = m_workerSessions.find(id);
+    if (it != m_workerSessions.end()) {
+        releaseWorkerProfile(it->second.profileID);
+        m_stats.numWorkers--;
+        m_workerSessions.erase(it);
     }
+}
 
-    if (!(reader >> count)) { return false; }
-    optionalResources.resize(count);
-    for (size_t i = 0; i < count; ++i) {
-        if (!(reader >> optionalResources[i])) { return false; }
+
+void TaskDatabase::cleanupZombieTasks(std::time_t heartbeatTimeoutSeconds)
+{
+    // Only running tasks whose last heartbeat is already too old can be zombies, and a scan of the table's heartbeat
+    // column finds them without touching any other task. They're collected first, since finishing them frees their rows.
+    std::time_t now = getTime();
+    for (TaskID id : m_table.findStale(now - heartbeatTimeoutSeconds)) {
+        if (auto task = getTaskByID(id)) {
+            cleanupIfZombieTask(task, heartbeatTimeoutSeconds);
+        }
     }
 
-    return true;
+    // Sessions whose lease expired belong to workers that are gone; their tasks were timed out above
+    std::vector<WorkerSessionID> expiredSessions;
+    for (const auto& entry : m_workerSessions) {
+        if (now - entry.second.leaseTime >= heartbeatTimeoutSeconds) {
+            expiredSessions.push_back(entry.first);
+        }
+    }
+    for (WorkerSessionID id : expiredSessions) {
+        closeWorkerSession(id);
+    }
 }
 
 
-std::string TaskSchedule::toString() const
+void TaskDatabase::renewAllLeases()
 {
-    std::string str = "RequiredResources = {";
-    for (size_t i = 0; i < requiredResources.size(); ++i) {
-        str += requiredResources[i].get();
-        if (i != requiredResources.size() - 1) {
-            str += ", ";
+    std::time_t now = getTime();
+    for (auto& entry : m_allTasksByID) {
+        heartbeatTask(entry.second);
+    }
+    for (auto& entry : m_workerSessions) {
+        entry.second.leaseTime = now;
+    }
+}
+
+
+bool TaskDatabase::isLogging() const
+{
+    return m_log && m_log->isEnabled();
+}
+
+
+void TaskDatabase::logRecord(const BlobStreamWriter& record)
+{
+    m_log->append(record.data());
+}
+
+
+bool TaskDatabase::applyLogRecord(ArrayView<uint8_t> recordBytes)
+{
+    BlobStreamReader record(recordBytes);
+
+    TaskLogRecordType type;
+    if (!(record >> type)) { return false; }
+
+    switch (type) {
+        case TaskLogRecordType::CreateTask: {
+            TaskID id;
+            std::time_t createTime;
+            TaskCreateInfo info;
+            if (!(record >> id) || !(record >> createTime) || !(record >> info)) { return false; }
+            if (hasTask(id)) { return false; }
+
+            applyCreateTask(id, createTime, info);
+            return true;
+        }
+
+        case TaskLogRecordType::StartTask: {
+            TaskID id;
+            WorkerSessionID sessionID;
+            std::time_t startTime;
+            if (!(record >> id) || !(record >> sessionID) || !(record >> startTime)) { return false; }
+
+            if (auto task = getTaskByID(id)) {
+                applyStartTask(task, sessionID, startTime);
+            }
+            return true;
+        }
+
+        case TaskLogRecordType::FinishTask: {
+            TaskID id;
+            if (!(record >> id)) { return false; }
+
+            if (auto task = getTaskByID(id)) {
+                applyFinishTask(task);
+            }
+            return true;
+        }
+
+        case TaskLogRecordType::CancelTask: {
+            TaskID id;
+            if (!(record >> id)) { return false; }
+
+            if (auto task = getTaskByID(id)) {
+                applyCancelTask(task);
+            }
+            return true;
+        }
+
+        case TaskLogRecordType::OpenWorkerSession: {
+            WorkerSessionID id;
+            std::string machineName;
+            std::time_t openTime;
+            size_t count;
+            if (!(record >> id) || !(record >> machineName) || !(record >> openTime) || !(record >> count)) { return false; }
+
+            std::vector<std::string> resources(count);
+            for (auto& resource : resources) {
+                if (!(record >> resource)) { return false; }
+            }
+
+            applyOpenWorkerSession(id, machineName, resources, openTime);
+            return true;
+        }
+
+        case TaskLogRecordType::CloseWorkerSession: {
+            WorkerSessionID id;
+            if (!(record >> id)) { return false; }
+
+            applyCloseWorkerSession(id);
+            return true;
         }
     }
-    str += "}";
-    str += " OptionalResources = {";
-    for (size_t i = 0; i < optionalResources.size(); ++i) {
-        str += optionalResources[i].get();
-        if (i != optionalResources.size() - 1) {
-            str += ", ";
+
+    return false;
+}
+
+
+void TaskDatabase::serializeSnapshotHeader(std::vector<BlobStreamWriter>& outChunks) const
+{
+    BlobStreamWriter counters;
+    counters << TaskSnapshotChunkType::Counters << m_nextPendingOrder << m_stats.numFinished;
+    outChunks.push_back(std::move(counters));
+
+    // Sessions must be restored before the tasks running within them
+    BlobStreamWriter sessions;
+    sessions << TaskSnapshotChunkType::WorkerSessions << m_workerSessions.size();
+    for (const auto& entry : m_workerSessions) {
+        const auto& session = entry.second;
+        const auto* profile = getWorkerProfile(session.profileID);
+        size_t resourceCount = profile ? profile->resources.size() : 0;
+
+        sessions << session.id << session.machineName << session.openTime << session.leaseTime << resourceCount;
+        if (profile) {
+            for (const auto& resource : profile->resources) {
+                sessions << resource;
+            }
         }
     }
-    str += "}";
-    return str;
+    outChunks.push_back(std::move(sessions));
 }
 
 
-void TaskCreateInfo::serialize(BlobStreamWriter& writer) const
+void TaskDatabase::writeSnapshotTask(BlobStreamWriter& writer, const Task& task) const
 {
-    writer << command;
-    writer << schedule;
+    writer << task.m_id << task.m_command << task.m_schedule << task.m_status << task.m_sessionID << task.m_pendingOrder;
 }
 
 
-bool TaskCreateInfo::deserialize(BlobStreamReader& reader)
+void TaskDatabase::writeSnapshotTask(BlobStreamWriter& writer, const SpilledTask& spilled) const
 {
-    if (!(reader >> command)) { return false; }
-    if (!(reader >> schedule)) { return false; }
-    return true;
+    // Spilled tasks are all pending, and are read back from the spill file as they're written
+    TaskStatus status;
+    TaskCreateInfo info;
+    readSpilledTask(spilled, status.createTime, info);
+    writer << spilled.id << info.command << info.schedule << status << NO_WORKER_SESSION << spilled.pendingOrder;
 }
 
 
-void TaskRunStatus::serialize(BlobStreamWriter& writer) const
+void TaskDatabase::beginSnapshot()
 {
-    writer << wasCanceled;
-    writer << startTime;
-    writer << heartbeatTime;
+    m_snapshotHeaderChunks.clear();
+    serializeSnapshotHeader(m_snapshotHeaderChunks);
+
+    m_snapshotPhase = SnapshotPhase::ResidentTasks;
+    m_snapshotCursor = 0;
+    m_snapshotSignatureCursor.clear();
+    m_snapshotEndOrder = m_nextPendingOrder;
+    m_snapshotCopies = BlobStreamWriter();
+    m_snapshotCopyCount = 0;
+    m_snapshotCopiedIDs.clear();
 }
 
-bool TaskRunStatus::deserialize(BlobStreamReader& reader)
+
+bool TaskDatabase::serializeSnapshotChunk(BlobStreamWriter& outChunk)
 {
-    if (!(reader >> wasCanceled)) { return false; }
-    if (!(reader >> startTime)) { return false; }
-    if (!(reader >> heartbeatTime)) { return false; }
+    if (m_snapshotPhase == SnapshotPhase::Idle) { return false; }
+
+    if (!m_snapshotHeaderChunks.empty()) {
+        outChunk = std::move(m_snapshotHeaderChunks.front());
+        m_snapshotHeaderChunks.erase(m_snapshotHeaderChunks.begin());
+        return true;
+    }
+
+    if (m_snapshotCopyCount > 0) {
+        outChunk << TaskSnapshotChunkType::Tasks << m_snapshotCopyCount << m_snapshotCopies.data();
+        m_snapshotCopies = BlobStreamWriter();
+        m_snapshotCopyCount = 0;
+        return true;
+    }
+
+    // Nothing is copied once every task was scanned, so the snapshot is done once the last copies were serialized
+    if (m_snapshotPhase == SnapshotPhase::Scanned) {
+        m_snapshotPhase = SnapshotPhase::Idle;
+        m_snapshotCopiedIDs.clear();
+        return false;
+    }
+
+    // Otherwise, serialize the next tasks the scan reaches. Since IDs are random, this is as likely to reach tasks
+    // created since the snapshot began (which are skipped) as any other.
+    BlobStreamWriter tasks;
+    size_t chunkTaskCount = 0;
+    if (m_snapshotPhase == SnapshotPhase::ResidentTasks) {
+        auto it = m_allTasksByID.lower_bound(m_snapshotCursor);
+        for (; it != m_allTasksByID.end() && chunkTaskCount < (size_t)SNAPSHOT_TASKS_PER_CHUNK; ++it) {
+            const Task& task = *it->second;
+            if (isExcludedFromSnapshot(task.m_id, task.m_pendingOrder)) { continue; }
+            writeSnapshotTask(tasks, task);
+            chunkTaskCount++;
+        }
+        if (it == m_allTasksByID.end()) {
+            m_snapshotPhase = SnapshotPhase::SpilledTasks;
+            m_snapshotCursor = 0;
+            m_snapshotSignatureCursor.clear();
+        }
+        else {
+            m_snapshotCursor = it->first;
+        }
+    }
+    else {
+        // Buckets emptied since the last chunk are gone, so the scan resumes at the first one from the cursor on
+        auto bucketIt = m_pendingBuckets.lower_bound(m_snapshotSignatureCursor);
+        uint64_t fromOrder = (bucketIt != m_pendingBuckets.end() && bucketIt->first == m_snapshotSignatureCursor) ? m_snapshotCursor : 0;
+        for (; bucketIt != m_pendingBuckets.end(); ++bucketIt, fromOrder = 0) {
+            const auto& queue = bucketIt->second.spilledTasks;
+            auto it = std::lower_bound(queue.begin(), queue.end(), fromOrder,
+                [](const SpilledTask& spilled, uint64_t order) { return spilled.pendingOrder < order; });
+            for (; it != queue.end() && chunkTaskCount < (size_t)SNAPSHOT_TASKS_PER_CHUNK; ++it) {
+                if (it->spillOffset == PAGED_IN_SPILL_OFFSET || isExcludedFromSnapshot(it->id, it->pendingOrder)) { continue; }
+                writeSnapshotTask(tasks, *it);
+                chunkTaskCount++;
+            }
+            if (it != queue.end()) {
+                fromOrder = it->pendingOrder;
+                break;
+            }
+        }
+        if (bucketIt == m_pendingBuckets.end()) {
+            m_snapshotPhase = SnapshotPhase::Scanned;
+        }
+        else {
+            m_snapshotSignatureCursor = bucketIt->first;
+            m_snapshotCursor = fromOrder;
+        }
+    }
+
+    outChunk << TaskSnapshotChunkType::Tasks << chunkTaskCount << tasks.data();
     return true;
 }
 
 
-void TaskStatus::serialize(BlobStreamWriter& writer) const
+bool TaskDatabase::isExcludedFromSnapshot(TaskID id, uint64_t pendingOrder) const
+{
+    return pendingOrder >= m_snapshotEndOrder || m_snapshotCopiedIDs.find(id) != m_snapshotCopiedIDs.end();
+}
+
+
+void TaskDatabase::copyIntoSnapshot(const Task& task)
 {
-    writer << createTime;
+    // Resident tasks the scan already passed are in the snapshot as they were (changes to them are logged after it)
+    if (m_snapshotPhase != SnapshotPhase::ResidentTasks || task.m_id < m_snapshotCursor) { return; }
+    if (isExcludedFromSnapshot(task.m_id, task.m_pendingOrder)) { return; }
+
+    writeSnapshotTask(m_snapshotCopies, task);
+    m_snapshotCopyCount++;
+    m_snapshotCopiedIDs.insert(task.m_id);
+}
 
-    if (const auto* runStatusPtr = runStatus.ptrOrNull()) {
-        writer << true;
-        runStatusPtr->serialize(writer);
+
+void TaskDatabase::copyIntoSnapshot(const PendingTaskBucket& bucket, const SpilledTask& spilled)
+{
+    // Paging a task in moves it out of the spilled tasks, where the scan may not have reached it yet
+    if (m_snapshotPhase == SnapshotPhase::Idle || m_snapshotPhase == SnapshotPhase::Scanned) { return; }
+    if (m_snapshotPhase == SnapshotPhase::SpilledTasks && (bucket.signature < m_snapshotSignatureCursor ||
+        (bucket.signature == m_snapshotSignatureCursor && spilled.pendingOrder < m_snapshotCursor))) {
+        return;
+    }
+    if (isExcludedFromSnapshot(spilled.id, spilled.pendingOrder)) { return; }
+
+    writeSnapshotTask(m_snapshotCopies, spilled);
+    m_snapshotCopyCount++;
+    m_snapshotCopiedIDs.insert(spilled.id);
+}
+
+
+bool TaskDatabase::applySnapshotChunk(ArrayView<uint8_t> chunkBytes)
+{
+    BlobStreamReader chunk(chunkBytes);
+
+    TaskSnapshotChunkType type;
+    if (!(chunk >> type)) { return false; }
+
+    switch (type) {
+        case TaskSnapshotChunkType::Counters: {
+            return (chunk >> m_nextPendingOrder) && (chunk >> m_stats.numFinished);
+        }
+
+        case TaskSnapshotChunkType::WorkerSessions: {
+            size_t sessionCount;
+            if (!(chunk >> sessionCount)) { return false; }
+
+            for (size_t i = 0; i < sessionCount; ++i) {
+                WorkerSessionID id;
+                std::string machineName;
+                std::time_t openTime, leaseTime;
+                size_t resourceCount;
+                if (!(chunk >> id) || !(chunk >> machineName) || !(chunk >> openTime) || !(chunk >> leaseTime) || !(chunk >> resourceCount)) {
+                    return false;
+                }
+
+                std::vector<std::string> resources;
+                for (size_t j = 0; j < resourceCount; ++j) {
+                    std::string resource;
+                    if (!(chunk >> resource)) { return false; }
+                    resources.push_back(resource);
+                }
+
+                if (hasWorkerSession(id)) { return false; }
+                applyOpenWorkerSession(id, machineName, resources, openTime);
+                m_workerSessions[id].leaseTime = leaseTime;
+            }
+            return true;
+        }
+
+        case TaskSnapshotChunkType::Tasks: {
+            size_t taskCount;
+            if (!(chunk >> taskCount)) { return false; }
+
+            // Snapshots hold tasks in ID order, so the tasks this chunk spills are appended out of pending order. Each
+            // bucket's are sorted once the chunk is done, then merged with those spilled by earlier chunks.
+            std::map<PendingTaskBucket*, size_t> spilledBefore;
+            bool valid = true;
+            for (size_t i = 0; i < taskCount; ++i) {
+                TaskID id;
+                TaskCreateInfo info;
+                TaskStatus status;
+                WorkerSessionID sessionID;
+                uint64_t pendingOrder;
+                if (!(chunk >> id) || !(chunk >> info.command) || !(chunk >> info.schedule) || !(chunk >> status) ||
+                    !(chunk >> sessionID) || !(chunk >> pendingOrder) || hasTask(id)) {
+                    valid = false;
+                    break;
+                }
+
+                if (status.getState() == TaskState::Pending && shouldSpillPendingTask()) {
+                    auto& bucket = getPendingBucket(info.schedule);
+                    spilledBefore.insert(std::make_pair(&bucket, bucket.spilledTasks.size()));
+                    spillPendingTask(id, pendingOrder, status.createTime, info);
+                    m_stats.numPending++;
+                    continue;
+                }
+
+                TaskPtr task = std::make_shared<Task>(id, m_commands.store(info.command), info.schedule);
+                task->m_status = status;
+                task->m_sessionID = sessionID;
+                addResidentTask(task);
+
+                switch (status.getState()) {
+                    case TaskState::Pending: m_stats.numPending++; break;
+                    case TaskState::Running: m_stats.numRunning++; break;
+                    case TaskState::Canceling: m_stats.numCanceling++; break;
+                }
+
+                if (status.getState() == TaskState::Pending) {
+                    addPendingTask(task, pendingOrder);
+                }
+                else {
+                    auto sessionIt = m_workerSessions.find(sessionID);
+                    if (sessionIt != m_workerSessions.end()) {
+                        sessionIt->second.runningTasks.insert(id);
+                    }
+                }
+            }
+
+            auto byOrder = [](const SpilledTask& a, const SpilledTask& b) { return a.pendingOrder < b.pendingOrder; };
+            for (const auto& entry : spilledBefore) {
+                auto& queue = entry.first->spilledTasks;
+                auto firstNew = queue.begin() + entry.second;
+                std::sort(firstNew, queue.end(), byOrder);
+                std::inplace_merge(queue.begin(), firstNew, queue.end(), byOrder);
+            }
+            return valid;
+        }
+    }
+
+    return false;
+}
+
+
+void TaskDatabase::clear()
+{
+    m_pendingBuckets.clear();
+    m_nextPendingOrder = 0;
+    m_allTasksByID.clear();
+    m_table.clear();
+    m_spilledTasks.clear();
+    if (m_spill) {
+        m_spill->clear();
+    }
+    m_workerSessions.clear();
+    m_workerProfiles.clear();
+    m_workerProfileIDsByResources.clear();
+    m_nextWorkerProfileID = 1;
+    m_stats = TaskStats();
+
+    m_snapshotPhase = SnapshotPhase::Idle;
+    m_snapshotHeaderChunks.clear();
+    m_snapshotCopies = BlobStreamWriter();
+    m_snapshotCopyCount = 0;
+    m_snapshotCopiedIDs.clear();
+}
+
+
+bool TaskDatabase::cleanupIfZombieTask(TaskPtr task, std::time_t heartbeatTimeoutSeconds)
+{
+    bool died = false;
+
+    if (auto* runStatus = task->getStatus().runStatus.ptrOrNull()) {
+        std::time_t diff = getTime() - runStatus->heartbeatTime;
+        died = (diff >= heartbeatTimeoutSeconds);
+    }
+
+    if (died) {
+        markTaskFinished(task);
+    }
+    return died;
+}
+
+
+uint32_t TaskTable::add(TaskID id, const TaskStatus& status)
+{
+    uint32_t slot;
+    if (!m_freeSlots.empty()) {
+        slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
     }
     else {
-        writer << false;
+        slot = (uint32_t)m_ids.size();
+        m_ids.push_back(0);
+        m_states.push_back(0);
+        m_createTimes.push_back(0);
+        m_startTimes.push_back(0);
+        m_heartbeatTimes.push_back(0);
     }
+
+    m_ids[slot] = id;
+    update(slot, status);
+    return slot;
 }
 
 
-bool TaskStatus::deserialize(BlobStreamReader& reader)
+void TaskTable::update(uint32_t slot, const TaskStatus& status)
 {
-    if (!(reader >> createTime)) { return false; }
+    const auto* runStatus = status.runStatus.ptrOrNull();
+    m_states[slot] = toStateMask(status.getState());
+    m_createTimes[slot] = status.createTime;
+    m_startTimes[slot] = runStatus ? runStatus->startTime : 0;
+    m_heartbeatTimes[slot] = runStatus ? runStatus->heartbeatTime : 0;
+}
+
+
+void TaskTable::remove(uint32_t slot)
+{
+    m_ids[slot] = 0;
+    m_states[slot] = 0;
+    m_freeSlots.push_back(slot);
+}
+
 
-    bool hasRunStatus;
-    if (!(reader >> hasRunStatus)) { return false; }
-    if (hasRunStatus) {
-        TaskRunStatus runStatusVal;
-        if (!runStatusVal.deserialize(reader)) { return false; }
-        runStatus = runStatusVal;
+void TaskTable::clear()
+{
+    m_ids.clear();
+    m_states.clear();
+    m_createTimes.clear();
+    m_startTimes.clear();
+    m_heartbeatTimes.clear();
+    m_freeSlots.clear();
+}
+
+
+void TaskTable::find(TaskStateMask states, ArenaVector<TaskID>& outIDs) const
+{
+    const TaskStateMask* stateColumn = m_states.data();
+    for (size_t slot = 0, slotCount = m_states.size(); slot < slotCount; ++slot) {
+        if (stateColumn[slot] & states) {
+            outIDs.push_back(m_ids[slot]);
+        }
+    }
+}
+
+
+std::vector<TaskID> TaskTable::findStale(std::time_t staleTime) const
+{
+    // Stale tasks are rare, so count them with a branchless pass over the two columns first, and only go back for their
+    // IDs if there are any
+    TaskStateMask runningStates = toStateMask(TaskState::Running) | toStateMask(TaskState::Canceling);
+    const TaskStateMask* stateColumn = m_states.data();
+    const std::time_t* heartbeatColumn = m_heartbeatTimes.data();
+    size_t slotCount = m_states.size();
+
+    size_t staleCount = 0;
+    for (size_t slot = 0; slot < slotCount; ++slot) {
+        staleCount += ((stateColumn[slot] & runningStates) != 0) & (heartbeatColumn[slot] <= staleTime);
+    }
+
+    std::vector<TaskID> ids;
+    ids.reserve(staleCount);
+    for (size_t slot = 0; slot < slotCount && ids.size() < staleCount; ++slot) {
+        if ((stateColumn[slot] & runningStates) && heartbeatColumn[slot] <= staleTime) {
+            ids.push_back(m_ids[slot]);
+        }
+    }
+    return ids;
+}
+
+
+ResourceTags makeResourceTags(std::vector<Symbol>&& tags)
+{
+    ResourceTags sorted = std::move(tags);
+    normalizeResourceTags(sorted);
+    return sorted;
+}
+
+
+bool hasResourceTag(ArrayView<Symbol> tags, Symbol tag)
+{
+    // Workers only have a handful of tags, so a linear scan beats a binary search
+    for (int i = 0; i < tags.size(); ++i) {
+        if (tags[i] == tag) { return true; }
+    }
+    return false;
+}
+
+
+TaskState TaskStatus::getState() const
+{
+    if (runStatus.hasValue()) {
+        return runStatus.orDefault().wasCanceled ? TaskState::Canceling : TaskState::Running;
     }
     else {
-        runStatus = Nothing();
+        return TaskState::Pending;
     }
+}
 
-    return true;
+
+std::string TaskSchedule::getSignature() const
+{
+    std::vector<std::string> required, optional;
+    for (const auto& res : requiredResources) { required.push_back(res.get()); }
+    for (const auto& res : optionalResources) { optional.push_back(res.get()); }
+    std::sort(required.begin(), required.end());
+    std::sort(optional.begin(), optional.end());
+    required.erase(std::unique(required.begin(), required.end()), required.end());
+    optional.erase(std::unique(optional.begin(), optional.end()), optional.end());
+
+    // Tags are length-prefixed, so no choice of tag names can make two different schedules collide
+    std::string signature;
+    for (const auto& res : required) { signature += std::to_string(res.size()) + ":" + res; }
+    signature += "|";
+    for (const auto& res : optional) { signature += std::to_string(res.size()) + ":" + res; }
+    return signature;
+}
+
+
+std::string TaskSchedule::toString() const
+{
+    std::string str = "RequiredResources = {";
+    for (size_t i = 0; i < requiredResources.size(); ++i) {
+        str += requiredResources[i].get();
+        if (i != requiredResources.size() - 1) {
+            str += ", ";
+        }
+    }
+    str += "}";
+    str += " OptionalResources = {";
+    for (size_t i = 0; i < optionalResources.size(); ++i) {
+        str += optionalResources[i].get();
+        if (i != optionalResources.size() - 1) {
+            str += ", ";
+        }
+    }
+    str += "}";
+    return str;
 }
 
 
-static std::string intervalToString(time_t interval)
+std::string intervalToString(time_t interval)
 {
     int seconds = interval % 60;
     interval /= 60;
@@ -3,38 +3,76 @@
 #include <vector>
 #include <cstdint>
 #include <ctime>
+#include <deque>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
 #include "Crust/Array.h"
 #include "Crust/Optional.h"
 #include "Crust/PooledString.h"
 #include "Crust/PooledBlob.h"
+#include "Crust/Symbol.h"
 #include "Crust/BlobStream.h"
+#include "Crust/BlobSchema.h"
+#include "Crust/Arena.h"
 #include "Crust/FormattedText.h"
+#include "TaskCommand.h"
 
 
 typedef uint64_t TaskID;
+typedef uint64_t WorkerSessionID;
+typedef uint32_t WorkerProfileID;
 class Task;
 struct TaskSet;
 typedef std::shared_ptr<Task> TaskPtr;
 typedef std::shared_ptr<TaskID> TaskSetPtr;
 typedef std::weak_ptr<Task> TaskWeakPtr;
 
+// Tasks taken to run outside of any worker session (i.e. heartbeated individually) are owned by this session ID
+static const WorkerSessionID NO_WORKER_SESSION = 0;
+
+// A worker's resource tags, sorted (by symbol ID) and without duplicates. Tags are symbols, so matching them against a
+// schedule's tags compares integers, and decoding tags that are already known doesn't allocate.
+typedef std::vector<Symbol> ResourceTags;
+
+ResourceTags makeResourceTags(std::vector<Symbol>&& tags);
+bool hasResourceTag(ArrayView<Symbol> tags, Symbol tag);
+
+// Sorts and dedupes resource tags in place, into the same form as ResourceTags
+template<class Alloc>
+void normalizeResourceTags(std::vector<Symbol, Alloc>& tags)
+{
+    std::sort(tags.begin(), tags.end());
+    tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+}
+
+// How many tasks are grouped into each chunk of a database snapshot. An incremental snapshot serializes one chunk at a
+// time between requests, so this also bounds how long it holds them up.
+static const int SNAPSHOT_TASKS_PER_CHUNK = 16384;
+
+// The spill offset of a spilled task's queue entry once the task has been paged back in (see PendingTaskBucket)
+static const uint64_t PAGED_IN_SPILL_OFFSET = UINT64_MAX;
+
 
 // This encapsulates all the information on when/where to run a task
 struct TaskSchedule
 {
-    std::vector<PooledString> requiredResources; // required resource tags that workers must have to run this task
-    std::vector<PooledString> optionalResources; // optional resource tags that workers are preferred to have to run this task
+    std::vector<Symbol> requiredResources; // required resource tags that workers must have to run this task
+    std::vector<Symbol> optionalResources; // optional resource tags that workers are preferred to have to run this task
 
-    void serialize(BlobStreamWriter& writer) const;
-    bool deserialize(BlobStreamReader& reader);
+    static auto getSchema()
+    {
+        return makeBlobSchema(listField(&TaskSchedule::requiredResources), listField(&TaskSchedule::optionalResources));
+    }
 
+    std::string getSignature() const; // schedules with the same signature are equivalent (resource tag order doesn't matter)
     std::string toString() const;
 };
 
-inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskSchedule& val) { val.serialize(writer); return writer; }
-inline bool operator>>(BlobStreamReader& reader, TaskSchedule& val) { return val.deserialize(reader); }
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskSchedule& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, TaskSchedule& val) { return readBlobSchema(reader, val); }
 
 
 // These task states are simply conveniences for the user when inspecting a Task object. Internal state is NOT
@@ -46,6 +84,11 @@ enum class TaskState : uint8_t
 
 std::string toString(TaskState state);
 
+// A set of task states, as a bitmask of (1 << state)
+typedef uint8_t TaskStateMask;
+inline TaskStateMask toStateMask(TaskState state) { return TaskStateMask(1 << (int)state); }
+std::string intervalToString(std::time_t interval);
+
 
 // This struct describes status information for tasks that are NOT pending; e.g. either running, or finished.
 struct TaskRunStatus
@@ -57,12 +100,15 @@ struct TaskRunStatus
     // This tracks the last time the worker that is running this task was heard from (used to timeout tasks)
     std::time_t heartbeatTime;
 
-    void serialize(BlobStreamWriter& writer) const;
-    bool deserialize(BlobStreamReader& reader);
+    static auto getSchema()
+    {
+        return makeBlobSchema(blobField(&TaskRunStatus::wasCanceled), deltaVarIntField(&TaskRunStatus::startTime),
+            deltaVarIntField(&TaskRunStatus::heartbeatTime));
+    }
 };
 
-inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskRunStatus& val) { val.serialize(writer); return writer; }
-inline bool operator>>(BlobStreamReader& reader, TaskRunStatus& val) { return val.deserialize(reader); }
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskRunStatus& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, TaskRunStatus& val) { return readBlobSchema(reader, val); }
 
 
 // This struct describes the runtime status of a task, i.e. when it was enqueued, when it started running (if it has), etc.
@@ -73,56 +119,86 @@ struct TaskStatus
 
     TaskState getState() const; // this classifies the task into several disjoint states; see TaskState
 
-    void serialize(BlobStreamWriter& writer) const;
-    bool deserialize(BlobStreamReader& reader);
+    static auto getSchema() { return makeBlobSchema(deltaVarIntField(&TaskStatus::createTime), blobField(&TaskStatus::runStatus)); }
 
     std::string toString() const;
 };
 
-inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskStatus& val) { val.serialize(writer); return writer; }
-inline bool operator>>(BlobStreamReader& reader, TaskStatus& val) { return val.deserialize(reader); }
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskStatus& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, TaskStatus& val) { return readBlobSchema(reader, val); }
+
+
+// The status of every task held in memory, stored as one array per field and indexed by the slot each task is given,
+// so filtering or sweeping all tasks scans a few contiguous arrays instead of following a pointer to every Task. Rows
+// mirror each Task's status, and TaskDatabase updates them whenever it changes one. Freed slots are reused.
+class TaskTable
+{
+public:
+    uint32_t add(TaskID id, const TaskStatus& status); // returns the new row's slot
+    void update(uint32_t slot, const TaskStatus& status);
+    void remove(uint32_t slot);
+    void clear();
+
+    void find(TaskStateMask states, ArenaVector<TaskID>& outIDs) const;
+    std::vector<TaskID> findStale(std::time_t staleTime) const; // running tasks last heartbeated at or before staleTime
+
+private:
+    std::vector<TaskID> m_ids;
+    std::vector<TaskStateMask> m_states; // a single state's bit, or 0 for free slots
+    std::vector<std::time_t> m_createTimes;
+    std::vector<std::time_t> m_startTimes; // 0 while pending
+    std::vector<std::time_t> m_heartbeatTimes; // 0 while pending
+    std::vector<uint32_t> m_freeSlots;
+};
 
 
 // This is a simple structure to group together all the information needed to start a task
 struct TaskCreateInfo
 {
-    PooledString command; // a command to run in the shell
+    std::string command; // a command to run in the shell
     TaskSchedule schedule;
 
-    void serialize(BlobStreamWriter& writer) const;
-    bool deserialize(BlobStreamReader& reader);
+    static auto getSchema() { return makeBlobSchema(blobField(&TaskCreateInfo::command), blobField(&TaskCreateInfo::schedule)); }
 };
 
-inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskCreateInfo& val) { val.serialize(writer); return writer; }
-inline bool operator>>(BlobStreamReader& reader, TaskCreateInfo& val) { return val.deserialize(reader); }
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskCreateInfo& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, TaskCreateInfo& val) { return readBlobSchema(reader, val); }
 
 class TaskDB;
+class TaskLog;
+class TaskSpill;
+struct PendingTaskBucket;
 
 
 // Provides methods (private, shared only with TaskDatabase) to change task run state information
 class Task : public std::enable_shared_from_this<Task>
 {
 public:
-    Task(TaskID id, const TaskCreateInfo& startInfo);
+    Task(TaskID id, TaskCommand&& command, const TaskSchedule& schedule);
     
     TaskID getID() const { return m_id; }
     std::string getHexID() const;
     
-    const PooledString& getCommand() const { return m_command; }
+    const TaskCommand& getCommand() const { return m_command; }
     const TaskSchedule& getSchedule() const { return m_schedule; }
     const TaskStatus& getStatus() const { return m_status; }
+    WorkerSessionID getWorkerSessionID() const { return m_sessionID; }
 
 private:
     friend class TaskDatabase;
 
     TaskID m_id;
-    PooledString m_command; // what to execute by the worker
+    TaskCommand m_command; // what to execute by the worker
     TaskSchedule m_schedule; // where and when to run the task
     TaskStatus m_status;
+    WorkerSessionID m_sessionID; // the session of the worker running this task, if it was taken within a session
+    PendingTaskBucket* m_pendingBucket; // the bucket holding this task while it's pending, otherwise null
+    uint64_t m_pendingOrder; // the task's position in its bucket's queue
+    uint32_t m_slot; // the task's row in the database's TaskTable
 
-    void markStarted();
+    void markStarted(std::time_t startTime);
     bool markShouldCancel();
-    void heartbeat();
+    void heartbeat(std::time_t now);
 };
 
 
@@ -134,6 +210,7 @@ struct TaskStats
     int numRunning;
     int numCanceling;
     uint64_t numFinished;
+    int numWorkers;
 };
 
 struct TaskSet
@@ -141,30 +218,238 @@ struct TaskSet
     std::set<TaskID> ids;
 };
 
+// A worker profile is a distinct set of resource tags. Workers register their tags once when opening a session, and
+// all workers registered with identical tags share the same profile (so the server parses each tag set only once).
+struct WorkerProfile
+{
+    WorkerProfileID id;
+    ResourceTags resources;
+    int numWorkers; // the profile is removed once no registered worker uses it anymore
+};
+
+// A worker session is a lease held by a single worker process. As long as the worker keeps renewing its lease, every
+// task it took to run within the session is kept alive, so a worker sends one heartbeat no matter how many tasks it runs.
+// The set of open sessions also serves as the registry of live workers.
+struct WorkerSession
+{
+    WorkerSessionID id;
+    WorkerProfileID profileID;
+    PooledString machineName; // purely informational, reported by the worker itself
+    std::time_t openTime;
+    std::time_t leaseTime; // the last time the worker renewed its lease (used to timeout the whole session)
+    std::set<TaskID> runningTasks;
+};
+
+// All that stays in memory of a pending task kept in the spill file (see TaskSpill), which is paged back in once it's
+// about to run (or anything else needs it)
+struct SpilledTask
+{
+    uint64_t pendingOrder;
+    TaskID id;
+    uint64_t spillOffset;
+};
+
+// Pending tasks with equivalent schedules share one bucket (queued in creation order), so the scheduler only needs to
+// match each distinct schedule against a worker's resources rather than every single pending task.
+struct PendingTaskBucket
+{
+    PendingTaskBucket() : numSpilledTasks(0) {}
+
+    std::string signature;
+    TaskSchedule schedule;
+    std::map<uint64_t, TaskPtr> tasksByOrder;
+
+    // Queued tasks that are only kept in the spill file, in pending order. A task paged in from the middle of the queue
+    // leaves its entry behind, marked with PAGED_IN_SPILL_OFFSET, until the entries ahead of it are gone (or there are
+    // more such entries than live ones), so the front entry is always a spilled task.
+    std::deque<SpilledTask> spilledTasks;
+    size_t numSpilledTasks; // the entries that aren't marked paged in
+
+    size_t getTaskCount() const { return tasksByOrder.size() + numSpilledTasks; }
+    uint64_t getOldestOrder() const; // the bucket must not be empty
+    SpilledTask* findSpilledTask(uint64_t pendingOrder); // the entry of the task with this pending order, if it's queued
+    void removeSpilledTask(SpilledTask& spilled); // once it's paged in
+};
+
+// Finds spilled tasks by ID: an open-addressing hash table with linear probing, so each spilled task takes one flat slot
+// rather than a node of its own. Removing an entry shifts back the ones probed past it, so there are no tombstones.
+class SpilledTaskIndex
+{
+public:
+    struct Entry
+    {
+        TaskID id;
+        PendingTaskBucket* bucket; // null in empty slots
+        uint64_t pendingOrder;
+    };
+
+    SpilledTaskIndex() : m_count(0) {}
+
+    void add(TaskID id, PendingTaskBucket* bucket, uint64_t pendingOrder);
+    const Entry* find(TaskID id) const;
+    void remove(TaskID id);
+    void clear();
+    size_t size() const { return m_count; }
+
+private:
+    static size_t getHomeSlot(TaskID id, size_t mask);
+    void grow();
+
+    std::vector<Entry> m_slots; // a power of two of them, at most half full
+    size_t m_count;
+};
+
+
+// The kinds of mutations TaskDatabase appends to its log. Replaying a log's records in order rebuilds the database.
+enum class TaskLogRecordType : uint8_t
+{
+    CreateTask, StartTask, FinishTask, CancelTask, OpenWorkerSession, CloseWorkerSession
+};
+
+// The kinds of chunks a TaskDatabase snapshot is made of. Tasks are spread over many chunks, so snapshots of any size
+// can be written and restored a chunk at a time.
+enum class TaskSnapshotChunkType : uint8_t
+{
+    Counters, WorkerSessions, Tasks
+};
+
+
 class TaskDatabase
 {
 public:
-    TaskPtr getTaskByID(TaskID id) const;
-    std::vector<TaskPtr> getTasksByStates(const std::set<TaskState>& states) const;
+    TaskDatabase();
+    TaskDatabase(const TaskDatabase&) = delete;
+
+    // Every mutation is appended to the log (if one is set) as it happens; the log's owner decides when to commit it.
+    // Heartbeats and lease renewals are not logged, since they have no lasting effect.
+    void setLog(TaskLog* log) { m_log = log; }
+    // Once this many pending tasks are in memory, newly pending tasks are kept in the spill file instead, until they're
+    // paged back in. Without a spill file, every task is kept in memory.
+    void setSpill(TaskSpill* spill, size_t maxResidentPendingTasks) { m_spill = spill; m_maxResidentPendingTasks = maxResidentPendingTasks; }
+    bool applyLogRecord(ArrayView<uint8_t> record); // replays a logged mutation (without logging it again); false if corrupt
+    void renewAllLeases(); // gives every running task and worker session a fresh heartbeat, e.g. after replaying a log
+
+    // Replaying a request trace runs the database on a virtual clock, which only moves when it's set, and draws task and
+    // worker session IDs from a generator seeded like the traced server's, so the replay assigns the very same IDs
+    void setVirtualTime(std::time_t time) { m_virtualTime = time; }
+    void seedIDs(uint64_t seed);
+    std::time_t getTime() const; // the virtual time if one is set, otherwise the current time
+
+    // A snapshot captures the whole database as a sequence of chunks. Restoring must apply all of them, in order, to an
+    // empty database; logged mutations made after the snapshot can then be replayed on top of it.
+    //
+    // A snapshot captures the database as it was when it began, but is serialized a chunk at a time, e.g. one per poll
+    // cycle, so a large database neither stalls requests nor has to fit in memory twice. Until it's done, a task about to
+    // change before its chunk was serialized is copied into the snapshot first (and tasks created since it began are
+    // left out). Heartbeats don't count as changes, since they aren't logged either.
+    void beginSnapshot();
+    bool serializeSnapshotChunk(BlobStreamWriter& outChunk); // false, writing nothing, once every chunk was serialized
+    bool applySnapshotChunk(ArrayView<uint8_t> chunk); // false if corrupt
+    void clear(); // removes every task and worker session without logging anything, e.g. before restoring a snapshot
+
+    bool hasTask(TaskID id) const;
+    TaskPtr getTaskByID(TaskID id); // pages the task back in if it was spilled, so use it to change the task
+    // Only looking a task up doesn't page it in: a spilled task is read from the spill file instead, so polling the
+    // status of a large backlog keeps memory bounded
+    TaskPtr getResidentTask(TaskID id) const; // null if it isn't in memory
+    bool readSpilledTask(TaskID id, TaskCreateInfo& outInfo, TaskStatus& outStatus) const; // false if it isn't spilled
+    void getTasksByStates(TaskStateMask states, ArenaVector<TaskPtr>& outTasks); // only the tasks in memory; see getSpilledTasks
+    // Spilled tasks are all pending. Their IDs and creation times are read from the spill file without paging them back in.
+    void getSpilledTasks(ArenaVector<std::pair<TaskID, std::time_t>>& outTasks) const;
     int getTotalTaskCount() const;
+    int getSpilledTaskCount() const { return (int)m_spilledTasks.size(); }
     TaskStats getStats() const { return m_stats; }
 
-    TaskPtr createTask(const TaskCreateInfo& startInfo);
-    TaskPtr takeTaskToRun(const std::set<std::string>& haveResources);
+    TaskID createTask(const TaskCreateInfo& startInfo);
+    // Taken tasks are appended to outTasks, whose arena also holds the temporaries of matching them. haveResources must
+    // be normalized (see normalizeResourceTags); the session overload matches the resources the session's worker registered.
+    void takeTasksToRun(ArrayView<Symbol> haveResources, int maxCount, WorkerSessionID sessionID, ArenaVector<TaskPtr>& outTasks);
+    void takeTasksToRun(WorkerSessionID sessionID, int maxCount, ArenaVector<TaskPtr>& outTasks);
     void heartbeatTask(TaskPtr task);
     void markTaskFinished(TaskPtr task); // this should be called whenever a running task finishes, whether or not it was canceled while it was running
     void markTaskShouldCancel(TaskPtr task);
 
+    WorkerSessionID openWorkerSession(const std::string& machineName, const std::vector<std::string>& resources);
+    bool hasWorkerSession(WorkerSessionID id) const;
+    const WorkerSession* getWorkerSession(WorkerSessionID id) const;
+    const WorkerProfile* getWorkerProfile(WorkerProfileID id) const;
+    const std::unordered_map<WorkerSessionID, WorkerSession>& getWorkerSessions() const { return m_workerSessions; }
+    const std::map<WorkerProfileID, WorkerProfile>& getWorkerProfiles() const { return m_workerProfiles; }
+    Optional<std::vector<TaskID>> renewWorkerSession(WorkerSessionID id); // returns the session's canceled tasks, or nothing if the session expired
+    void closeWorkerSession(WorkerSessionID id);
+
     void cleanupZombieTasks(std::time_t heartbeatTimeoutSeconds);
 
 private:
     friend class Task;
 
+    uint64_t getRandomID() const;
     TaskID getUnusedTaskID() const;
+    WorkerSessionID getUnusedWorkerSessionID() const;
+    WorkerProfileID acquireWorkerProfile(const std::vector<std::string>& resources);
+    void releaseWorkerProfile(WorkerProfileID id);
     bool cleanupIfZombieTask(TaskPtr task, std::time_t heartbeatTimeoutSeconds);
-
-    std::set<TaskPtr> m_pendingTasks;
-    std::map<TaskID, TaskPtr> m_allTasksByID;
+    PendingTaskBucket& getPendingBucket(const TaskSchedule& schedule);
+    void addPendingTask(TaskPtr task, uint64_t pendingOrder);
+    void removePendingTask(TaskPtr task);
+    TaskPtr takeOldestPendingTask(PendingTaskBucket& bucket);
+
+    // Spilling keeps a pending task's creation time and info in the spill file, and only an index entry in memory
+    bool shouldSpillPendingTask() const;
+    PendingTaskBucket& spillPendingTask(TaskID id, uint64_t pendingOrder, std::time_t createTime, const TaskCreateInfo& info);
+    size_t readSpilledTask(const SpilledTask& spilled, std::time_t& outCreateTime, TaskCreateInfo& outInfo) const; // returns the record's size
+    TaskPtr pageInTask(TaskID id); // spills another task if there are then too many in memory
+    void spillNewestResidentTask(const Task& except);
+    void compactSpill();
+    void addResidentTask(TaskPtr task);
+
+    void serializeSnapshotHeader(std::vector<BlobStreamWriter>& outChunks) const; // the counters and worker sessions
+    void writeSnapshotTask(BlobStreamWriter& writer, const Task& task) const;
+    void writeSnapshotTask(BlobStreamWriter& writer, const SpilledTask& spilled) const;
+    bool isExcludedFromSnapshot(TaskID id, uint64_t pendingOrder) const; // created since it began, or already copied
+    void copyIntoSnapshot(const Task& task); // called before changing a task, while an incremental snapshot is running
+    void copyIntoSnapshot(const PendingTaskBucket& bucket, const SpilledTask& spilled);
+
+    // These apply mutations with all their inputs given explicitly, so logged mutations replay identically. Records are
+    // only serialized while the log keeps them somewhere.
+    bool isLogging() const;
+    void logRecord(const BlobStreamWriter& record);
+    void applyCreateTask(TaskID id, std::time_t createTime, const TaskCreateInfo& info);
+    void applyStartTask(TaskPtr task, WorkerSessionID sessionID, std::time_t startTime);
+    void applyFinishTask(TaskPtr task);
+    void applyCancelTask(TaskPtr task);
+    void applyOpenWorkerSession(WorkerSessionID id, const std::string& machineName, const std::vector<std::string>& resources, std::time_t openTime);
+    void applyCloseWorkerSession(WorkerSessionID id);
+
+    std::map<std::string, PendingTaskBucket> m_pendingBuckets;
+    uint64_t m_nextPendingOrder;
+    TaskCommandStore m_commands;
+    std::map<TaskID, TaskPtr> m_allTasksByID; // every task except the spilled ones
+    TaskTable m_table; // the status of every task in m_allTasksByID
+    SpilledTaskIndex m_spilledTasks; // where each spilled task is queued
+    std::unordered_map<WorkerSessionID, WorkerSession> m_workerSessions; // looked up by every worker request and renewal
+    std::map<WorkerProfileID, WorkerProfile> m_workerProfiles;
+    std::map<ResourceTags, WorkerProfileID> m_workerProfileIDsByResources;
+    WorkerProfileID m_nextWorkerProfileID;
     TaskStats m_stats;
+    TaskLog* m_log;
+    TaskSpill* m_spill;
+    size_t m_maxResidentPendingTasks;
+    Optional<std::time_t> m_virtualTime;
+    mutable std::mt19937_64 m_idRandom;
+    bool m_seededIDs; // otherwise IDs are drawn from rand() and the clock
+
+    // The incremental snapshot being serialized, if any. Resident tasks are serialized in ID order, then spilled ones
+    // bucket by bucket (in signature order), each bucket's in pending order. The cursor is the lowest ID, or the bucket
+    // and lowest pending order, of the current phase that hasn't been serialized yet.
+    enum class SnapshotPhase : uint8_t { Idle, ResidentTasks, SpilledTasks, Scanned };
+    SnapshotPhase m_snapshotPhase;
+    TaskID m_snapshotCursor; // or the pending order, while serializing spilled tasks
+    std::string m_snapshotSignatureCursor;
+    uint64_t m_snapshotEndOrder; // tasks with this pending order or later were created after the snapshot began
+    std::vector<BlobStreamWriter> m_snapshotHeaderChunks; // captured when the snapshot began, and serialized first
+    BlobStreamWriter m_snapshotCopies; // tasks copied before they changed, waiting for the next chunk
+    size_t m_snapshotCopyCount;
+    std::set<TaskID> m_snapshotCopiedIDs;
 };
 
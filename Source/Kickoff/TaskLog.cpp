@@ -0,0 +1,153 @@
+#include "TaskLog.h"
+#include "TaskDatabase.h"
+#include "TaskReplication.h"
+#include "Crust/Util.h"
+#include "Crust/MappedFile.h"
+#include "Crust/Error.h"
+
+
+static uint32_t recordChecksum(ArrayView<uint8_t> payload)
+{
+    return (uint32_t)hashData(payload);
+}
+
+
+TaskLog::TaskLog()
+    : m_file(nullptr)
+    , m_size(0)
+    , m_backlog(nullptr)
+    , m_nextSequence(0)
+    , m_uncommittedRecordCount(0)
+{
+}
+
+
+TaskLog::~TaskLog()
+{
+    close();
+}
+
+
+void TaskLog::writeRecord(std::vector<uint8_t>& out, ArrayView<uint8_t> payload)
+{
+    uint32_t header[2] = { (uint32_t)payload.size(), recordChecksum(payload) };
+    const uint8_t* headerBytes = (const uint8_t*)header;
+    out.insert(out.end(), headerBytes, headerBytes + sizeof(header));
+    if (payload.size() > 0) {
+        out.insert(out.end(), &payload.first(), &payload.first() + payload.size());
+    }
+}
+
+
+bool TaskLog::readRecord(const uint8_t* data, uint64_t size, uint64_t& offset, ArrayView<uint8_t>& outPayload)
+{
+    if (offset > size || size - offset < TASK_LOG_RECORD_HEADER_SIZE) { return false; }
+
+    uint32_t payloadSize, checksum;
+    memcpy(&payloadSize, data + offset, sizeof(payloadSize));
+    memcpy(&checksum, data + offset + sizeof(payloadSize), sizeof(checksum));
+
+    uint64_t payloadOffset = offset + TASK_LOG_RECORD_HEADER_SIZE;
+    if (payloadSize > size - payloadOffset || payloadSize > (uint32_t)INT_MAX) { return false; }
+
+    ArrayView<uint8_t> payload(data + payloadOffset, (int)payloadSize);
+    if (recordChecksum(payload) != checksum) { return false; }
+
+    outPayload = payload;
+    offset = payloadOffset + payloadSize;
+    return true;
+}
+
+
+Optional<uint64_t> TaskLog::replay(const std::string& path, TaskDatabase& db)
+{
+    if (!fileExists(path)) {
+        return (uint64_t)0;
+    }
+
+    MappedFile file;
+    if (!file.open(path)) {
+        return Nothing();
+    }
+
+    uint64_t offset = 0;
+    ArrayView<uint8_t> payload;
+    while (true) {
+        uint64_t recordOffset = offset;
+        if (!readRecord(file.data(), file.size(), offset, payload)) { break; }
+        if (!db.applyLogRecord(payload)) {
+            offset = recordOffset;
+            break;
+        }
+    }
+
+    if (offset != file.size()) {
+        printWarning("Discarding " + std::to_string(file.size() - offset) + " bytes of torn or corrupt records at the end of \"" + path + "\"");
+    }
+    return offset;
+}
+
+
+bool TaskLog::open(const std::string& path, uint64_t validSize)
+{
+    close();
+
+    // Create the file if needed without truncating it, then cut off anything past the last intact record
+    FILE* file = nullptr;
+    if (fopen_s(&file, path.c_str(), "ab") != 0 || !file) { return false; }
+    fclose(file);
+
+    if (fopen_s(&file, path.c_str(), "r+b") != 0 || !file) { return false; }
+    if (!truncateFile(file, validSize) || _fseeki64(file, 0, SEEK_END) != 0) {
+        fclose(file);
+        return false;
+    }
+
+    m_file = file;
+    m_path = path;
+    m_size = validSize;
+    return true;
+}
+
+
+void TaskLog::close()
+{
+    commit();
+    if (m_file) {
+        fclose(m_file);
+        m_file = nullptr;
+    }
+    m_size = 0;
+}
+
+
+void TaskLog::append(ArrayView<uint8_t> record)
+{
+    if (!isEnabled()) { return; }
+
+    writeRecord(m_uncommitted, record);
+    m_uncommittedRecordCount++;
+    m_nextSequence++;
+}
+
+
+bool TaskLog::commit()
+{
+    if (m_uncommitted.empty()) { return true; }
+
+    bool written = true;
+    if (m_file) {
+        written = fwrite(m_uncommitted.data(), m_uncommitted.size(), 1, m_file) == 1;
+        written = written && flushFileToDisk(m_file);
+        m_size += m_uncommitted.size();
+    }
+
+    // Only records that are durable are shipped, so a standby never gets ahead of its primary's own log
+    if (m_backlog && written) {
+        m_backlog->add(m_nextSequence - m_uncommittedRecordCount, m_uncommittedRecordCount, std::move(m_uncommitted));
+    }
+
+    m_uncommitted.clear();
+    m_uncommittedRecordCount = 0;
+    return written;
+}
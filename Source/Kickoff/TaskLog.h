@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include "Crust/Array.h"
+#include "Crust/Optional.h"
+
+class TaskDatabase;
+class ReplicationBacklog;
+
+// The size of the [uint32 payload size][uint32 payload checksum] header that frames each record
+static const size_t TASK_LOG_RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+
+// An append-only write-ahead log of TaskDatabase mutations. Appended records are only buffered in memory; commit()
+// writes every record buffered since the last commit and makes them durable with a single fsync, so the server can
+// group-commit all of the requests it handles in one poll cycle before replying to any of them.
+//
+// Each record is framed as [uint32 payload size][uint32 payload checksum][payload], so a torn record at the end of
+// the file (e.g. from a crash in the middle of a write) is detected and discarded on replay.
+//
+// Records are numbered by a sequence that keeps counting across log files. Committed records are also handed to the
+// replication backlog (if one is set), which streams them to standby servers. Without an open file, the log only feeds
+// the backlog, and without either, appended records are dropped (and the sequence doesn't advance).
+class TaskLog
+{
+public:
+    TaskLog();
+    ~TaskLog();
+    TaskLog(const TaskLog&) = delete;
+
+    // Replays every intact record of the log file into the database, returning the size in bytes of the intact part of
+    // the log (zero if the file doesn't exist), or nothing if the file exists but can't be read.
+    static Optional<uint64_t> replay(const std::string& path, TaskDatabase& db);
+
+    // The record framing, shared with snapshots. readRecord advances offset past the record, and fails (leaving offset
+    // unchanged) if the data ends before the record does or the record's checksum doesn't match.
+    static void writeRecord(std::vector<uint8_t>& out, ArrayView<uint8_t> payload);
+    static bool readRecord(const uint8_t* data, uint64_t size, uint64_t& offset, ArrayView<uint8_t>& outPayload);
+
+    // Opens the log for appending, discarding anything past validSize (i.e. a torn record found by replay)
+    bool open(const std::string& path, uint64_t validSize);
+    void close();
+    bool isOpen() const { return m_file != nullptr; }
+
+    void setBacklog(ReplicationBacklog* backlog) { m_backlog = backlog; }
+    bool hasBacklog() const { return m_backlog != nullptr; }
+    bool isEnabled() const { return m_file || m_backlog; } // whether appended records go anywhere
+
+    void append(ArrayView<uint8_t> record);
+    bool commit();
+    bool hasUncommittedRecords() const { return !m_uncommitted.empty(); }
+    uint64_t getSize() const { return m_size; } // the committed size of the log file
+    uint64_t getNextSequence() const { return m_nextSequence; } // the sequence number the next appended record will get
+    uint64_t getCommittedSequence() const { return m_nextSequence - m_uncommittedRecordCount; } // that of the first uncommitted record
+
+private:
+    FILE* m_file;
+    std::string m_path;
+    uint64_t m_size;
+    ReplicationBacklog* m_backlog;
+    uint64_t m_nextSequence;
+    std::vector<uint8_t> m_uncommitted;
+    int m_uncommittedRecordCount;
+};
@@ -0,0 +1,77 @@
+#include "TaskReplication.h"
+#include "TaskLog.h"
+#include <algorithm>
+
+
+ReplicationBacklog::ReplicationBacklog()
+    : m_totalBytes(0)
+    , m_firstSequence(0)
+    , m_nextSequence(0)
+{
+}
+
+
+void ReplicationBacklog::add(uint64_t firstSequence, int recordCount, std::vector<uint8_t>&& records)
+{
+    if (recordCount <= 0) { return; }
+    if (firstSequence != m_nextSequence) {
+        clear(firstSequence);
+    }
+
+    Batch batch;
+    batch.firstSequence = firstSequence;
+    batch.recordCount = recordCount;
+    batch.records = std::move(records);
+
+    m_totalBytes += batch.records.size();
+    m_nextSequence = firstSequence + recordCount;
+    m_batches.push_back(std::move(batch));
+
+    // Always keep the newest batch, no matter how large it is
+    while (m_totalBytes > REPLICATION_BACKLOG_MAX_BYTES && m_batches.size() > 1) {
+        m_totalBytes -= m_batches.front().records.size();
+        m_batches.pop_front();
+        m_firstSequence = m_batches.front().firstSequence;
+    }
+}
+
+
+void ReplicationBacklog::clear(uint64_t nextSequence)
+{
+    m_batches.clear();
+    m_totalBytes = 0;
+    m_firstSequence = nextSequence;
+    m_nextSequence = nextSequence;
+}
+
+
+bool ReplicationBacklog::getRecords(uint64_t fromSequence, size_t maxBytes, std::vector<uint8_t>& outRecords, int& outRecordCount) const
+{
+    outRecords.clear();
+    outRecordCount = 0;
+    if (fromSequence < m_firstSequence || fromSequence > m_nextSequence) { return false; }
+
+    // Find the batch holding the first requested record
+    auto it = std::upper_bound(m_batches.begin(), m_batches.end(), fromSequence, [](uint64_t sequence, const Batch& batch) {
+        return sequence < batch.firstSequence;
+    });
+    if (it == m_batches.begin()) { return true; } // nothing newer than fromSequence
+    --it;
+
+    for (; it != m_batches.end(); ++it) {
+        // Skip over the records of the first batch that the standby already has
+        uint64_t offset = 0;
+        ArrayView<uint8_t> payload;
+        for (uint64_t sequence = it->firstSequence; sequence < fromSequence; ++sequence) {
+            TaskLog::readRecord(it->records.data(), it->records.size(), offset, payload);
+        }
+
+        int skippedCount = int(std::max(fromSequence, it->firstSequence) - it->firstSequence);
+        if (skippedCount >= it->recordCount) { continue; }
+        if (outRecordCount > 0 && outRecords.size() + (it->records.size() - offset) > maxBytes) { break; }
+
+        outRecords.insert(outRecords.end(), it->records.begin() + (size_t)offset, it->records.end());
+        outRecordCount += it->recordCount - skippedCount;
+    }
+    return true;
+}
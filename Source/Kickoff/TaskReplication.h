@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <cstdint>
+
+
+// The most recently committed log records kept in memory for standby servers to stream; a standby that falls further
+// behind than this has to start over from a full snapshot
+static const size_t REPLICATION_BACKLOG_MAX_BYTES = 256 * 1024 * 1024;
+
+// The most record bytes a primary sends a standby in one reply
+static const size_t REPLICATION_BATCH_MAX_BYTES = 4 * 1024 * 1024;
+
+// How often a standby that's caught up asks its primary for new records
+static const int REPLICATION_POLL_INTERVAL_MS = 50;
+
+// How long a standby waits for its primary to reply before reconnecting
+static const int REPLICATION_TIMEOUT_MS = 5000;
+
+// How long a standby waits for a snapshot instead. The primary serializes it a chunk per poll cycle, between handling
+// other requests, so a large one takes a while.
+static const int REPLICATION_SNAPSHOT_TIMEOUT_MS = 60 * 1000;
+
+
+// Recently committed log records (still in their log framing), indexed by sequence number. The primary keeps appending
+// committed batches and discards the oldest ones once the backlog grows too large.
+class ReplicationBacklog
+{
+public:
+    ReplicationBacklog();
+
+    void add(uint64_t firstSequence, int recordCount, std::vector<uint8_t>&& records);
+    void clear(uint64_t nextSequence); // forgets every record, e.g. when the log's sequence starts over
+
+    // Gets framed records starting at the given sequence number (at least one record if any are available, but otherwise
+    // up to roughly maxBytes of them). Returns false if the records have already been discarded or don't exist yet.
+    bool getRecords(uint64_t fromSequence, size_t maxBytes, std::vector<uint8_t>& outRecords, int& outRecordCount) const;
+
+private:
+    struct Batch
+    {
+        uint64_t firstSequence;
+        int recordCount;
+        std::vector<uint8_t> records;
+    };
+
+    std::deque<Batch> m_batches;
+    size_t m_totalBytes;
+    uint64_t m_firstSequence; // the oldest sequence number still in the backlog
+    uint64_t m_nextSequence;
+};
@@ -1,8 +1,14 @@
 #include "TaskServer.h"
 #include "Crust/Array.h"
 #include "Crust/Error.h"
+#include "Crust/Util.h"
+#include "TaskSnapshot.h"
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <random>
+#include <deque>
+#include <cstdint>
 
 
 static const int MIN_TASK_POLL_MS = 1000;
@@ -12,14 +18,44 @@ static const int MAX_TASK_POLL_MS = 60 * 1000;
 static zmq::message_t toMessage(ArrayView<uint8_t> bytes)
 {
     zmq::message_t replyMsg(bytes.size());
-    memcpy(replyMsg.data(), (const void*)&bytes.first(), bytes.size());
-    return std::move(replyMsg);
+    if (bytes.size() > 0) {
+        memcpy(replyMsg.data(), (const void*)&bytes.first(), bytes.size());
+    }
+    return replyMsg;
+}
+
+
+static void recycleMessageBuffer(void* data, void* hint)
+{
+    BlobStreamWriter::recycleBuffer((std::vector<uint8_t>*)hint);
+}
+
+
+// Hands the writer's buffer over to the message, which gives it back to the writers' pool once it's been sent
+static zmq::message_t toMessage(BlobStreamWriter&& writer)
+{
+    if (writer.size() < MIN_ZERO_COPY_MESSAGE_BYTES) {
+        return toMessage(writer.data());
+    }
+
+    auto buffer = writer.releaseBuffer();
+    return zmq::message_t(buffer->data(), buffer->size(), recycleMessageBuffer, buffer);
 }
 
 
-static zmq::message_t toMessage(const BlobStreamWriter& writer)
+// Writes list items after reserving their exact size, so long replies are built without reallocating
+template<class Items>
+static void writeItems(BlobStreamWriter& writer, const Items& items)
 {
-    return std::move(toMessage(writer.data()));
+    BlobStreamWriter counter = writer.makeCounter();
+    for (const auto& item : items) {
+        counter << item;
+    }
+
+    writer.reserve(writer.size() + counter.size());
+    for (const auto& item : items) {
+        writer << item;
+    }
 }
 
 
@@ -29,51 +65,876 @@ static ArrayView<uint8_t> viewMessage(const zmq::message_t& msg)
 }
 
 
-TaskServer::TaskServer(int port)
-    : m_port(port)
+static uint64_t newReplicationEpoch()
+{
+    std::random_device device;
+    return (uint64_t(device()) << 32) | uint64_t(device());
+}
+
+
+// Requests a standby server still answers, since they don't change anything
+static bool isReadOnlyRequest(TaskRequestType type)
+{
+    switch (type) {
+        case TaskRequestType::GetCommand:
+        case TaskRequestType::GetSchedule:
+        case TaskRequestType::GetStatus:
+        case TaskRequestType::GetStats:
+        case TaskRequestType::GetTasksByStates:
+        case TaskRequestType::GetWorkers:
+        case TaskRequestType::GetReplicationSnapshot:
+        case TaskRequestType::GetReplicationRecords:
+        case TaskRequestType::PromoteToPrimary:
+        case TaskRequestType::Hello:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+const char* getRequestTypeName(TaskRequestType type)
+{
+    switch (type) {
+        case TaskRequestType::GetCommand: return "GetCommand";
+        case TaskRequestType::GetSchedule: return "GetSchedule";
+        case TaskRequestType::GetStatus: return "GetStatus";
+        case TaskRequestType::GetStats: return "GetStats";
+        case TaskRequestType::GetTasksByStates: return "GetTasksByStates";
+        case TaskRequestType::Create: return "Create";
+        case TaskRequestType::TakeToRun: return "TakeToRun";
+        case TaskRequestType::HeartbeatAndCheckWasTaskCanceled: return "HeartbeatAndCheckWasTaskCanceled";
+        case TaskRequestType::MarkFinished: return "MarkFinished";
+        case TaskRequestType::MarkShouldCancel: return "MarkShouldCancel";
+        case TaskRequestType::OpenWorkerSession: return "OpenWorkerSession";
+        case TaskRequestType::RenewWorkerSession: return "RenewWorkerSession";
+        case TaskRequestType::CloseWorkerSession: return "CloseWorkerSession";
+        case TaskRequestType::TakeToRunInSession: return "TakeToRunInSession";
+        case TaskRequestType::GetWorkers: return "GetWorkers";
+        case TaskRequestType::TakeManyToRunInSession: return "TakeManyToRunInSession";
+        case TaskRequestType::CreateMany: return "CreateMany";
+        case TaskRequestType::FinishAndTakeToRunInSession: return "FinishAndTakeToRunInSession";
+        case TaskRequestType::GetReplicationSnapshot: return "GetReplicationSnapshot";
+        case TaskRequestType::GetReplicationRecords: return "GetReplicationRecords";
+        case TaskRequestType::PromoteToPrimary: return "PromoteToPrimary";
+        case TaskRequestType::HandOff: return "HandOff";
+        case TaskRequestType::Hello: return "Hello";
+        case TaskRequestType::Versioned: return "Versioned";
+        default: return "Unknown";
+    }
+}
+
+
+TaskServer::TaskServer(int port, const std::string& dataDir)
+    : m_maxResidentPendingTasks(0)
+    , m_port(port)
+    , m_dataDir(dataDir)
+    , m_logGeneration(0)
+    , m_oldestLogGeneration(0)
+    , m_snapshotLogGeneration(0)
+    , m_snapshotting(false)
+    , m_snapshotSequence(0)
+    , m_replicationEpoch(newReplicationEpoch())
+    , m_awaitingPrimaryReply(false)
+    , m_syncedWithPrimary(false)
+    , m_primaryEpoch(0)
+    , m_primarySequence(0)
+    , m_takingOver(false)
+    , m_waitingForPort(false)
+    , m_handedOff(false)
     , m_context(1)
-    , m_responder(m_context, ZMQ_REP)
+    , m_responder(m_context, ZMQ_ROUTER)
     , m_running(false)
+{
+    // Changes are only logged once there's somewhere to keep them: the data directory, or the backlog once a standby
+    // has connected (see beginSnapshot)
+    m_db.setLog(&m_log);
+}
+
+
+bool TaskServer::tryBindPort()
 {
     try {
         m_responder.bind("tcp://*:" + std::to_string(m_port));
+        return true;
     }
     catch (zmq::error_t) {
+        return false;
+    }
+}
+
+
+void TaskServer::bindPort()
+{
+    if (!tryBindPort()) {
         printError("Failed to start server on port " + std::to_string(m_port) + "!");
         exit(-1);
     }
 }
 
 
-void TaskServer::processRequest()
+void TaskServer::bindHandedOffPort()
 {
-    // Get a request
-    zmq::message_t request;
-    m_responder.recv(&request);
+    if (!tryBindPort()) {
+        if (std::chrono::steady_clock::now() >= m_portGiveUpTime) {
+            printError("The old server process never released port " + std::to_string(m_port) + "!");
+            exit(-1);
+        }
+        return;
+    }
 
-    // Generate a reply, and track statistics about the reply type
-    auto reply = generateReply(viewMessage(request));
+    // The old process closed its connection to the private endpoint before releasing the port, so it's no longer needed
+    m_waitingForPort = false;
+    m_responder.unbind(m_handOffEndpoint);
+    ColoredString("Took over port " + std::to_string(m_port) + "\n", TextColor::LightCyan).print();
+}
 
-    TaskReplyType type = *(TaskReplyType*)(&reply.data().first());
-    if (type == TaskReplyType::Success) { m_stats.succeededRequests++; }
-    else if (type == TaskReplyType::Failed) { m_stats.failedRequests++; }
-    else if (type == TaskReplyType::BadRequest) { m_stats.badRequests++; }
 
-    // Send the reply
-    m_responder.send(toMessage(reply));
+void TaskServer::restoreFromDisk()
+{
+    auto startTime = std::chrono::steady_clock::now();
+    makeDirectory(m_dataDir);
+
+    std::string snapshotPath = m_dataDir + "/" + TASK_SNAPSHOT_FILENAME;
+    if (fileExists(snapshotPath)) {
+        m_logGeneration = TaskSnapshot::load(snapshotPath, m_db).orFail("Failed to load the snapshot \"" + snapshotPath + "\"");
+    }
+
+    // Logs the snapshot already covers are left behind if the server stopped right after writing it
+    for (uint64_t generation = m_logGeneration; generation > 0 && fileExists(getLogPath(generation - 1)); --generation) {
+        deleteFile(getLogPath(generation - 1));
+    }
+    m_oldestLogGeneration = m_logGeneration;
+
+    // Replay every log generation written since the snapshot. Only the newest one may end in a torn record, since a
+    // generation is always fully committed before the next one starts.
+    uint64_t validLogSize = 0;
+    while (true) {
+        std::string logPath = getLogPath(m_logGeneration);
+        validLogSize = TaskLog::replay(logPath, m_db).orFail("Failed to read the task log \"" + logPath + "\"");
+
+        if (!fileExists(getLogPath(m_logGeneration + 1))) { break; }
+        if (validLogSize != getFileSize(logPath).orDefault(0)) {
+            fail("The task log \"" + logPath + "\" is corrupt, but later logs depend on it");
+        }
+        m_logGeneration++;
+    }
+
+    if (!m_log.open(getLogPath(m_logGeneration), validLogSize)) {
+        fail("Failed to open the task log \"" + getLogPath(m_logGeneration) + "\" for writing");
+    }
+
+    // Workers get a full timeout period to reconnect and resume heartbeating the tasks they were running
+    m_db.renewAllLeases();
+
+    auto elapsedMS = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+    auto stats = m_db.getStats();
+    ColoredString("Restored " + std::to_string(m_db.getTotalTaskCount()) + " tasks (" + std::to_string(stats.numRunning + stats.numCanceling) +
+        " running) and " + std::to_string(stats.numWorkers) + " workers from \"" + m_dataDir + "\" in " + std::to_string(elapsedMS) + "ms\n",
+        TextColor::LightCyan).print();
+}
+
+
+void TaskServer::openSpill()
+{
+    makeDirectory(m_dataDir);
+
+    std::string spillPath = m_dataDir + "/" + TASK_SPILL_FILENAME_PREFIX + toHexString(m_replicationEpoch) + TASK_SPILL_FILENAME_SUFFIX;
+    if (!m_spill.open(spillPath)) {
+        fail("Failed to create the task spill file \"" + spillPath + "\"");
+    }
+    m_db.setSpill(&m_spill, m_maxResidentPendingTasks);
+}
+
+
+std::string TaskServer::getLogPath(uint64_t generation) const
+{
+    return m_dataDir + "/" + TASK_LOG_FILENAME_PREFIX + std::to_string(generation) + TASK_LOG_FILENAME_SUFFIX;
+}
+
+
+void TaskServer::startSnapshot()
+{
+    // Everything logged so far goes into the snapshot, and everything logged from now on goes into a new generation
+    commitLog();
+    m_snapshotLogGeneration = m_logGeneration + 1;
+    if (!m_log.open(getLogPath(m_snapshotLogGeneration), 0)) {
+        fail("Failed to open the task log \"" + getLogPath(m_snapshotLogGeneration) + "\" for writing");
+    }
+    m_logGeneration = m_snapshotLogGeneration;
+
+    // The database is serialized as it is right now, but only a chunk per poll cycle (see continueSnapshot), so even a
+    // huge database doesn't hold up requests while it's serialized
+    std::string snapshotPath = m_dataDir + "/" + TASK_SNAPSHOT_FILENAME;
+    m_snapshotFile = std::make_shared<TaskSnapshotWriter>();
+    if (!m_snapshotFile->open(snapshotPath, m_snapshotLogGeneration)) {
+        // The old generations are still intact, so nothing is lost; the next snapshot will cover them too
+        printWarning("Failed to write a snapshot to \"" + m_dataDir + "\"; keeping the full task log instead.");
+        m_snapshotFile.reset();
+        return;
+    }
+    beginSnapshot();
+}
+
+
+void TaskServer::beginSnapshot()
+{
+    // Standbys waiting for a snapshot get this one, then stream the records logged after it. The backlog is only kept
+    // from the first standby on.
+    if (!m_waitingStandbys.empty()) {
+        if (!m_log.hasBacklog()) {
+            m_backlog.clear(m_log.getNextSequence());
+            m_log.setBacklog(&m_backlog);
+        }
+        m_snapshotStandbys = std::move(m_waitingStandbys);
+        m_waitingStandbys.clear();
+        m_snapshotSequence = m_log.getCommittedSequence();
+    }
+
+    m_db.beginSnapshot();
+    m_snapshotting = true;
+}
+
+
+void TaskServer::continueSnapshot()
+{
+    // Standbys that asked for a snapshot while none was being serialized get one of their own. It only covers what's
+    // committed, since a standby must never hold changes that aren't durable yet.
+    if (!m_snapshotting) {
+        if (m_waitingStandbys.empty()) { return; }
+        commitLog();
+        beginSnapshot();
+    }
+
+    BlobStreamWriter chunk;
+    if (m_db.serializeSnapshotChunk(chunk)) {
+        if (m_snapshotFile) {
+            m_snapshotFile->append(chunk.data());
+        }
+        if (!m_snapshotStandbys.empty()) {
+            m_snapshotStandbyChunks.push_back(std::move(chunk));
+        }
+        return;
+    }
+
+    m_snapshotting = false;
+    sendSnapshotToStandbys();
+    if (!m_snapshotFile) { return; }
+
+    // All that's left is syncing the file to disk, which is far slower, so that happens in the background while the
+    // server keeps handling requests
+    auto file = std::move(m_snapshotFile);
+    m_snapshotWrite = std::async(std::launch::async, [file]() {
+        return file->finish();
+    });
+}
+
+
+void TaskServer::finishSnapshot(bool wait)
+{
+    if (wait) {
+        while (m_snapshotting) {
+            continueSnapshot();
+        }
+    }
+
+    if (!m_snapshotWrite.valid()) { return; }
+    if (!wait && m_snapshotWrite.wait_for(std::chrono::seconds(0)) != std::future_status::ready) { return; }
+
+    if (!m_snapshotWrite.get()) {
+        // The old generations are still intact, so nothing is lost; the next snapshot will cover them too
+        printWarning("Failed to write a snapshot to \"" + m_dataDir + "\"; keeping the full task log instead.");
+        return;
+    }
+
+    for (; m_oldestLogGeneration < m_snapshotLogGeneration; ++m_oldestLogGeneration) {
+        deleteFile(getLogPath(m_oldestLogGeneration));
+    }
+    ColoredString("Snapshot of " + std::to_string(m_db.getTotalTaskCount()) + " tasks written\n", TextColor::Cyan).print();
+}
+
+
+void TaskServer::sendSnapshotToStandbys()
+{
+    if (m_snapshotStandbys.empty()) { return; }
+
+    // Snapshots can be far larger than a single message should be, so each chunk gets its own frame
+    BlobStreamWriter header;
+    header << TaskReplyType::Success << m_replicationEpoch << m_snapshotSequence << (uint64_t)m_snapshotStandbyChunks.size();
+    for (size_t i = 0; i < m_snapshotStandbys.size(); ++i) {
+        bool last = (i + 1 == m_snapshotStandbys.size());
+        m_responder.send(m_snapshotStandbys[i], ZMQ_SNDMORE);
+        m_responder.send(zmq::message_t(), ZMQ_SNDMORE);
+        m_responder.send(toMessage(header.data()), m_snapshotStandbyChunks.empty() ? 0 : ZMQ_SNDMORE);
+        for (size_t j = 0; j < m_snapshotStandbyChunks.size(); ++j) {
+            // The last standby gets the chunks themselves, the others copies
+            auto& chunk = m_snapshotStandbyChunks[j];
+            int flags = (j + 1 < m_snapshotStandbyChunks.size()) ? ZMQ_SNDMORE : 0;
+            m_responder.send(last ? toMessage(std::move(chunk)) : toMessage(chunk.data()), flags);
+        }
+    }
+
+    m_stats.succeededRequests += m_snapshotStandbys.size();
+    m_snapshotStandbys.clear();
+    m_snapshotStandbyChunks.clear();
+}
+
+
+void TaskServer::processRequests()
+{
+    zmq::pollitem_t items[] = { { (void*)m_responder, 0, ZMQ_POLLIN, 0 }, { nullptr, 0, ZMQ_POLLIN, 0 } };
+    int numItems = 1;
+    if (isFollowing()) {
+        items[1].socket = (void*)*m_primary;
+        numItems = 2;
+    }
+    // While a snapshot is being serialized, the server only checks for requests between its chunks
+    int timeoutMS = isFollowing() ? REPLICATION_POLL_INTERVAL_MS : SERVER_POLL_TIMEOUT_MS;
+    if (m_waitingForPort) { timeoutMS = HANDOFF_BIND_RETRY_MS; }
+    zmq::poll(items, numItems, (m_snapshotting || !m_waitingStandbys.empty()) ? 0 : timeoutMS);
+
+    if (isFollowing()) {
+        updateReplication((items[1].revents & ZMQ_POLLIN) != 0);
+    }
+
+    // Handle every request that's already waiting, up to a limit, before replying to any of them
+    struct PendingReply
+    {
+        zmq::message_t identity;
+        std::vector<BlobStreamWriter> frames;
+    };
+    std::vector<PendingReply> pendingReplies;
+    PendingReply handOff;
+    bool handOffRequested = false;
+    uint64_t handOffEpoch = 0, handOffSequence = 0;
+    std::string successorEndpoint, successorDataDir;
+
+    while ((items[0].revents & ZMQ_POLLIN) && (int)pendingReplies.size() < MAX_REQUESTS_PER_POLL_CYCLE) {
+        // Requests from REQ sockets arrive through the ROUTER socket as [identity][empty delimiter][request]
+        std::vector<zmq::message_t> frames(1);
+        if (!m_responder.recv(&frames[0], ZMQ_DONTWAIT)) { break; }
+        while (frames.back().more()) {
+            frames.emplace_back();
+            m_responder.recv(&frames.back());
+        }
+
+        // Anything that isn't a REQ envelope has nobody to reply to, so just drop it
+        if (frames.size() != 3 || frames[1].size() != 0) { continue; }
+
+        PendingReply pending;
+        pending.identity = std::move(frames[0]);
+
+        // Snapshots for standbys are serialized between poll cycles (see continueSnapshot), and replied to once complete
+        BlobStreamReader request(viewMessage(frames[2]));
+        TaskRequestType requestType;
+        bool hasType = (request >> requestType);
+        if (hasType && requestType == TaskRequestType::GetReplicationSnapshot && !request.hasMore()) {
+            m_waitingStandbys.push_back(std::move(pending.identity));
+            continue;
+        }
+
+        // A handoff has to include every change up to and including this poll cycle, so it's replied to after the commit;
+        // anything received after it is relayed to the new server process
+        if (!isFollowing() && hasType && requestType == TaskRequestType::HandOff && (request >> handOffEpoch) &&
+            (request >> handOffSequence) && (request >> successorEndpoint) && (request >> successorDataDir) && !request.hasMore()) {
+            handOff = std::move(pending);
+            handOffRequested = true;
+            break;
+        }
+
+        // Generate a reply, and track statistics about the reply type
+        m_trace.append(viewMessage(frames[2]));
+        pending.frames.push_back(generateReply(viewMessage(frames[2])));
+
+        TaskReplyType replyType = *(TaskReplyType*)(&pending.frames[0].data().first());
+        if (replyType == TaskReplyType::Success) { m_stats.succeededRequests++; }
+        else if (replyType == TaskReplyType::Failed || replyType == TaskReplyType::UnknownSession || replyType == TaskReplyType::NotPrimary) { m_stats.failedRequests++; }
+        else if (replyType == TaskReplyType::BadRequest) { m_stats.badRequests++; }
+
+        pendingReplies.push_back(std::move(pending));
+    }
+
+    // Group commit: a single fsync makes every mutation of this poll cycle durable, and it must complete before any
+    // of the replies acknowledging those mutations are sent
+    commitLog();
+
+    if (handOffRequested) {
+        handOff.frames.push_back(generateHandOffReply(handOffEpoch, handOffSequence, successorDataDir));
+        m_successorEndpoint = successorEndpoint;
+        pendingReplies.push_back(std::move(handOff));
+    }
+
+    for (auto& pending : pendingReplies) {
+        m_responder.send(pending.identity, ZMQ_SNDMORE);
+        m_responder.send(zmq::message_t(), ZMQ_SNDMORE);
+        for (size_t i = 0; i < pending.frames.size(); ++i) {
+            m_responder.send(toMessage(std::move(pending.frames[i])), i + 1 < pending.frames.size() ? ZMQ_SNDMORE : 0);
+        }
+    }
+}
+
+
+void TaskServer::commitLog()
+{
+    if (!m_log.commit()) {
+        fail("Failed to write to the task log; shutting down rather than acknowledging changes that may not be durable.");
+    }
+}
+
+
+BlobStreamWriter TaskServer::generateHandOffReply(uint64_t epoch, uint64_t fromSequence, const std::string& successorDataDir)
+{
+    BlobStreamWriter reply;
+
+    // A new process that was given another data directory would quietly drop this one's, so it's refused instead (one
+    // given no data directory just continues in this one's)
+    if (!successorDataDir.empty() && successorDataDir != m_dataDir) {
+        reply << TaskReplyType::BadRequest;
+        return reply;
+    }
+
+    std::vector<uint8_t> records;
+    int recordCount = 0;
+    if (epoch != m_replicationEpoch || !m_log.hasBacklog() || !m_backlog.getRecords(fromSequence, SIZE_MAX, records, recordCount)) {
+        reply << TaskReplyType::Failed;
+        return reply;
+    }
+
+    // The new process takes over the data directory, so this one must be done writing to it. Standbys still waiting for
+    // a snapshot get theirs too, while this process still serves them.
+    finishSnapshot(true);
+    if (!m_waitingStandbys.empty()) {
+        continueSnapshot();
+        finishSnapshot(true);
+    }
+    m_log.close();
+    m_handedOff = true;
+
+    reply << TaskReplyType::Success << recordCount << (int)records.size();
+    if (!records.empty()) {
+        reply << ArrayView<uint8_t>(records);
+    }
+    reply << m_dataDir << m_logGeneration << m_oldestLogGeneration;
+    return reply;
+}
+
+
+// Whether a request comes from a client that understands the Reconnect reply, i.e. it's tagged with a version that has it
+static bool canReconnect(ArrayView<uint8_t> requestBytes)
+{
+    BlobStreamReader request(requestBytes);
+    TaskRequestType type;
+    uint8_t version;
+    return (request >> type) && type == TaskRequestType::Versioned && (request >> version) && version >= PROTOCOL_VERSION_RECONNECT;
+}
+
+
+void TaskServer::forwardRequestsToSuccessor()
+{
+    // Closing the port would also close every connection accepted on it, losing any request in flight on them, so the
+    // port stays open for a while, and requests are relayed to the new process (on its private endpoint) and its replies
+    // relayed back. Clients reconnect to the new process once the port is closed.
+    zmq::socket_t successor(m_context, ZMQ_DEALER);
+    successor.connect(m_successorEndpoint);
+
+    std::deque<zmq::message_t> waitingClients; // the new process replies to relayed requests in order
+    auto now = std::chrono::steady_clock::now();
+    auto drainEndTime = now + std::chrono::milliseconds(HANDOFF_DRAIN_MS);
+    auto giveUpTime = drainEndTime + std::chrono::milliseconds(REPLICATION_TIMEOUT_MS);
+    auto lastRequestTime = now;
+
+    // Past the drain period, the port is closed once no relayed request is waiting for its reply and the clients have
+    // gone quiet; only a request from a client too old to be told to reconnect, and arriving in that very instant, can
+    // still be lost
+    while (now < giveUpTime && (now < drainEndTime || !waitingClients.empty() ||
+        now - lastRequestTime < std::chrono::milliseconds(HANDOFF_QUIET_MS))) {
+        zmq::pollitem_t items[] = { { (void*)successor, 0, ZMQ_POLLIN, 0 }, { (void*)m_responder, 0, ZMQ_POLLIN, 0 } };
+        zmq::poll(items, 2, 10);
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            // Replies come back from the new process's ROUTER socket as [empty delimiter][reply]
+            std::vector<zmq::message_t> frames(1);
+            successor.recv(&frames[0]);
+            while (frames.back().more()) {
+                frames.emplace_back();
+                successor.recv(&frames.back());
+            }
+
+            if (!waitingClients.empty() && frames.size() >= 2) {
+                m_responder.send(waitingClients.front(), ZMQ_SNDMORE);
+                waitingClients.pop_front();
+                for (size_t i = 0; i < frames.size(); ++i) {
+                    m_responder.send(frames[i], i + 1 < frames.size() ? ZMQ_SNDMORE : 0);
+                }
+            }
+        }
+
+        if (items[1].revents & ZMQ_POLLIN) {
+            std::vector<zmq::message_t> frames(1);
+            m_responder.recv(&frames[0]);
+            while (frames.back().more()) {
+                frames.emplace_back();
+                m_responder.recv(&frames.back());
+            }
+
+            if (frames.size() == 3 && frames[1].size() == 0) {
+                lastRequestTime = std::chrono::steady_clock::now();
+                if (lastRequestTime >= drainEndTime && canReconnect(viewMessage(frames[2]))) {
+                    BlobStreamWriter reply;
+                    reply << TaskReplyType::Reconnect;
+                    m_responder.send(frames[0], ZMQ_SNDMORE);
+                    m_responder.send(frames[1], ZMQ_SNDMORE);
+                    m_responder.send(toMessage(std::move(reply)));
+                }
+                else {
+                    waitingClients.push_back(std::move(frames[0]));
+                    successor.send(frames[1], ZMQ_SNDMORE);
+                    successor.send(frames[2]);
+                }
+            }
+        }
+
+        now = std::chrono::steady_clock::now();
+    }
+
+    if (!waitingClients.empty()) {
+        printWarning(std::to_string(waitingClients.size()) + " relayed requests weren't answered by the new server process.");
+    }
+
+    // Don't wait forever for replies to reach clients that may be gone, then release the port for the new process
+    int linger = HANDOFF_DRAIN_MS;
+    m_responder.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    successor.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    m_responder.close();
+}
+
+
+void TaskServer::takeOver()
+{
+    m_takingOver = true;
+}
+
+
+void TaskServer::setTraceFile(const std::string& path)
+{
+    m_tracePath = path;
+}
+
+
+void TaskServer::setMaxResidentPendingTasks(size_t count)
+{
+    m_maxResidentPendingTasks = count;
+}
+
+
+void TaskServer::takeOverFromRunningServer()
+{
+    auto startTime = std::chrono::steady_clock::now();
+    ColoredString("Taking over from the server running on port " + std::to_string(m_port) + "\n", TextColor::LightCyan).print();
+
+    // The running server keeps the port for a while after handing off, relaying its requests to this process on a
+    // private endpoint meanwhile
+    m_responder.bind("tcp://127.0.0.1:*");
+    char endpoint[256];
+    size_t endpointSize = sizeof(endpoint);
+    m_responder.getsockopt(ZMQ_LAST_ENDPOINT, endpoint, &endpointSize);
+    m_handOffEndpoint = endpoint;
+
+    // First catch up the same way a standby does, while the running server keeps serving requests, so that the handoff
+    // itself only has to transfer the last few changes
+    follow("127.0.0.1", m_port);
+    while (!m_syncedWithPrimary || m_awaitingPrimaryReply) {
+        if (m_awaitingPrimaryReply && std::chrono::steady_clock::now() - m_primaryRequestTime >= std::chrono::milliseconds(getPrimaryTimeoutMS())) {
+            fail("No primary server is responding on port " + std::to_string(m_port) + " to take over from.");
+        }
+
+        zmq::pollitem_t item = { (void*)*m_primary, 0, ZMQ_POLLIN, 0 };
+        zmq::poll(&item, 1, REPLICATION_POLL_INTERVAL_MS);
+        updateReplication((item.revents & ZMQ_POLLIN) != 0);
+    }
+
+    // From here on, the old server stops serving requests until this process binds the port
+    auto handOffStartTime = std::chrono::steady_clock::now();
+    BlobStreamWriter request;
+    request << TaskRequestType::HandOff << m_primaryEpoch << m_primarySequence << m_handOffEndpoint << m_dataDir;
+    m_primary->send(toMessage(std::move(request)));
+
+    zmq::pollitem_t item = { (void*)*m_primary, 0, ZMQ_POLLIN, 0 };
+    zmq::poll(&item, 1, REPLICATION_TIMEOUT_MS);
+    zmq::message_t replyMsg;
+    if (!(item.revents & ZMQ_POLLIN) || !m_primary->recv(&replyMsg)) {
+        fail("The running server didn't hand off its state.");
+    }
+
+    BlobStreamReader reply(viewMessage(replyMsg));
+    TaskReplyType type;
+    if (!(reply >> type)) {
+        fail("The running server sent a corrupt handoff.");
+    }
+    if (type == TaskReplyType::BadRequest) {
+        fail("The running server keeps its tasks in another -data directory than this one was given (leave out -data to continue in its directory).");
+    }
+    if (type != TaskReplyType::Success) {
+        fail("The running server refused to hand off its state (it may be a standby, or changed during the handoff).");
+    }
+
+    int recordCount = 0;
+    std::string dataDir;
+    uint64_t logGeneration, oldestLogGeneration;
+    if (!applyPrimaryRecords(reply, &recordCount) || !(reply >> dataDir) || !(reply >> logGeneration) || !(reply >> oldestLogGeneration)) {
+        fail("The running server sent a corrupt handoff.");
+    }
+
+    m_primary.reset();
+    m_primaryConnStr.clear();
+
+    // Continue the old server's log in its data directory, starting with a snapshot of the state handed off
+    m_dataDir = dataDir;
+    if (!m_dataDir.empty()) {
+        m_logGeneration = logGeneration;
+        m_oldestLogGeneration = oldestLogGeneration;
+        startSnapshot();
+    }
+
+    // Worker leases aren't logged, so give workers a full timeout period as if they had all just renewed. The port is
+    // bound from the run loop, as soon as the old process releases it.
+    m_db.renewAllLeases();
+    m_waitingForPort = true;
+    m_portGiveUpTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDOFF_BIND_TIMEOUT_MS);
+
+    auto now = std::chrono::steady_clock::now();
+    auto handOffMS = std::chrono::duration_cast<std::chrono::milliseconds>(now - handOffStartTime).count();
+    auto totalMS = std::chrono::duration_cast<std::chrono::milliseconds>(now - startTime).count();
+    ColoredString("Took over " + std::to_string(m_db.getTotalTaskCount()) + " tasks in " + std::to_string(totalMS) + "ms (requests paused for " +
+        std::to_string(handOffMS) + "ms)\n", TextColor::LightCyan).print();
+}
+
+
+void TaskServer::follow(const std::string& primaryIP, int primaryPort)
+{
+    m_primaryConnStr = "tcp://" + primaryIP + ":" + std::to_string(primaryPort);
+    m_syncedWithPrimary = false;
+    connectToPrimary();
+}
+
+
+void TaskServer::connectToPrimary()
+{
+    // A REQ socket can't give up on a request that never gets a reply, so a fresh socket is used after a timeout
+    m_primary.reset(new zmq::socket_t(m_context, ZMQ_REQ));
+    int linger = 0;
+    m_primary->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    try {
+        m_primary->connect(m_primaryConnStr);
+    }
+    catch (zmq::error_t) {
+        printError("Failed to connect to primary server: \"" + m_primaryConnStr + "\"");
+        exit(-1);
+    }
+
+    m_awaitingPrimaryReply = false;
+    m_nextPrimaryRequestTime = std::chrono::steady_clock::now();
+}
+
+
+int TaskServer::getPrimaryTimeoutMS() const
+{
+    return m_syncedWithPrimary ? REPLICATION_TIMEOUT_MS : REPLICATION_SNAPSHOT_TIMEOUT_MS;
+}
+
+
+void TaskServer::updateReplication(bool primaryReplied)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    if (primaryReplied) {
+        std::vector<zmq::message_t> frames(1);
+        m_primary->recv(&frames[0]);
+        while (frames.back().more()) {
+            frames.emplace_back();
+            m_primary->recv(&frames.back());
+        }
+
+        // Ask again right away while catching up, otherwise wait a bit before polling the primary again
+        m_awaitingPrimaryReply = false;
+        bool mayHaveMore = handlePrimaryReply(frames);
+        m_nextPrimaryRequestTime = now + std::chrono::milliseconds(mayHaveMore ? 0 : REPLICATION_POLL_INTERVAL_MS);
+    }
+    else if (m_awaitingPrimaryReply && now - m_primaryRequestTime >= std::chrono::milliseconds(getPrimaryTimeoutMS())) {
+        printWarning("The primary server isn't responding; retrying.");
+        connectToPrimary();
+    }
+
+    if (!m_awaitingPrimaryReply && now >= m_nextPrimaryRequestTime) {
+        BlobStreamWriter request;
+        if (m_syncedWithPrimary) {
+            request << TaskRequestType::GetReplicationRecords << m_primaryEpoch << m_primarySequence;
+        }
+        else {
+            request << TaskRequestType::GetReplicationSnapshot;
+        }
+
+        m_primary->send(toMessage(std::move(request)));
+        m_awaitingPrimaryReply = true;
+        m_primaryRequestTime = now;
+    }
+}
+
+
+bool TaskServer::handlePrimaryReply(const std::vector<zmq::message_t>& frames)
+{
+    if (!m_syncedWithPrimary) {
+        if (!applyPrimarySnapshot(frames)) {
+            printWarning("Failed to get a snapshot from the primary server; retrying.");
+            return false;
+        }
+        return true;
+    }
+
+    BlobStreamReader reply(viewMessage(frames[0]));
+    TaskReplyType type;
+    if (!(reply >> type)) { return false; }
+    if (type != TaskReplyType::Success) {
+        // The primary restarted or discarded records this server still needs
+        printWarning("Lost track of the primary server's log; syncing from a new snapshot.");
+        m_syncedWithPrimary = false;
+        return true;
+    }
+
+    int recordCount = 0;
+    if (!applyPrimaryRecords(reply, &recordCount)) {
+        printWarning("Received a corrupt record from the primary server; syncing from a new snapshot.");
+        m_syncedWithPrimary = false;
+        return true;
+    }
+    return recordCount > 0;
+}
+
+
+bool TaskServer::applyPrimaryRecords(BlobStreamReader& reply, int* outRecordCount)
+{
+    int recordCount;
+    std::vector<uint8_t> records;
+    if (!(reply >> recordCount) || !(reply >> records)) { return false; }
+
+    // Records are logged (and shipped to this server's own standbys) exactly like the changes they describe
+    uint64_t offset = 0;
+    ArrayView<uint8_t> record;
+    for (int i = 0; i < recordCount; ++i) {
+        if (!TaskLog::readRecord(records.data(), records.size(), offset, record) || !m_db.applyLogRecord(record)) {
+            return false;
+        }
+        m_log.append(record);
+        m_primarySequence++;
+    }
+
+    *outRecordCount = recordCount;
+    return true;
+}
+
+
+bool TaskServer::applyPrimarySnapshot(const std::vector<zmq::message_t>& frames)
+{
+    BlobStreamReader header(viewMessage(frames[0]));
+    TaskReplyType type;
+    uint64_t epoch, sequence, chunkCount;
+    if (!(header >> type) || type != TaskReplyType::Success) { return false; }
+    if (!(header >> epoch) || !(header >> sequence) || !(header >> chunkCount) || chunkCount + 1 != frames.size()) { return false; }
+
+    // A snapshot still being serialized describes the state about to be replaced, but the log generations it covers
+    // are only deleted once it's finished
+    finishSnapshot(true);
+    m_db.clear();
+    for (size_t i = 1; i < frames.size(); ++i) {
+        if (!m_db.applySnapshotChunk(viewMessage(frames[i]))) {
+            m_db.clear();
+            return false;
+        }
+    }
+
+    m_primaryEpoch = epoch;
+    m_primarySequence = sequence;
+    m_syncedWithPrimary = true;
+
+    // This server's own log no longer describes its state, so its history starts over: its standbys need to resync,
+    // and its data directory gets a fresh snapshot before any further records are logged
+    commitLog();
+    m_replicationEpoch = newReplicationEpoch();
+    m_backlog.clear(m_log.getNextSequence());
+    if (m_log.isOpen()) {
+        finishSnapshot(true);
+        startSnapshot();
+        finishSnapshot(true);
+    }
+
+    ColoredString("Synced with primary server " + m_primaryConnStr + ": " + std::to_string(m_db.getTotalTaskCount()) + " tasks\n",
+        TextColor::LightCyan).print();
+    return true;
+}
+
+
+bool TaskServer::promoteToPrimary()
+{
+    if (!isFollowing() || !m_syncedWithPrimary) { return false; }
+
+    m_primary.reset();
+    m_primaryConnStr.clear();
+    m_awaitingPrimaryReply = false;
+
+    // Workers are about to switch over from the old primary, so give them a full timeout period to do so
+    m_db.renewAllLeases();
+
+    ColoredString("Promoted to primary server\n", TextColor::LightCyan).print();
+    return true;
 }
 
 
 void TaskServer::run()
 {
+    // Spilling starts before any state is restored or taken over, so that doesn't have to fit in memory either
+    if (!m_dataDir.empty() && m_maxResidentPendingTasks > 0) {
+        openSpill();
+    }
+
+    if (m_takingOver) {
+        takeOverFromRunningServer();
+    }
+    else {
+        if (!m_dataDir.empty()) {
+            restoreFromDisk();
+        }
+        bindPort();
+    }
+
+    // Task and worker session IDs are drawn from a recorded seed while tracing, so a replay of the trace assigns the same ones
+    if (!m_tracePath.empty()) {
+        uint64_t idSeed = newReplicationEpoch();
+        m_db.seedIDs(idSeed);
+        if (!m_trace.open(m_tracePath, idSeed, m_db.getTime())) {
+            fail("Failed to open the request trace \"" + m_tracePath + "\" for writing");
+        }
+        ColoredString("Tracing requests into \"" + m_tracePath + "\"\n", TextColor::LightCyan).print();
+    }
+
     ColoredString("Server running on port " + std::to_string(m_port) + "\n", TextColor::LightCyan).print();
+    if (isFollowing()) {
+        ColoredString("Standing by for primary server " + m_primaryConnStr + "\n", TextColor::LightCyan).print();
+    }
 
     time_t serverStartTime = std::time(nullptr);
     time_t lastStatsPrint = 0, lastCleanup = 0;
 
     m_running = true;
     while (m_running) {
-        processRequest();
+        if (m_waitingForPort) {
+            bindHandedOffPort();
+        }
+        processRequests();
+        if (m_handedOff) {
+            ColoredString("Handed off to the new server process\n", TextColor::LightYellow).print();
+            forwardRequestsToSuccessor();
+            return;
+        }
 
         time_t now = std::time(nullptr);
         time_t serverAge = now - serverStartTime;
@@ -87,24 +948,56 @@ void TaskServer::run()
             lastStatsPrint = now;
         }
 
-        if (timeSinceLastCleanup >= SERVER_TASK_CLEANUP_INTERVAL_SECONDS) {
+        // A standby leaves timing out tasks to its primary, and replays the resulting changes
+        if (timeSinceLastCleanup >= SERVER_TASK_CLEANUP_INTERVAL_SECONDS && !isFollowing()) {
             m_db.cleanupZombieTasks(WORKER_HEARTBEAT_TIMEOUT_SECONDS);
+            commitLog();
             lastCleanup = now;
         }
+
+        continueSnapshot();
+        finishSnapshot(false);
+        if (m_log.isOpen() && !m_snapshotting && !m_snapshotWrite.valid() && m_log.getSize() >= SNAPSHOT_MIN_LOG_SIZE) {
+            startSnapshot();
+        }
     }
+
+    commitLog();
+    finishSnapshot(true);
+    m_trace.close();
 }
 
 
 void TaskServer::shutdown()
 {
     ColoredString("Shutting down server\n", TextColor::LightYellow).print();
-    m_running = true;
+    m_running = false;
+}
+
+
+std::vector<BlobStreamWriter> TaskServer::handleRequest(ArrayView<uint8_t> request)
+{
+    std::vector<BlobStreamWriter> frames;
+    frames.push_back(generateReply(request));
+    commitLog();
+    return frames;
+}
+
+
+// Writes a task exactly as writing its TaskRunInfo would, without copying its command into one first
+static void writeRunInfo(BlobStreamWriter& writer, const Task& task)
+{
+    writer << varInt(task.getID()) << task.getCommand();
 }
 
 
 BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
 {
+    // Nothing allocated while handling the previous request outlives its reply
+    m_requestArena.reset();
+
     BlobStreamReader request(requestBytes);
+    request.setUntrusted(true);
     BlobStreamWriter reply;
 
     TaskRequestType type;
@@ -113,49 +1006,91 @@ BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
         return reply;
     }
 
+    // Tagged requests, and their replies, use the encoding of the protocol version they're tagged with
+    if (type == TaskRequestType::Versioned) {
+        uint8_t version;
+        if (!(request >> version) || version < PROTOCOL_VERSION_COMPACT || version > PROTOCOL_VERSION || !(request >> type)) {
+            reply << TaskReplyType::BadRequest;
+            return reply;
+        }
+        request.setCompact(true);
+        reply.setCompact(true);
+    }
+
+    if (isFollowing() && !isReadOnlyRequest(type)) {
+        reply << TaskReplyType::NotPrimary;
+        return reply;
+    }
+
     switch (type) {
+        case TaskRequestType::Hello: {
+            uint8_t clientVersion;
+            if (!(request >> clientVersion) || request.hasMore()) { break; }
+
+            reply << TaskReplyType::Success << std::min(clientVersion, PROTOCOL_VERSION);
+            return reply;
+        }
+
         case TaskRequestType::GetCommand: {
             TaskID id;
-            if (!(request >> id)) { break; }
-            auto task = m_db.getTaskByID(id);
+            if (!(request >> varInt(id))) { break; }
+            auto task = m_db.getResidentTask(id);
+            TaskCreateInfo info;
+            TaskStatus status;
 
-            if (!task) {
-                reply << TaskReplyType::Failed;
-            }
-            else {
+            if (task) {
                 reply << TaskReplyType::Success;
                 reply << task->getCommand();
             }
+            else if (m_db.readSpilledTask(id, info, status)) {
+                reply << TaskReplyType::Success;
+                reply << info.command;
+            }
+            else {
+                reply << TaskReplyType::Failed;
+            }
             return reply;
         }
 
         case TaskRequestType::GetSchedule: {
             TaskID id;
-            if (!(request >> id)) { break; }
-            auto task = m_db.getTaskByID(id);
+            if (!(request >> varInt(id))) { break; }
+            auto task = m_db.getResidentTask(id);
+            TaskCreateInfo info;
+            TaskStatus status;
 
-            if (!task) {
-                reply << TaskReplyType::Failed;
+            if (task) {
+                reply << TaskReplyType::Success;
+                reply << task->getSchedule();
+            }
+            else if (m_db.readSpilledTask(id, info, status)) {
+                reply << TaskReplyType::Success;
+                reply << info.schedule;
             }
             else {
-                reply << TaskReplyType::Success;
-                reply << task->getSchedule();
+                reply << TaskReplyType::Failed;
             }
             return reply;
         }
 
         case TaskRequestType::GetStatus: {
             TaskID id;
-            if (!(request >> id)) { break; }
-            auto task = m_db.getTaskByID(id);
+            if (!(request >> varInt(id))) { break; }
+            auto task = m_db.getResidentTask(id);
+            TaskCreateInfo info;
+            TaskStatus status;
 
-            if (!task) {
-                reply << TaskReplyType::Failed;
-            }
-            else {
+            if (task) {
                 reply << TaskReplyType::Success;
                 reply << task->getStatus();
             }
+            else if (m_db.readSpilledTask(id, info, status)) {
+                reply << TaskReplyType::Success;
+                reply << status;
+            }
+            else {
+                reply << TaskReplyType::Failed;
+            }
             return reply;
         }
 
@@ -170,7 +1105,7 @@ BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
 
         case TaskRequestType::HeartbeatAndCheckWasTaskCanceled: {
             TaskID id;
-            if (!(request >> id)) { break; }
+            if (!(request >> varInt(id))) { break; }
             auto task = m_db.getTaskByID(id);
 
             if (!task) {
@@ -196,55 +1131,109 @@ BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
                 return reply;
             }
 
-            std::set<TaskState> states;
+            TaskStateMask states = 0;
             TaskState state;
             while (request >> state) {
-                states.insert(state);
+                states |= toStateMask(state);
             }
 
-            auto tasks = m_db.getTasksByStates(states);
+            // Spilled tasks are listed straight from the spill file, rather than paged in just to be listed
+            ArenaVector<TaskPtr> tasks(m_requestArena);
+            m_db.getTasksByStates(states, tasks);
+            ArenaVector<std::pair<TaskID, std::time_t>> spilledTasks(m_requestArena);
+            if (states & toStateMask(TaskState::Pending)) {
+                m_db.getSpilledTasks(spilledTasks);
+            }
 
-            reply << TaskReplyType::Success;
-            for (auto task : tasks) {
-                TaskBriefInfo info;
-                info.id = task->getID();
-                info.status = task->getStatus();
-                reply << info;
+            ArenaVector<TaskBriefInfo> infos(tasks.size() + spilledTasks.size(), TaskBriefInfo(), m_requestArena);
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                infos[i].id = tasks[i]->getID();
+                infos[i].status = tasks[i]->getStatus();
             }
+            for (size_t i = 0; i < spilledTasks.size(); ++i) {
+                TaskBriefInfo& info = infos[tasks.size() + i];
+                info.id = spilledTasks[i].first;
+                info.status.createTime = spilledTasks[i].second;
+            }
+
+            reply << TaskReplyType::Success;
+            writeItems(reply, infos);
 
             return reply;
         }
 
         case TaskRequestType::Create: {
-            TaskCreateInfo startInfo;
-            if (!(request >> startInfo)) { break; }
+            if (!(request >> m_decodedCreateInfo)) { break; }
 
-            auto newTask = m_db.createTask(startInfo);
-            if (!newTask) {
-                reply << TaskReplyType::Failed;
+            reply << TaskReplyType::Success;
+            reply << varInt(m_db.createTask(m_decodedCreateInfo));
+            return reply;
+        }
+
+        case TaskRequestType::CreateMany: {
+            size_t count;
+            if (!(request >> varInt(count))) { break; }
+            if (count > (size_t)MAX_TASKS_CREATED_PER_REQUEST) { break; }
+
+            // Check that the whole batch decodes before creating anything, so a corrupt request doesn't create only some of
+            // its tasks. Then decode it again to create them, one at a time into the same reused TaskCreateInfo.
+            BlobStreamReader batch = request;
+            bool decoded = true;
+            for (size_t i = 0; i < count && decoded; ++i) {
+                decoded = (request >> m_decodedCreateInfo);
             }
-            else {
-                reply << TaskReplyType::Success;
-                reply << newTask->getID();
+            if (!decoded || request.hasMore()) { break; }
+
+            reply << TaskReplyType::Success;
+            reply << varInt(count);
+            for (size_t i = 0; i < count; ++i) {
+                batch >> m_decodedCreateInfo;
+                reply << varInt(m_db.createTask(m_decodedCreateInfo));
             }
             return reply;
         }
 
         case TaskRequestType::TakeToRun: {
-            std::set<std::string> haveResources;
-            std::string resource;
-            while (request >> resource) {
-                haveResources.insert(resource);
+            // A tag that isn't a symbol yet can't be required or wanted by any task, so it's simply left out rather than
+            // created
+            ArenaVector<Symbol> tags(m_requestArena);
+            ArrayView<uint8_t> tagBytes;
+            while (request.readView(tagBytes)) {
+                Symbol resource;
+                if (Symbol::find(tagBytes, resource)) {
+                    tags.push_back(resource);
+                }
             }
+            normalizeResourceTags(tags);
 
-            auto task = m_db.takeTaskToRun(haveResources);
-            if (task) {
-                TaskRunInfo info;
-                info.id = task->getID();
-                info.command = task->getCommand();
+            ArenaVector<TaskPtr> tasks(m_requestArena);
+            m_db.takeTasksToRun(tags, 1, NO_WORKER_SESSION, tasks);
+            if (!tasks.empty()) {
+                reply << TaskReplyType::Success;
+                writeRunInfo(reply, *tasks[0]);
+            }
+            else {
+                reply << TaskReplyType::Failed;
+            }
+            return reply;
+        }
+
+        case TaskRequestType::TakeToRunInSession: {
+            WorkerSessionID sessionID;
+            if (!(request >> varInt(sessionID))) { break; }
+            if (request.hasMore()) { break; }
+
+            // Taking a task also counts as renewing the lease, so idle workers keep their sessions alive while polling
+            if (!m_db.renewWorkerSession(sessionID).hasValue()) {
+                reply << TaskReplyType::UnknownSession;
+                return reply;
+            }
 
+            ArenaVector<TaskPtr> tasks(m_requestArena);
+            m_db.takeTasksToRun(sessionID, 1, tasks);
+            if (!tasks.empty()) {
                 reply << TaskReplyType::Success;
-                reply << info;
+                writeRunInfo(reply, *tasks[0]);
             }
             else {
                 reply << TaskReplyType::Failed;
@@ -252,9 +1241,175 @@ BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
             return reply;
         }
 
+        case TaskRequestType::TakeManyToRunInSession: {
+            WorkerSessionID sessionID;
+            int maxCount;
+            if (!(request >> varInt(sessionID))) { break; }
+            if (!(request >> varInt(maxCount))) { break; }
+            if (request.hasMore() || maxCount < 1) { break; }
+
+            if (!m_db.renewWorkerSession(sessionID).hasValue()) {
+                reply << TaskReplyType::UnknownSession;
+                return reply;
+            }
+
+            // All the tasks are marked started before the reply is sent, so no other worker can take them in between
+            ArenaVector<TaskPtr> tasks(m_requestArena);
+            m_db.takeTasksToRun(sessionID, std::min(maxCount, MAX_TASKS_TAKEN_PER_REQUEST), tasks);
+            if (tasks.empty()) {
+                reply << TaskReplyType::Failed;
+                return reply;
+            }
+
+            reply << TaskReplyType::Success;
+            reply << varInt(tasks.size());
+            for (const auto& task : tasks) {
+                writeRunInfo(reply, *task);
+            }
+            return reply;
+        }
+
+        case TaskRequestType::FinishAndTakeToRunInSession: {
+            WorkerSessionID sessionID;
+            size_t finishedCount;
+            if (!(request >> varInt(sessionID))) { break; }
+            if (!(request >> varInt(finishedCount))) { break; }
+            if (finishedCount > (size_t)MAX_TASKS_TAKEN_PER_REQUEST) { break; }
+
+            ArenaVector<TaskID> finishedIDs(finishedCount, 0, m_requestArena);
+            bool decoded = true;
+            for (auto& id : finishedIDs) {
+                if (!(request >> varInt(id))) { decoded = false; break; }
+            }
+            if (!decoded) { break; }
+
+            int maxCount;
+            if (!(request >> varInt(maxCount))) { break; }
+            if (request.hasMore() || maxCount < 0) { break; }
+
+            // Finishing tasks doesn't depend on the session, so do that even if the session has expired
+            size_t numFinished = 0;
+            for (TaskID id : finishedIDs) {
+                auto task = m_db.getTaskByID(id);
+                if (task) {
+                    m_db.markTaskFinished(task);
+                    numFinished++;
+                }
+            }
+
+            if (!m_db.renewWorkerSession(sessionID).hasValue()) {
+                reply << TaskReplyType::UnknownSession;
+                reply << varInt(numFinished);
+                return reply;
+            }
+
+            ArenaVector<TaskPtr> tasks(m_requestArena);
+            if (maxCount > 0) {
+                m_db.takeTasksToRun(sessionID, std::min(maxCount, MAX_TASKS_TAKEN_PER_REQUEST), tasks);
+            }
+
+            reply << TaskReplyType::Success;
+            reply << varInt(numFinished);
+            reply << varInt(tasks.size());
+            for (const auto& task : tasks) {
+                writeRunInfo(reply, *task);
+            }
+            return reply;
+        }
+
+        case TaskRequestType::OpenWorkerSession: {
+            std::string machineName;
+            if (!(request >> machineName)) { break; }
+
+            // Tasks needing the worker's tags may only be created later, so its tags are made symbols now, within the
+            // limit for untrusted input
+            std::vector<std::string> haveResources;
+            ArrayView<uint8_t> tagBytes;
+            bool created = true;
+            while (created && request.readView(tagBytes)) {
+                Symbol resource;
+                created = Symbol::tryCreate(tagBytes, resource);
+                haveResources.push_back(resource.get());
+            }
+            if (!created) { break; }
+
+            reply << TaskReplyType::Success;
+            reply << varInt(m_db.openWorkerSession(machineName, haveResources));
+            return reply;
+        }
+
+        case TaskRequestType::GetWorkers: {
+            if (request.hasMore()) { break; }
+
+            WorkerRegistryInfo info;
+            std::map<WorkerProfileID, int> runningTasksByProfile;
+            for (const auto& entry : m_db.getWorkerSessions()) {
+                const auto& session = entry.second;
+
+                WorkerInfo worker;
+                worker.id = session.id;
+                worker.profileID = session.profileID;
+                worker.machineName = session.machineName;
+                worker.openTime = session.openTime;
+                worker.lastSeenTime = session.leaseTime;
+                worker.numRunningTasks = (int)session.runningTasks.size();
+                info.workers.push_back(worker);
+
+                runningTasksByProfile[session.profileID] += worker.numRunningTasks;
+            }
+            for (const auto& entry : m_db.getWorkerProfiles()) {
+                const auto& profile = entry.second;
+
+                WorkerProfileInfo profileInfo;
+                profileInfo.id = profile.id;
+                profileInfo.resources.assign(profile.resources.begin(), profile.resources.end());
+                profileInfo.numWorkers = profile.numWorkers;
+                profileInfo.numRunningTasks = runningTasksByProfile[profile.id];
+                info.profiles.push_back(profileInfo);
+            }
+
+            BlobStreamWriter counter = reply.makeCounter();
+            counter << TaskReplyType::Success << info;
+            reply.reserve(counter.size());
+            reply << TaskReplyType::Success;
+            reply << info;
+            return reply;
+        }
+
+        case TaskRequestType::RenewWorkerSession: {
+            WorkerSessionID sessionID;
+            if (!(request >> varInt(sessionID)) || request.hasMore()) { break; }
+
+            auto canceledTasks = m_db.renewWorkerSession(sessionID);
+            if (const auto* canceledTasksPtr = canceledTasks.ptrOrNull()) {
+                reply << TaskReplyType::Success;
+                for (TaskID id : *canceledTasksPtr) {
+                    reply << varInt(id);
+                }
+            }
+            else {
+                reply << TaskReplyType::UnknownSession;
+            }
+            return reply;
+        }
+
+        case TaskRequestType::CloseWorkerSession: {
+            WorkerSessionID sessionID;
+            if (!(request >> varInt(sessionID)) || request.hasMore()) { break; }
+
+            if (m_db.hasWorkerSession(sessionID)) {
+                m_db.closeWorkerSession(sessionID);
+                reply << TaskReplyType::Success;
+            }
+            else {
+                reply << TaskReplyType::UnknownSession;
+            }
+            return reply;
+        }
+
         case TaskRequestType::MarkFinished: {
             TaskID id;
-            if (!(request >> id)) { break; }
+            if (!(request >> varInt(id))) { break; }
 
             auto task = m_db.getTaskByID(id);
             if (task) {
@@ -269,7 +1424,7 @@ BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
 
         case TaskRequestType::MarkShouldCancel: {
             TaskID id;
-            if (!(request >> id)) { break; }
+            if (!(request >> varInt(id))) { break; }
 
             auto task = m_db.getTaskByID(id);
             if (task) {
@@ -281,6 +1436,34 @@ BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
             }
             return reply;
         }
+
+        case TaskRequestType::GetReplicationRecords: {
+            uint64_t epoch, fromSequence;
+            if (!(request >> epoch) || !(request >> fromSequence)) { break; }
+
+            // Failing tells the standby it has to start over from a snapshot
+            std::vector<uint8_t> records;
+            int recordCount = 0;
+            if (epoch != m_replicationEpoch || !m_log.hasBacklog() ||
+                !m_backlog.getRecords(fromSequence, REPLICATION_BATCH_MAX_BYTES, records, recordCount)) {
+                reply << TaskReplyType::Failed;
+                return reply;
+            }
+
+            reply.reserve(sizeof(TaskReplyType) + sizeof(int) * 2 + records.size());
+            reply << TaskReplyType::Success << recordCount << (int)records.size();
+            if (!records.empty()) {
+                reply << ArrayView<uint8_t>(records);
+            }
+            return reply;
+        }
+
+        case TaskRequestType::PromoteToPrimary: {
+            if (request.hasMore()) { break; }
+
+            reply << (promoteToPrimary() ? TaskReplyType::Success : TaskReplyType::Failed);
+            return reply;
+        }
     }
 
     reply << TaskReplyType::BadRequest;
@@ -291,13 +1474,14 @@ BlobStreamWriter TaskServer::generateReply(ArrayView<uint8_t> requestBytes)
 TaskClient::TaskClient(const std::string& ipStr, int port)
     : m_context(1)
     , m_requester(m_context, ZMQ_REQ)
+    , m_protocolVersion(0)
 {
-    std::string connStr = "tcp://" + ipStr + ":" + std::to_string(port);
+    m_endpoint = "tcp://" + ipStr + ":" + std::to_string(port);
     try {
-        m_requester.connect(connStr.c_str());
+        m_requester.connect(m_endpoint.c_str());
     }
     catch (zmq::error_t) {
-        printError("Failed to connect to task server: \"" + connStr + "\"");
+        printError("Failed to connect to task server: \"" + m_endpoint + "\"");
         exit(-1);
     }
 }
@@ -306,36 +1490,79 @@ TaskClient::TaskClient(const std::string& ipStr, int port)
 TaskClient::TaskClient(TaskClient&& client)
     : m_context(std::move(client.m_context))
     , m_requester(std::move(client.m_requester))
+    , m_endpoint(std::move(client.m_endpoint))
+    , m_protocolVersion(client.m_protocolVersion)
 {
 
 }
 
 
-TaskClient::ReplyData TaskClient::getReplyToRequest(const BlobStreamWriter& request)
+BlobStreamWriter TaskClient::newRequest(TaskRequestType type)
 {
-    m_requester.send(toMessage(request));
-    zmq::message_t replyMsg;
-    m_requester.recv(&replyMsg);
+    // The encoding is negotiated before the first request. Servers from before protocol versions reply to Hello as a bad
+    // request, and keep getting untagged requests in the original encoding.
+    if (m_protocolVersion == 0) {
+        BlobStreamWriter hello;
+        hello << TaskRequestType::Hello << PROTOCOL_VERSION;
+
+        ReplyData reply = getReplyToRequest(std::move(hello));
+        uint8_t version = PROTOCOL_VERSION_FIXED_WIDTH;
+        if (reply.type == TaskReplyType::Success) {
+            reply.reader >> version;
+        }
+        m_protocolVersion = clamp(version, PROTOCOL_VERSION_FIXED_WIDTH, PROTOCOL_VERSION);
+    }
+
+    BlobStreamWriter request;
+    if (m_protocolVersion >= PROTOCOL_VERSION_COMPACT) {
+        request << TaskRequestType::Versioned << m_protocolVersion;
+        request.setCompact(true);
+    }
+    request << type;
+    return request;
+}
+
+
+TaskClient::ReplyData TaskClient::getReplyToRequest(BlobStreamWriter&& request)
+{
+    bool compact = request.isCompact();
+    zmq::message_t requestMessage = toMessage(std::move(request));
 
     ReplyData replyData;
-    replyData.data.resize(replyMsg.size());
-    MutableArrayView<uint8_t>(replyData.data).copyFrom(viewMessage(replyMsg));
-    replyData.reader = BlobStreamReader(replyData.data);
+    replyData.message.reset(new zmq::message_t());
+    while (true) {
+        // A copy is sent (sharing the request's bytes), so the request is still at hand if it has to be sent again
+        zmq::message_t sentMessage;
+        sentMessage.copy(&requestMessage);
+        m_requester.send(sentMessage);
+
+        // The reply is parsed straight out of the received message, in the same encoding as the request
+        m_requester.recv(replyData.message.get());
+        replyData.reader = BlobStreamReader(viewMessage(*replyData.message));
+        replyData.reader.setCompact(compact);
+
+        if (!(replyData.reader >> replyData.type)) {
+            replyData.type = TaskReplyType::Failed;
+        }
+        if (replyData.type != TaskReplyType::Reconnect) {
+            return replyData;
+        }
 
-    if (!(replyData.reader >> replyData.type)) {
-        replyData.type = TaskReplyType::Failed;
+        // The server is handing its port off to a new process; by the time this waits out, the old process has closed
+        // the port (or is about to), and a new connection reaches the new one
+        std::this_thread::sleep_for(std::chrono::milliseconds(CLIENT_RECONNECT_DELAY_MS));
+        m_requester = zmq::socket_t(m_context, ZMQ_REQ);
+        m_requester.connect(m_endpoint.c_str());
     }
-    return std::move(replyData);
 }
 
 
 Optional<PooledString> TaskClient::getTaskCommand(TaskID id)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::GetCommand;
-    request << id;
+    BlobStreamWriter request = newRequest(TaskRequestType::GetCommand);
+    request << varInt(id);
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     if (reply.type == TaskReplyType::Success) {
         PooledString val;
         if (reply.reader >> val) {
@@ -349,11 +1576,10 @@ Optional<PooledString> TaskClient::getTaskCommand(TaskID id)
 
 Optional<TaskSchedule> TaskClient::getTaskSchedule(TaskID id)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::GetSchedule;
-    request << id;
+    BlobStreamWriter request = newRequest(TaskRequestType::GetSchedule);
+    request << varInt(id);
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     if (reply.type == TaskReplyType::Success) {
         TaskSchedule val;
         if (reply.reader >> val) {
@@ -367,11 +1593,10 @@ Optional<TaskSchedule> TaskClient::getTaskSchedule(TaskID id)
 
 Optional<TaskStatus> TaskClient::getTaskStatus(TaskID id)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::GetStatus;
-    request << id;
+    BlobStreamWriter request = newRequest(TaskRequestType::GetStatus);
+    request << varInt(id);
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     if (reply.type == TaskReplyType::Success) {
         TaskStatus status;
         if (reply.reader >> status) {
@@ -385,11 +1610,10 @@ Optional<TaskStatus> TaskClient::getTaskStatus(TaskID id)
 
 Optional<bool> TaskClient::heartbeatAndCheckWasTaskCanceled(TaskID id)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::HeartbeatAndCheckWasTaskCanceled;
-    request << id;
+    BlobStreamWriter request = newRequest(TaskRequestType::HeartbeatAndCheckWasTaskCanceled);
+    request << varInt(id);
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     if (reply.type == TaskReplyType::Success) {
         bool wasCanceled;
         if (reply.reader >> wasCanceled) {
@@ -401,41 +1625,73 @@ Optional<bool> TaskClient::heartbeatAndCheckWasTaskCanceled(TaskID id)
 }
 
 
+Optional<std::vector<TaskID>> TaskClient::renewWorkerSession(WorkerSessionID session)
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::RenewWorkerSession);
+    request << varInt(session);
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (reply.type == TaskReplyType::Success) {
+        std::vector<TaskID> canceledTasks;
+        TaskID id;
+        while (reply.reader >> varInt(id)) {
+            canceledTasks.push_back(id);
+        }
+        return std::move(canceledTasks);
+    }
+
+    return Nothing();
+}
+
+
 Optional<std::vector<TaskBriefInfo>> TaskClient::getTasksByStates(const std::set<TaskState>& states)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::GetTasksByStates;
+    BlobStreamWriter request = newRequest(TaskRequestType::GetTasksByStates);
     for (auto state : states) {
         request << state;
     }
 
     std::vector<TaskBriefInfo> tasks;
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     if (reply.type == TaskReplyType::Success) {
         TaskBriefInfo info;
         while (reply.reader >> info) {
-            tasks.push_back(info);
+            tasks.push_back(std::move(info));
         }
     }
     else {
         return Nothing();
     }
 
-    return tasks;
+    return std::move(tasks);
 }
 
 
 Optional<TaskStats> TaskClient::getStats()
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::GetStats;
+    BlobStreamWriter request = newRequest(TaskRequestType::GetStats);
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     if (reply.type == TaskReplyType::Success) {
         TaskStats stats;
         if (reply.reader >> stats) {
-            return stats;
+            return std::move(stats);
+        }
+    }
+    return Nothing();
+}
+
+
+Optional<WorkerRegistryInfo> TaskClient::getWorkers()
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::GetWorkers);
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (reply.type == TaskReplyType::Success) {
+        WorkerRegistryInfo info;
+        if (reply.reader >> info) {
+            return std::move(info);
         }
     }
     return Nothing();
@@ -444,14 +1700,13 @@ Optional<TaskStats> TaskClient::getStats()
 
 Optional<TaskID> TaskClient::createTask(const TaskCreateInfo& startInfo)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::Create;
+    BlobStreamWriter request = newRequest(TaskRequestType::Create);
     request << startInfo;
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     if (reply.type == TaskReplyType::Success) {
         TaskID id;
-        if (reply.reader >> id) {
+        if (reply.reader >> varInt(id)) {
             return id;
         }
     }
@@ -460,19 +1715,146 @@ Optional<TaskID> TaskClient::createTask(const TaskCreateInfo& startInfo)
 }
 
 
+Optional<std::vector<TaskID>> TaskClient::createTasks(ArrayView<TaskCreateInfo> startInfos)
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::CreateMany);
+    request << varInt((size_t)startInfos.size());
+    for (int i = 0; i < startInfos.size(); ++i) {
+        request << startInfos[i];
+    }
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (reply.type == TaskReplyType::Success) {
+        size_t count;
+        if (!(reply.reader >> varInt(count)) || count != (size_t)startInfos.size()) { return Nothing(); }
+
+        std::vector<TaskID> ids(count);
+        for (auto& id : ids) {
+            if (!(reply.reader >> varInt(id))) { return Nothing(); }
+        }
+        return std::move(ids);
+    }
+
+    return Nothing();
+}
+
+
 Optional<TaskRunInfo> TaskClient::takeTaskToRun(const std::vector<std::string>& haveResources)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::TakeToRun;
+    BlobStreamWriter request = newRequest(TaskRequestType::TakeToRun);
     for (const auto& resource : haveResources) {
         request << resource;
     }
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (reply.type == TaskReplyType::Success) {
+        TaskRunInfo info;
+        if (reply.reader >> info) {
+            return std::move(info);
+        }
+    }
+
+    return Nothing();
+}
+
+
+Optional<TaskRunInfo> TaskClient::takeTaskToRun(WorkerSessionID session, bool* outUnknownSession)
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::TakeToRunInSession);
+    request << varInt(session);
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (outUnknownSession) {
+        *outUnknownSession = (reply.type == TaskReplyType::UnknownSession);
+    }
     if (reply.type == TaskReplyType::Success) {
         TaskRunInfo info;
         if (reply.reader >> info) {
-            return info;
+            return std::move(info);
+        }
+    }
+
+    return Nothing();
+}
+
+
+Optional<std::vector<TaskRunInfo>> TaskClient::takeTasksToRun(WorkerSessionID session, int maxCount, bool* outUnknownSession)
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::TakeManyToRunInSession);
+    request << varInt(session);
+    request << varInt(maxCount);
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (outUnknownSession) {
+        *outUnknownSession = (reply.type == TaskReplyType::UnknownSession);
+    }
+    if (reply.type == TaskReplyType::Success) {
+        size_t count;
+        if (!(reply.reader >> varInt(count))) { return Nothing(); }
+
+        std::vector<TaskRunInfo> tasks(count);
+        for (auto& info : tasks) {
+            if (!(reply.reader >> info)) { return Nothing(); }
+        }
+        return std::move(tasks);
+    }
+
+    return Nothing();
+}
+
+
+Optional<std::vector<TaskRunInfo>> TaskClient::finishAndTakeTasksToRun(WorkerSessionID session, ArrayView<TaskID> finishedTasks, int maxCount,
+    bool* outUnknownSession, int* outNumFinished)
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::FinishAndTakeToRunInSession);
+    request << varInt(session);
+    request << varInt((size_t)finishedTasks.size());
+    for (int i = 0; i < finishedTasks.size(); ++i) {
+        request << varInt(finishedTasks[i]);
+    }
+    request << varInt(maxCount);
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (outUnknownSession) {
+        *outUnknownSession = (reply.type == TaskReplyType::UnknownSession);
+    }
+
+    size_t numFinished = 0;
+    if (reply.type == TaskReplyType::Success || reply.type == TaskReplyType::UnknownSession) {
+        reply.reader >> varInt(numFinished);
+    }
+    if (outNumFinished) {
+        *outNumFinished = (int)numFinished;
+    }
+
+    if (reply.type == TaskReplyType::Success) {
+        size_t count;
+        if (!(reply.reader >> varInt(count))) { return Nothing(); }
+
+        std::vector<TaskRunInfo> tasks(count);
+        for (auto& info : tasks) {
+            if (!(reply.reader >> info)) { return Nothing(); }
+        }
+        return std::move(tasks);
+    }
+
+    return Nothing();
+}
+
+
+Optional<WorkerSessionID> TaskClient::openWorkerSession(const std::string& machineName, const std::vector<std::string>& haveResources)
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::OpenWorkerSession);
+    request << machineName;
+    for (const auto& resource : haveResources) {
+        request << resource;
+    }
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    if (reply.type == TaskReplyType::Success) {
+        WorkerSessionID session;
+        if (reply.reader >> varInt(session)) {
+            return session;
         }
     }
 
@@ -480,24 +1862,41 @@ Optional<TaskRunInfo> TaskClient::takeTaskToRun(const std::vector<std::string>&
 }
 
 
+bool TaskClient::closeWorkerSession(WorkerSessionID session)
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::CloseWorkerSession);
+    request << varInt(session);
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    return (reply.type == TaskReplyType::Success);
+}
+
+
+bool TaskClient::promoteToPrimary()
+{
+    BlobStreamWriter request = newRequest(TaskRequestType::PromoteToPrimary);
+
+    ReplyData reply = getReplyToRequest(std::move(request));
+    return (reply.type == TaskReplyType::Success);
+}
+
+
 bool TaskClient::markTaskFinished(TaskID task)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::MarkFinished;
-    request << task;
+    BlobStreamWriter request = newRequest(TaskRequestType::MarkFinished);
+    request << varInt(task);
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     return (reply.type == TaskReplyType::Success);
 }
 
 
 bool TaskClient::markTaskShouldCancel(TaskID task)
 {
-    BlobStreamWriter request;
-    request << TaskRequestType::MarkShouldCancel;
-    request << task;
+    BlobStreamWriter request = newRequest(TaskRequestType::MarkShouldCancel);
+    request << varInt(task);
 
-    ReplyData reply = getReplyToRequest(request);
+    ReplyData reply = getReplyToRequest(std::move(request));
     return (reply.type == TaskReplyType::Success);
 }
 
@@ -532,34 +1931,3 @@ ColoredString ServerStats::toColoredString() const
         ColoredString(std::to_string(badRequests), TextColor::LightRed) +
         ColoredString(" bad/corrupt.", TextColor::Red);
 }
-
-
-void TaskBriefInfo::serialize(BlobStreamWriter& writer) const
-{
-    writer << id;
-    writer << status;
-}
-
-
-bool TaskBriefInfo::deserialize(BlobStreamReader& reader)
-{
-    if (!(reader >> id)) { return false; }
-    if (!(reader >> status)) { return false; }
-    return true;
-}
-
-
-void TaskRunInfo::serialize(BlobStreamWriter& writer) const
-{
-    writer << id;
-    writer << command;
-}
-
-
-bool TaskRunInfo::deserialize(BlobStreamReader& reader)
-{
-    if (!(reader >> id)) { return false; }
-    if (!(reader >> command)) { return false; }
-    return true;
-}
-
@@ -1,7 +1,15 @@
 #pragma once
 
 #include "TaskDatabase.h"
+#include "TaskLog.h"
+#include "TaskSpill.h"
+#include "TaskSnapshot.h"
+#include "TaskReplication.h"
+#include "TaskTrace.h"
 #include "External/zmq.hpp"
+#include <future>
+#include <chrono>
+#include <memory>
 #include "Crust/BlobStream.h"
 #include "Crust/FormattedText.h"
 
@@ -17,21 +25,88 @@ static const int SERVER_STATS_MIN_INTERVAL_SECONDS = 10;
 // has happened to a worker owning a particular task (e.g. it was killed, machine lost power, etc.)
 static const int WORKER_HEARTBEAT_TIMEOUT_SECONDS = 60 * 5;
 
+// The most tasks a worker may take to run with a single request
+static const int MAX_TASKS_TAKEN_PER_REQUEST = 1024;
+
+// The most tasks a client may create with a single request (larger batches are split over several requests)
+static const int MAX_TASKS_CREATED_PER_REQUEST = 4096;
+
 // Seconds between checking for and cleaning up running tasks that have timed out
 static const int SERVER_TASK_CLEANUP_INTERVAL_SECONDS = 60;
 
+// How long the server waits for requests before doing periodic work (stats, cleanup) anyway
+static const int SERVER_POLL_TIMEOUT_MS = 1000;
+
+// The most requests the server handles (and group-commits to its log) before replying to them
+static const int MAX_REQUESTS_PER_POLL_CYCLE = 1024;
+
+// The write-ahead log within the server's data directory is split into numbered generations ("tasks.<n>.log"). Each
+// snapshot starts a new generation, and older generations are deleted once the snapshot is safely on disk.
+static const char* const TASK_LOG_FILENAME_PREFIX = "tasks.";
+static const char* const TASK_LOG_FILENAME_SUFFIX = ".log";
+static const char* const TASK_SNAPSHOT_FILENAME = "tasks.snapshot";
+
+// Each server process spills pending tasks into its own file in the data directory ("tasks.<id>.spill", or the same
+// plus TASK_SPILL_COMPACT_SUFFIX after every other compaction), which is deleted as soon as the process exits
+static const char* const TASK_SPILL_FILENAME_PREFIX = "tasks.";
+static const char* const TASK_SPILL_FILENAME_SUFFIX = ".spill";
+
+// Once the current log generation grows past this size, the server snapshots the database and starts a new generation
+static const uint64_t SNAPSHOT_MIN_LOG_SIZE = 64 * 1024 * 1024;
+
+// After handing off to a new server process, the old one keeps its port for this long, relaying every request it gets
+// to the new process over a private loopback connection. Once the relayed requests are answered it closes the port,
+// which the new process then binds (clients transparently reconnect to it).
+static const int HANDOFF_DRAIN_MS = 2000;
+
+// Past the drain, the old process tells clients that understand it to reconnect rather than relaying their requests,
+// and only closes the port once it has gone this long without getting any request (closing it would lose requests
+// still on their way in). Clients wait CLIENT_RECONNECT_DELAY_MS before reconnecting, so they do go quiet.
+static const int HANDOFF_QUIET_MS = 100;
+static const int CLIENT_RECONNECT_DELAY_MS = 250;
+
+// How long a new server process keeps trying to bind the port it's taking over, while the old process drains it (which
+// takes at most HANDOFF_DRAIN_MS plus REPLICATION_TIMEOUT_MS), and how often it tries
+static const int HANDOFF_BIND_TIMEOUT_MS = 10000;
+static const int HANDOFF_BIND_RETRY_MS = 10;
+
+// Versions of the request/reply encoding. Version 1 writes every integer at its full width; version 2 writes counts,
+// lengths and IDs as varints and timestamps as deltas (see BlobStreamWriter::setCompact); version 3 encodes the same as
+// 2, but its clients understand the Reconnect reply. Clients negotiate the version with a Hello request, then tag each
+// request with it. Untagged requests (and their replies) use version 1.
+static const uint8_t PROTOCOL_VERSION_FIXED_WIDTH = 1;
+static const uint8_t PROTOCOL_VERSION_COMPACT = 2;
+static const uint8_t PROTOCOL_VERSION_RECONNECT = 3;
+static const uint8_t PROTOCOL_VERSION = PROTOCOL_VERSION_RECONNECT; // the latest version
+
+// Messages smaller than this are copied into zmq rather than handing it the writer's buffer, since zmq keeps small
+// messages inline but has to allocate bookkeeping of its own for a buffer it's handed
+static const size_t MIN_ZERO_COPY_MESSAGE_BYTES = 64;
+
 
 enum class TaskRequestType : uint8_t
 {
     GetCommand, GetSchedule, GetStatus,
     GetStats, GetTasksByStates,
     Create, TakeToRun, HeartbeatAndCheckWasTaskCanceled,
-    MarkFinished, MarkShouldCancel
+    MarkFinished, MarkShouldCancel,
+    OpenWorkerSession, RenewWorkerSession, CloseWorkerSession, TakeToRunInSession,
+    GetWorkers, TakeManyToRunInSession, CreateMany,
+    FinishAndTakeToRunInSession,
+    GetReplicationSnapshot, GetReplicationRecords, PromoteToPrimary,
+    HandOff,
+    Hello, // negotiates the protocol version
+    Versioned // tags a request with the protocol version it's encoded in; followed by the version and the request itself
 };
 
+const char* getRequestTypeName(TaskRequestType type);
+
 enum class TaskReplyType : uint8_t
 {
-    BadRequest, Success, Failed
+    BadRequest, Success, Failed,
+    UnknownSession, // the worker session referenced by the request has expired (or never existed); the worker should open a new one
+    NotPrimary, // the server is a standby, which only answers requests that don't change anything
+    Reconnect // the server is handing its port off to a new process, and didn't handle the request; send it again on a new connection
 };
 
 
@@ -51,42 +126,160 @@ struct TaskBriefInfo
     TaskID id;
     TaskStatus status;
 
-    void serialize(BlobStreamWriter& writer) const;
-    bool deserialize(BlobStreamReader& reader);
+    static auto getSchema() { return makeBlobSchema(varIntField(&TaskBriefInfo::id), blobField(&TaskBriefInfo::status)); }
 };
 
-inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskBriefInfo& val) { val.serialize(writer); return writer; }
-inline bool operator>>(BlobStreamReader& reader, TaskBriefInfo& val) { return val.deserialize(reader); }
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskBriefInfo& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, TaskBriefInfo& val) { return readBlobSchema(reader, val); }
 
 
 struct TaskRunInfo
 {
     TaskID id;
-    PooledString command;
+    std::string command;
+
+    static auto getSchema() { return makeBlobSchema(varIntField(&TaskRunInfo::id), blobField(&TaskRunInfo::command)); }
+};
 
-    void serialize(BlobStreamWriter& writer) const;
-    bool deserialize(BlobStreamReader& reader);
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskRunInfo& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, TaskRunInfo& val) { return readBlobSchema(reader, val); }
+
+
+// Describes one registered worker profile (a distinct resource tag set) and how much capacity the cluster has for it
+struct WorkerProfileInfo
+{
+    WorkerProfileID id;
+    std::vector<Symbol> resources;
+    int numWorkers;
+    int numRunningTasks;
+
+    static auto getSchema()
+    {
+        return makeBlobSchema(varIntField(&WorkerProfileInfo::id), listField(&WorkerProfileInfo::resources),
+            varIntField(&WorkerProfileInfo::numWorkers), varIntField(&WorkerProfileInfo::numRunningTasks));
+    }
 };
 
-inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const TaskRunInfo& val) { val.serialize(writer); return writer; }
-inline bool operator>>(BlobStreamReader& reader, TaskRunInfo& val) { return val.deserialize(reader); }
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const WorkerProfileInfo& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, WorkerProfileInfo& val) { return readBlobSchema(reader, val); }
+
+
+struct WorkerInfo
+{
+    WorkerSessionID id;
+    WorkerProfileID profileID;
+    PooledString machineName;
+    std::time_t openTime;
+    std::time_t lastSeenTime;
+    int numRunningTasks;
+
+    static auto getSchema()
+    {
+        return makeBlobSchema(varIntField(&WorkerInfo::id), varIntField(&WorkerInfo::profileID), blobField(&WorkerInfo::machineName),
+            deltaVarIntField(&WorkerInfo::openTime), deltaVarIntField(&WorkerInfo::lastSeenTime), varIntField(&WorkerInfo::numRunningTasks));
+    }
+};
+
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const WorkerInfo& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, WorkerInfo& val) { return readBlobSchema(reader, val); }
+
+
+// A snapshot of the server's live worker registry
+struct WorkerRegistryInfo
+{
+    std::vector<WorkerProfileInfo> profiles;
+    std::vector<WorkerInfo> workers;
+
+    static auto getSchema() { return makeBlobSchema(listField(&WorkerRegistryInfo::profiles), listField(&WorkerRegistryInfo::workers)); }
+};
+
+inline BlobStreamWriter& operator<<(BlobStreamWriter& writer, const WorkerRegistryInfo& val) { return writeBlobSchema(writer, val); }
+inline bool operator>>(BlobStreamReader& reader, WorkerRegistryInfo& val) { return readBlobSchema(reader, val); }
 
 
 class TaskServer
 {
 public:
-    TaskServer(int port);
+    TaskServer(int port, const std::string& dataDir = ""); // without a data directory, tasks are only kept in memory
+    void follow(const std::string& primaryIP, int primaryPort); // makes this server a standby of another one, until promoted
+    void takeOver(); // makes run() take over the state and port of the server already running on the same port (e.g. to upgrade it)
+    void setMaxResidentPendingTasks(size_t count); // pending tasks beyond this many are spilled to the data directory (0 keeps all in memory)
+    void setTraceFile(const std::string& path); // records every request run() handles into a trace, for replaying it offline (see TaskReplay)
     void run();
     void shutdown();
+    const ServerStats& getStats() const { return m_stats; } // only consistent once run() has returned
+
+    // Handles a request without run(), as if it had arrived in a poll cycle of its own (e.g. to replay a trace)
+    std::vector<BlobStreamWriter> handleRequest(ArrayView<uint8_t> request);
+    TaskDatabase& getDatabase() { return m_db; }
 
 private:
-    void processRequest();
+    void restoreFromDisk();
+    void openSpill();
+    bool tryBindPort();
+    void bindPort();
+    void bindHandedOffPort(); // binds the port once the server taken over releases it (or exits if it doesn't in time)
+    void takeOverFromRunningServer();
+    BlobStreamWriter generateHandOffReply(uint64_t epoch, uint64_t fromSequence, const std::string& successorDataDir);
+    void forwardRequestsToSuccessor();
+    void processRequests(); // handles every request received in one poll cycle, then commits the log and replies to all of them
+    void commitLog();
+    std::string getLogPath(uint64_t generation) const;
+    void startSnapshot(); // starts a snapshot of the data directory
+    void beginSnapshot(); // begins serializing the database, for the data directory and/or the standbys waiting for a snapshot
+    void continueSnapshot(); // serializes the snapshot's next chunk, or finishes it once every chunk is done
+    void finishSnapshot(bool wait);
+    void sendSnapshotToStandbys();
     BlobStreamWriter generateReply(ArrayView<uint8_t> request);
 
+    // Standby mode: the server streams its primary's log records and applies them, instead of accepting changes itself
+    bool isFollowing() const { return !m_primaryConnStr.empty(); }
+    void connectToPrimary();
+    int getPrimaryTimeoutMS() const; // how long to wait for the primary's reply (snapshots take longer than records)
+    void updateReplication(bool primaryReplied);
+    bool handlePrimaryReply(const std::vector<zmq::message_t>& frames); // returns whether more records may be waiting
+    bool applyPrimaryRecords(BlobStreamReader& reply, int* outRecordCount);
+    bool applyPrimarySnapshot(const std::vector<zmq::message_t>& frames);
+    bool promoteToPrimary();
+
     TaskDatabase m_db;
+    Arena m_requestArena; // temporaries of the request being handled, all freed at once before the next one
+    TaskCreateInfo m_decodedCreateInfo; // reused to decode tasks to create, so its buffers are only allocated once
+    ReplicationBacklog m_backlog;
+    TaskLog m_log;
+    TaskSpill m_spill;
+    TaskTraceWriter m_trace;
+    std::string m_tracePath;
+    size_t m_maxResidentPendingTasks;
     int m_port;
-    zmq::context_t m_context;
+    std::string m_dataDir;
+    uint64_t m_logGeneration; // the generation of the log currently being appended to
+    uint64_t m_oldestLogGeneration; // the oldest generation still on disk
+    bool m_snapshotting; // whether the database is serializing a snapshot, a chunk per poll cycle
+    std::shared_ptr<TaskSnapshotWriter> m_snapshotFile; // where the snapshot being serialized goes in the data directory, if anywhere
+    std::vector<zmq::message_t> m_waitingStandbys; // the standbys that asked for a snapshot, which they get from the next one to begin
+    std::vector<zmq::message_t> m_snapshotStandbys; // the standbys the snapshot being serialized goes to once it's complete
+    std::vector<BlobStreamWriter> m_snapshotStandbyChunks; // what's been serialized of it so far, if it goes to any standbys
+    uint64_t m_snapshotSequence; // the sequence number of the first record logged after the snapshot being serialized
+    std::future<bool> m_snapshotWrite; // the snapshot being synced to disk in the background, if any
+    uint64_t m_snapshotLogGeneration; // the first log generation not covered by the snapshot being written
+    uint64_t m_replicationEpoch; // identifies this server's record sequence, which starts over whenever its state is replaced
+    std::string m_primaryConnStr; // empty unless this server is a standby
+    bool m_awaitingPrimaryReply;
+    bool m_syncedWithPrimary;
+    uint64_t m_primaryEpoch;
+    uint64_t m_primarySequence; // the sequence number of the next primary record to apply
+    std::chrono::steady_clock::time_point m_primaryRequestTime;
+    std::chrono::steady_clock::time_point m_nextPrimaryRequestTime;
+    bool m_takingOver;
+    bool m_waitingForPort; // set while this server has taken over, but the old process hasn't released the port yet
+    std::chrono::steady_clock::time_point m_portGiveUpTime;
+    std::string m_handOffEndpoint; // the private endpoint this server gets relayed requests on while taking over
+    bool m_handedOff; // set once this server has handed its state off to a new process, which it then makes way for
+    std::string m_successorEndpoint; // the new process's private endpoint, which requests are relayed to
+    zmq::context_t m_context; // declared before every socket, so it's destroyed after them (destroying it first would hang)
     zmq::socket_t m_responder;
+    std::unique_ptr<zmq::socket_t> m_primary; // the socket to the primary server, while this is a standby or taking over
     ServerStats m_stats;
     volatile bool m_running;
 };
@@ -102,28 +295,42 @@ public:
     Optional<TaskSchedule> getTaskSchedule(TaskID id);
     Optional<TaskStatus> getTaskStatus(TaskID id);
     Optional<bool> heartbeatAndCheckWasTaskCanceled(TaskID id);
+    Optional<std::vector<TaskID>> renewWorkerSession(WorkerSessionID session); // returns the session's canceled tasks; nothing if the session expired
     Optional<std::vector<TaskBriefInfo>> getTasksByStates(const std::set<TaskState>& states);
     Optional<TaskStats> getStats();
+    Optional<WorkerRegistryInfo> getWorkers();
 
     Optional<TaskID> createTask(const TaskCreateInfo& startInfo);
+    Optional<std::vector<TaskID>> createTasks(ArrayView<TaskCreateInfo> startInfos); // at most MAX_TASKS_CREATED_PER_REQUEST
     Optional<TaskRunInfo> takeTaskToRun(const std::vector<std::string>& haveResources);
+    Optional<TaskRunInfo> takeTaskToRun(WorkerSessionID session, bool* outUnknownSession = nullptr);
+    Optional<std::vector<TaskRunInfo>> takeTasksToRun(WorkerSessionID session, int maxCount, bool* outUnknownSession = nullptr);
+
+    // Marks the given tasks finished and takes up to maxCount new tasks for the session in a single round trip
+    Optional<std::vector<TaskRunInfo>> finishAndTakeTasksToRun(WorkerSessionID session, ArrayView<TaskID> finishedTasks, int maxCount,
+        bool* outUnknownSession = nullptr, int* outNumFinished = nullptr);
     bool markTaskFinished(TaskID task); // this should be called whenever a running task finishes, whether or not it was canceled while it was running
     bool markTaskShouldCancel(TaskID task);
 
+    Optional<WorkerSessionID> openWorkerSession(const std::string& machineName, const std::vector<std::string>& haveResources);
+    bool closeWorkerSession(WorkerSessionID session);
+
+    bool promoteToPrimary(); // turns a standby server into a primary that accepts changes
+
     void waitUntilTaskFinished(TaskID task);
 
 private:
     struct ReplyData
     {
         ReplyData() {}
-        ReplyData(ReplyData&& other) 
+        ReplyData(ReplyData&& other)
         {
-            data = std::move(other.data);
+            message = std::move(other.message);
             type = other.type;
             reader = std::move(other.reader);
         }
-        
-        std::vector<uint8_t> data;
+
+        std::unique_ptr<zmq::message_t> message; // on the heap, so the reader's view of it stays valid when this is moved
         TaskReplyType type;
         BlobStreamReader reader;
 
@@ -131,8 +338,11 @@ private:
         ReplyData(const ReplyData& other) {}
     };
 
-    ReplyData getReplyToRequest(const BlobStreamWriter& request);
+    BlobStreamWriter newRequest(TaskRequestType type); // starts a request in the negotiated encoding
+    ReplyData getReplyToRequest(BlobStreamWriter&& request);
 
     zmq::context_t m_context;
     zmq::socket_t m_requester;
+    std::string m_endpoint; // what the requester connects to, again whenever the server says to reconnect
+    uint8_t m_protocolVersion; // 0 until negotiated
 };
@@ -0,0 +1,402 @@
+#include "TaskSimulator.h"
+#include "TaskServer.h"
+#include "Crust/Error.h"
+#include "Crust/FormattedText.h"
+#include "Crust/Util.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+// The spread of simulated task durations (the standard deviation of their logarithm); at 1, about a tenth of tasks run
+// over twice as long as the mean, and one in twenty over three times as long
+static const double SIMULATED_DURATION_SIGMA = 1.0;
+
+// Simulated arrival rates follow a sine wave with this period, peaking a quarter of the way through it
+static const double SIMULATED_DAY_SECONDS = 24.0 * 60.0 * 60.0;
+
+static const double PI = 3.14159265358979323846;
+
+// Simulated workers renew their sessions as rarely as they can without any lease expiring, since the renewals are
+// only there to keep the zombie cleanup from timing them out, and would otherwise take most of the simulation's time
+static const int SIMULATED_RENEW_INTERVAL_SECONDS = WORKER_HEARTBEAT_TIMEOUT_SECONDS / 2;
+
+
+TaskSimulatorConfig::TaskSimulatorConfig()
+    : slotsPerWorker(1)
+    , simulatedSeconds(SIMULATED_DAY_SECONDS)
+    , diurnalAmplitude(0.5)
+    , starvationSeconds(60.0 * 60.0)
+    , seed(1)
+{
+    parseWorkerPools("8000:linux,1500:linux+gpu,500:windows");
+    parseTaskClasses("30:linux:180,5:gpu:200,1.2:windows:300");
+}
+
+
+static std::vector<std::string> parseTags(const std::string& tagsStr)
+{
+    return splitString(tagsStr, "+", false);
+}
+
+
+bool TaskSimulatorConfig::parseWorkerPools(const std::string& spec)
+{
+    pools.clear();
+    for (const auto& poolStr : splitString(spec, ",", false)) {
+        auto fields = splitString(poolStr, ":", true);
+        if (fields.size() != 2) { return false; }
+
+        SimulatedWorkerPool pool;
+        pool.numWorkers = parseInt(fields[0]);
+        pool.resources = parseTags(fields[1]);
+        if (pool.numWorkers < 1) { return false; }
+        pools.push_back(pool);
+    }
+    return !pools.empty();
+}
+
+
+bool TaskSimulatorConfig::parseTaskClasses(const std::string& spec)
+{
+    taskClasses.clear();
+    for (const auto& classStr : splitString(spec, ",", false)) {
+        auto fields = splitString(classStr, ":", true);
+        if (fields.size() != 3) { return false; }
+
+        SimulatedTaskClass taskClass;
+        taskClass.tasksPerSecond = atof(fields[0].c_str());
+        taskClass.requiredResources = parseTags(fields[1]);
+        taskClass.meanDurationSeconds = atof(fields[2].c_str());
+        if (!(taskClass.tasksPerSecond > 0.0) || !(taskClass.meanDurationSeconds > 0.0)) { return false; }
+        taskClasses.push_back(taskClass);
+    }
+    return !taskClasses.empty();
+}
+
+
+TaskSimulator::TaskSimulator(const TaskSimulatorConfig& config)
+    : m_config(config)
+    , m_random(config.seed)
+    , m_nextEventOrder(0)
+    , m_now(0.0)
+    , m_lastRenewTime(0)
+    , m_lastCleanupTime(0)
+{
+    // Tasks of different classes that require the same tags are reported together, as the scheduler can't tell them apart
+    std::map<std::string, int> signatureIndices;
+    for (const auto& taskClass : m_config.taskClasses) {
+        TaskCreateInfo info;
+        info.command = "simulated";
+        info.schedule.requiredResources.assign(taskClass.requiredResources.begin(), taskClass.requiredResources.end());
+        normalizeResourceTags(info.schedule.requiredResources);
+
+        auto inserted = signatureIndices.insert(std::make_pair(info.schedule.getSignature(), (int)m_signatures.size()));
+        if (inserted.second) {
+            std::vector<std::string> tags = taskClass.requiredResources;
+            std::sort(tags.begin(), tags.end());
+            SignatureStats stats;
+            for (const auto& tag : tags) {
+                stats.name += (stats.name.empty() ? "" : "+") + tag;
+            }
+            if (stats.name.empty()) { stats.name = "(no tags)"; }
+            m_signatures.push_back(stats);
+        }
+        m_classSignatures.push_back(inserted.first->second);
+        m_classInfos.push_back(info);
+    }
+}
+
+
+void TaskSimulator::schedule(double time, EventType type, int index, TaskID taskID)
+{
+    Event event;
+    event.time = time;
+    event.order = m_nextEventOrder++;
+    event.type = type;
+    event.index = index;
+    event.taskID = taskID;
+    m_events.push(event);
+}
+
+
+void TaskSimulator::scheduleArrival(int classIndex, double after)
+{
+    // Arrivals at the varying diurnal rate are drawn by thinning ones at the peak rate
+    double baseRate = m_config.taskClasses[classIndex].tasksPerSecond;
+    double peakRate = baseRate * (1.0 + m_config.diurnalAmplitude);
+    std::exponential_distribution<double> interval(peakRate);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    double time = after;
+    while (true) {
+        time += interval(m_random);
+        double rate = baseRate * (1.0 + m_config.diurnalAmplitude * std::sin(2.0 * PI * time / SIMULATED_DAY_SECONDS));
+        if (uniform(m_random) * peakRate <= rate) { break; }
+    }
+    schedule(time, EventType::TaskArrival, classIndex);
+}
+
+
+void TaskSimulator::setTime(double time)
+{
+    m_now = time;
+    std::time_t now = (std::time_t)time;
+    m_db.setVirtualTime(now);
+
+    if (now - m_lastRenewTime >= SIMULATED_RENEW_INTERVAL_SECONDS) {
+        for (const auto& worker : m_workers) {
+            m_db.renewWorkerSession(worker.sessionID);
+        }
+        m_lastRenewTime = now;
+    }
+    if (now - m_lastCleanupTime >= SERVER_TASK_CLEANUP_INTERVAL_SECONDS) {
+        m_db.cleanupZombieTasks(WORKER_HEARTBEAT_TIMEOUT_SECONDS);
+        m_lastCleanupTime = now;
+    }
+}
+
+
+void TaskSimulator::updateIdleList(int workerIndex)
+{
+    SimulatedWorker& worker = m_workers[workerIndex];
+    auto& idleWorkers = m_idleWorkers[worker.poolIndex];
+
+    if (worker.freeSlots > 0 && worker.idlePosition < 0) {
+        worker.idlePosition = (int)idleWorkers.size();
+        idleWorkers.push_back(workerIndex);
+    }
+    else if (worker.freeSlots == 0 && worker.idlePosition >= 0) {
+        int lastWorker = idleWorkers.back();
+        idleWorkers[worker.idlePosition] = lastWorker;
+        m_workers[lastWorker].idlePosition = worker.idlePosition;
+        idleWorkers.pop_back();
+        worker.idlePosition = -1;
+    }
+}
+
+
+bool TaskSimulator::takeTasks(int workerIndex)
+{
+    SimulatedWorker& worker = m_workers[workerIndex];
+    if (worker.freeSlots == 0) { return false; }
+
+    m_arena.reset();
+    ArenaVector<TaskPtr> taken(m_arena);
+    m_db.takeTasksToRun(worker.sessionID, worker.freeSlots, taken);
+
+    for (const auto& task : taken) {
+        auto it = m_tasks.find(task->getID());
+        if (it == m_tasks.end()) { fail("The simulator's worker took a task it never created"); }
+
+        SimulatedTask& simulated = it->second;
+        simulated.startTime = m_now;
+        simulated.workerIndex = workerIndex;
+        SignatureStats& stats = m_signatures[m_classSignatures[simulated.classIndex]];
+        double waitSeconds = m_now - simulated.createTime;
+        stats.numStarted++;
+        stats.waitSeconds.push_back((float)waitSeconds);
+        if (waitSeconds >= m_config.starvationSeconds) {
+            stats.numStarved++;
+        }
+
+        schedule(m_now + simulated.duration, EventType::TaskFinish, workerIndex, task->getID());
+        worker.freeSlots--;
+    }
+
+    updateIdleList(workerIndex);
+    return !taken.empty();
+}
+
+
+void TaskSimulator::dispatchToIdleWorkers()
+{
+    // Every idle worker is polling, so whichever polls first gets the new task: pick pools in proportion to how many of
+    // their workers are idle, skipping pools whose workers can't run any pending task. Before the new task arrived, no
+    // idle worker could run any pending task, so once some worker takes a task there's nothing left for the others.
+    std::vector<bool> tried(m_idleWorkers.size(), false);
+    while (true) {
+        size_t candidates = 0;
+        for (size_t i = 0; i < m_idleWorkers.size(); ++i) {
+            if (!tried[i]) { candidates += m_idleWorkers[i].size(); }
+        }
+        if (candidates == 0) { return; }
+
+        size_t pick = std::uniform_int_distribution<size_t>(0, candidates - 1)(m_random);
+        size_t poolIndex = 0;
+        while (tried[poolIndex] || pick >= m_idleWorkers[poolIndex].size()) {
+            if (!tried[poolIndex]) { pick -= m_idleWorkers[poolIndex].size(); }
+            poolIndex++;
+        }
+
+        if (takeTasks(m_idleWorkers[poolIndex][pick])) { return; }
+        tried[poolIndex] = true;
+    }
+}
+
+
+void TaskSimulator::handleArrival(const Event& event)
+{
+    int classIndex = event.index;
+    const SimulatedTaskClass& taskClass = m_config.taskClasses[classIndex];
+
+    double mu = std::log(taskClass.meanDurationSeconds) - SIMULATED_DURATION_SIGMA * SIMULATED_DURATION_SIGMA / 2.0;
+    std::lognormal_distribution<double> durations(mu, SIMULATED_DURATION_SIGMA);
+
+    SimulatedTask simulated;
+    TaskID id = m_db.createTask(m_classInfos[classIndex]);
+    simulated.task = m_db.getTaskByID(id);
+    simulated.classIndex = classIndex;
+    simulated.createTime = m_now;
+    simulated.duration = durations(m_random);
+    simulated.startTime = -1.0;
+    simulated.workerIndex = -1;
+    m_tasks[id] = simulated;
+    m_signatures[m_classSignatures[classIndex]].numCreated++;
+
+    scheduleArrival(classIndex, m_now);
+    dispatchToIdleWorkers();
+}
+
+
+void TaskSimulator::handleFinish(const Event& event)
+{
+    auto it = m_tasks.find(event.taskID);
+    if (it == m_tasks.end()) { return; }
+
+    SimulatedWorker& worker = m_workers[event.index];
+    m_poolBusySlotSeconds[worker.poolIndex] += it->second.duration;
+    m_db.markTaskFinished(it->second.task);
+    m_tasks.erase(it);
+
+    // The worker asks for more work right away with the slot it just freed
+    worker.freeSlots++;
+    updateIdleList(event.index);
+    takeTasks(event.index);
+}
+
+
+void TaskSimulator::run()
+{
+    int numWorkers = 0;
+    for (const auto& pool : m_config.pools) {
+        numWorkers += pool.numWorkers;
+    }
+    ColoredString("Simulating " + std::to_string(numWorkers) + " workers for " + std::to_string((int64_t)m_config.simulatedSeconds) +
+        " seconds\n", TextColor::Cyan).print();
+
+    auto wallStartTime = std::chrono::steady_clock::now();
+    m_db.seedIDs(m_config.seed);
+    setTime(0.0);
+
+    m_idleWorkers.resize(m_config.pools.size());
+    m_poolBusySlotSeconds.assign(m_config.pools.size(), 0.0);
+    for (size_t poolIndex = 0; poolIndex < m_config.pools.size(); ++poolIndex) {
+        const auto& pool = m_config.pools[poolIndex];
+        for (int i = 0; i < pool.numWorkers; ++i) {
+            SimulatedWorker worker;
+            worker.sessionID = m_db.openWorkerSession("sim-worker-" + std::to_string(m_workers.size()), pool.resources);
+            worker.poolIndex = (int)poolIndex;
+            worker.freeSlots = m_config.slotsPerWorker;
+            worker.idlePosition = -1;
+            m_workers.push_back(worker);
+            updateIdleList((int)m_workers.size() - 1);
+        }
+    }
+
+    for (size_t i = 0; i < m_config.taskClasses.size(); ++i) {
+        scheduleArrival((int)i, 0.0);
+    }
+
+    uint64_t numEvents = 0;
+    while (!m_events.empty() && m_events.top().time <= m_config.simulatedSeconds) {
+        Event event = m_events.top();
+        m_events.pop();
+        setTime(event.time);
+        numEvents++;
+
+        if (event.type == EventType::TaskArrival) {
+            handleArrival(event);
+        }
+        else {
+            handleFinish(event);
+        }
+    }
+    m_now = m_config.simulatedSeconds;
+    finishStats();
+
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStartTime).count();
+    printReport(wallSeconds, numEvents);
+}
+
+
+void TaskSimulator::finishStats()
+{
+    for (const auto& entry : m_tasks) {
+        const SimulatedTask& simulated = entry.second;
+        if (simulated.startTime >= 0.0) {
+            m_poolBusySlotSeconds[m_workers[simulated.workerIndex].poolIndex] += m_now - simulated.startTime;
+            continue;
+        }
+
+        SignatureStats& stats = m_signatures[m_classSignatures[simulated.classIndex]];
+        double waitSeconds = m_now - simulated.createTime;
+        stats.numStillWaiting++;
+        stats.longestStillWaitingSeconds = std::max(stats.longestStillWaitingSeconds, waitSeconds);
+        if (waitSeconds >= m_config.starvationSeconds) {
+            stats.numStarved++;
+        }
+    }
+}
+
+
+void TaskSimulator::printReport(double wallSeconds, uint64_t numEvents) const
+{
+    auto formatNumber = [](double value) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.1f", value);
+        return std::string(buf);
+    };
+
+    TextHeader::make("Simulation Results")->print();
+    (ColoredString(std::to_string(numEvents), TextColor::LightGreen) + ColoredString(" events simulated in ", TextColor::Green) +
+        ColoredString(formatNumber(wallSeconds), TextColor::LightGreen) + ColoredString(" seconds\n\n", TextColor::Green)).print();
+
+    // Utilization is the fraction of each pool's slot time spent running tasks
+    ColoredString("Utilization:\n", TextColor::Cyan).print();
+    double totalBusy = 0.0, totalCapacity = 0.0;
+    for (size_t i = 0; i < m_config.pools.size(); ++i) {
+        const auto& pool = m_config.pools[i];
+        double capacity = double(pool.numWorkers) * m_config.slotsPerWorker * m_config.simulatedSeconds;
+        totalBusy += m_poolBusySlotSeconds[i];
+        totalCapacity += capacity;
+
+        std::string tags;
+        for (const auto& tag : pool.resources) {
+            tags += (tags.empty() ? "" : "+") + tag;
+        }
+        ColoredString(std::to_string(pool.numWorkers) + " workers with " + (tags.empty() ? std::string("no tags") : tags) + ": " +
+            formatNumber(100.0 * m_poolBusySlotSeconds[i] / capacity) + "%\n", TextColor::Green).print();
+    }
+    ColoredString("All workers: " + formatNumber(100.0 * totalBusy / totalCapacity) + "%\n\n", TextColor::LightGreen).print();
+
+    ColoredString("Queue wait in seconds, by required tags (starved tasks waited at least " +
+        formatNumber(m_config.starvationSeconds) + " seconds):\n", TextColor::Cyan).print();
+    for (const auto& stats : m_signatures) {
+        std::vector<float> waits = stats.waitSeconds;
+        std::sort(waits.begin(), waits.end());
+        auto percentile = [&](double fraction) { return waits[std::min(waits.size() - 1, size_t(fraction * (waits.size() - 1) + 0.5))]; };
+
+        std::string line = stats.name + ": " + std::to_string(stats.numCreated) + " created, " + std::to_string(stats.numStarted) + " started";
+        if (!waits.empty()) {
+            line += ", wait p50 " + formatNumber(percentile(0.5)) + ", p90 " + formatNumber(percentile(0.9)) + ", p99 " +
+                formatNumber(percentile(0.99)) + ", max " + formatNumber(waits.back());
+        }
+        line += ", " + std::to_string(stats.numStarved) + " starved";
+        ColoredString(line + "\n", stats.numStarved > 0 ? TextColor::Yellow : TextColor::Green).print();
+
+        if (stats.numStillWaiting > 0) {
+            ColoredString("  " + std::to_string(stats.numStillWaiting) + " still waiting at the end, the longest for " +
+                formatNumber(stats.longestStillWaitingSeconds) + " seconds\n", TextColor::Yellow).print();
+        }
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include "TaskDatabase.h"
+#include "Crust/Arena.h"
+
+
+// A group of identical workers, which all register the same resource tags
+struct SimulatedWorkerPool
+{
+    int numWorkers;
+    std::vector<std::string> resources;
+};
+
+
+// A stream of identical tasks: they arrive at random (a Poisson process), and run for a random, log-normally
+// distributed time, whose mean is given
+struct SimulatedTaskClass
+{
+    double tasksPerSecond;
+    std::vector<std::string> requiredResources;
+    double meanDurationSeconds;
+};
+
+
+struct TaskSimulatorConfig
+{
+    TaskSimulatorConfig(); // a 10,000 worker cluster, with a little more work than its GPU and Windows workers can keep up with at peak
+
+    // Pools are given as "<count>:<tag>+<tag>,...", and task classes as "<tasks per second>:<tag>+<tag>:<mean seconds>,..."
+    bool parseWorkerPools(const std::string& spec);
+    bool parseTaskClasses(const std::string& spec);
+
+    std::vector<SimulatedWorkerPool> pools;
+    std::vector<SimulatedTaskClass> taskClasses;
+    int slotsPerWorker;
+    double simulatedSeconds;
+    double diurnalAmplitude; // arrival rates swing by this fraction of themselves over each simulated day (0 keeps them steady)
+    double starvationSeconds; // tasks that wait at least this long to start count as starved
+    uint64_t seed;
+};
+
+
+// Runs a simulated cluster against a real TaskDatabase, as a discrete-event simulation on the database's virtual
+// clock, so a day of scheduling takes seconds. Workers take tasks the moment one arrives or a slot frees up (i.e. as
+// if they polled continuously), so queue waits reflect the scheduler and the cluster's capacity, not polling intervals.
+// Workers never fail, but they renew their sessions and zombie cleanup runs on the server's interval, so the cost of
+// both is part of the simulation.
+class TaskSimulator
+{
+public:
+    TaskSimulator(const TaskSimulatorConfig& config);
+
+    void run();
+
+private:
+    enum class EventType { TaskArrival, TaskFinish };
+
+    struct Event
+    {
+        double time;
+        uint64_t order; // breaks ties between simultaneous events, so they're handled in the order they were scheduled
+        EventType type;
+        int index; // the task class of an arrival, or the worker a task finishes on
+        TaskID taskID;
+
+        bool operator>(const Event& other) const { return time != other.time ? time > other.time : order > other.order; }
+    };
+
+    struct SimulatedTask
+    {
+        TaskPtr task;
+        int classIndex;
+        double createTime;
+        double duration;
+        double startTime; // negative until the task starts
+        int workerIndex; // the worker running the task, once it's started
+    };
+
+    struct SimulatedWorker
+    {
+        WorkerSessionID sessionID;
+        int poolIndex;
+        int freeSlots;
+        int idlePosition; // where the worker is in its pool's idle list, or -1 while all its slots are busy
+    };
+
+    // Statistics of the tasks sharing a tag signature (i.e. the same required resources)
+    struct SignatureStats
+    {
+        SignatureStats() : numCreated(0), numStarted(0), numStarved(0), numStillWaiting(0), longestStillWaitingSeconds(0.0) {}
+
+        std::string name;
+        uint64_t numCreated;
+        uint64_t numStarted;
+        uint64_t numStarved; // whether they started or are still waiting
+        uint64_t numStillWaiting; // when the simulation ended
+        double longestStillWaitingSeconds;
+        std::vector<float> waitSeconds; // of every task that started
+    };
+
+    void schedule(double time, EventType type, int index, TaskID taskID = 0);
+    void scheduleArrival(int classIndex, double after);
+    void handleArrival(const Event& event);
+    void handleFinish(const Event& event);
+    bool takeTasks(int workerIndex); // returns whether the worker took any
+    void dispatchToIdleWorkers();
+    void updateIdleList(int workerIndex);
+    void setTime(double time); // also renews the workers' sessions when they're due, and cleans up zombies whenever the server would
+    void finishStats(); // accounts for the tasks still running or waiting when the simulation ends
+    void printReport(double wallSeconds, uint64_t numEvents) const;
+
+    TaskSimulatorConfig m_config;
+    TaskDatabase m_db;
+    Arena m_arena;
+    std::mt19937_64 m_random;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_events;
+    uint64_t m_nextEventOrder;
+    double m_now;
+    std::time_t m_lastRenewTime;
+    std::time_t m_lastCleanupTime;
+    std::vector<TaskCreateInfo> m_classInfos; // what creating a task of each class creates
+    std::vector<int> m_classSignatures; // the SignatureStats index of each class
+    std::vector<SignatureStats> m_signatures;
+    std::unordered_map<TaskID, SimulatedTask> m_tasks; // every created task that hasn't finished yet
+    std::vector<SimulatedWorker> m_workers;
+    std::vector<std::vector<int>> m_idleWorkers; // the workers of each pool that have a free slot
+    std::vector<double> m_poolBusySlotSeconds; // the slot time each pool spent running tasks
+};
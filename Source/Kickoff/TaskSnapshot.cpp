@@ -0,0 +1,108 @@
+#include "TaskSnapshot.h"
+#include "TaskDatabase.h"
+#include "TaskLog.h"
+#include "Crust/Util.h"
+#include "Crust/MappedFile.h"
+
+
+static const uint32_t SNAPSHOT_MAGIC = 0x4e534f4b; // "KOSN"
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t logGeneration;
+    uint64_t chunkCount;
+};
+
+
+TaskSnapshotWriter::TaskSnapshotWriter()
+    : m_file(nullptr)
+    , m_logGeneration(0)
+    , m_chunkCount(0)
+    , m_failed(false)
+{
+}
+
+
+TaskSnapshotWriter::~TaskSnapshotWriter()
+{
+    if (m_file) {
+        fclose(m_file);
+        deleteFile(m_path + ".tmp");
+    }
+}
+
+
+bool TaskSnapshotWriter::open(const std::string& path, uint64_t logGeneration)
+{
+    FILE* file = nullptr;
+    if (fopen_s(&file, (path + ".tmp").c_str(), "wb") != 0 || !file) { return false; }
+
+    m_file = file;
+    m_path = path;
+    m_logGeneration = logGeneration;
+    m_chunkCount = 0;
+
+    // The chunk count isn't known yet, so the header is written again once it is
+    SnapshotHeader header = {};
+    m_failed = fwrite(&header, sizeof(header), 1, m_file) != 1;
+    return !m_failed;
+}
+
+
+void TaskSnapshotWriter::append(ArrayView<uint8_t> chunk)
+{
+    if (m_failed) { return; }
+
+    m_record.clear();
+    TaskLog::writeRecord(m_record, chunk);
+    m_failed = fwrite(m_record.data(), m_record.size(), 1, m_file) != 1;
+    m_chunkCount++;
+}
+
+
+bool TaskSnapshotWriter::finish()
+{
+    if (!m_file) { return false; }
+
+    SnapshotHeader header;
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.logGeneration = m_logGeneration;
+    header.chunkCount = m_chunkCount;
+    bool written = !m_failed && fseek(m_file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, m_file) == 1;
+
+    written = written && flushFileToDisk(m_file);
+    fclose(m_file);
+    m_file = nullptr;
+
+    std::string tempPath = m_path + ".tmp";
+    if (!written || !renameFile(tempPath, m_path)) {
+        deleteFile(tempPath);
+        return false;
+    }
+    return true;
+}
+
+
+Optional<uint64_t> TaskSnapshot::load(const std::string& path, TaskDatabase& db)
+{
+    MappedFile file;
+    if (!file.open(path)) { return Nothing(); }
+
+    SnapshotHeader header;
+    if (file.size() < sizeof(header)) { return Nothing(); }
+    memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) { return Nothing(); }
+
+    uint64_t offset = sizeof(header);
+    ArrayView<uint8_t> chunk;
+    for (uint64_t i = 0; i < header.chunkCount; ++i) {
+        if (!TaskLog::readRecord(file.data(), file.size(), offset, chunk)) { return Nothing(); }
+        if (!db.applySnapshotChunk(chunk)) { return Nothing(); }
+    }
+
+    return header.logGeneration;
+}
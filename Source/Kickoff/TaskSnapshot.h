@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "Crust/BlobStream.h"
+#include "Crust/Optional.h"
+
+class TaskDatabase;
+
+
+// A point-in-time image of a TaskDatabase, so restarting the server doesn't require replaying the task log's entire
+// history. Each snapshot records the generation of the first log written after it was taken; restoring loads the
+// snapshot, then replays that log and every later one on top of it.
+//
+// The file is a fixed header followed by the database's snapshot chunks, framed the same way as log records. Loading
+// maps the file into memory and restores chunks straight out of the mapping.
+class TaskSnapshot
+{
+public:
+    // Restores a snapshot into an empty database, returning the generation of the first log to replay after it, or
+    // nothing if the snapshot can't be read or is corrupt.
+    static Optional<uint64_t> load(const std::string& path, TaskDatabase& db);
+};
+
+
+// Writes a snapshot a chunk at a time, as the database serializes them (see TaskDatabase::beginSnapshot). Chunks go
+// to a temporary file, which finish() only moves into place once it's entirely on disk, so a crash in the middle of
+// writing never leaves a partial snapshot behind. Nothing here touches the database, so finish() (which does the slow
+// part, syncing the file) is safe to call from a background thread.
+class TaskSnapshotWriter
+{
+public:
+    TaskSnapshotWriter();
+    ~TaskSnapshotWriter(); // deletes the temporary file, unless finish() moved it into place
+    TaskSnapshotWriter(const TaskSnapshotWriter&) = delete;
+
+    bool open(const std::string& path, uint64_t logGeneration);
+    void append(ArrayView<uint8_t> chunk); // a failed write is only reported by finish()
+    bool finish();
+
+private:
+    FILE* m_file;
+    std::string m_path;
+    uint64_t m_logGeneration;
+    uint64_t m_chunkCount;
+    bool m_failed;
+    std::vector<uint8_t> m_record;
+};
@@ -0,0 +1,197 @@
+#include "TaskSpill.h"
+#include "TaskLog.h"
+#include "Crust/Util.h"
+#include "Crust/Error.h"
+
+
+TaskSpill::TaskSpill()
+    : m_file(nullptr)
+    , m_size(0)
+    , m_liveRecordCount(0)
+    , m_releasedBytes(0)
+    , m_compactFile(nullptr)
+    , m_compactSize(0)
+{
+}
+
+
+TaskSpill::~TaskSpill()
+{
+    close();
+}
+
+
+bool TaskSpill::open(const std::string& path)
+{
+    close();
+
+    m_file = openTemporaryFile(path);
+    if (!m_file) { return false; }
+
+    m_path = path;
+    m_compactPath = path + TASK_SPILL_COMPACT_SUFFIX;
+    return true;
+}
+
+
+void TaskSpill::close()
+{
+    if (m_file) {
+        fclose(m_file);
+        m_file = nullptr;
+    }
+    if (m_compactFile) {
+        fclose(m_compactFile);
+        m_compactFile = nullptr;
+    }
+    m_size = 0;
+    m_unwritten.clear();
+    m_liveRecordCount = 0;
+    m_releasedBytes = 0;
+}
+
+
+uint64_t TaskSpill::append(ArrayView<uint8_t> record)
+{
+    uint64_t offset = getSize();
+    TaskLog::writeRecord(m_unwritten, record);
+    m_liveRecordCount++;
+
+    if (m_unwritten.size() >= TASK_SPILL_WRITE_BUFFER_SIZE) {
+        writeBuffered();
+    }
+    return offset;
+}
+
+
+void TaskSpill::read(uint64_t offset, std::vector<uint8_t>& outRecord)
+{
+    // A spilled task that can't be read back is lost, so the server is better off restarting from its log
+    std::vector<uint8_t> framed;
+    const uint8_t* data = m_unwritten.data();
+    uint64_t size = m_unwritten.size();
+    uint64_t recordOffset = offset - m_size;
+
+    if (offset < m_size) {
+        uint32_t payloadSize = 0;
+        framed.resize(TASK_LOG_RECORD_HEADER_SIZE);
+        if (_fseeki64(m_file, (int64_t)offset, SEEK_SET) != 0 || fread(framed.data(), framed.size(), 1, m_file) != 1) {
+            fail("Failed to read from the task spill file \"" + m_path + "\"");
+        }
+
+        memcpy(&payloadSize, framed.data(), sizeof(payloadSize));
+        if (payloadSize > m_size - offset - TASK_LOG_RECORD_HEADER_SIZE) {
+            fail("The task spill file \"" + m_path + "\" is corrupt");
+        }
+        framed.resize(TASK_LOG_RECORD_HEADER_SIZE + payloadSize);
+        if (payloadSize > 0 && fread(framed.data() + TASK_LOG_RECORD_HEADER_SIZE, payloadSize, 1, m_file) != 1) {
+            fail("Failed to read from the task spill file \"" + m_path + "\"");
+        }
+
+        data = framed.data();
+        size = framed.size();
+        recordOffset = 0;
+    }
+
+    ArrayView<uint8_t> payload;
+    if (!TaskLog::readRecord(data, size, recordOffset, payload)) {
+        fail("The task spill file \"" + m_path + "\" is corrupt");
+    }
+    const uint8_t* bytes = payload.size() > 0 ? &payload.first() : nullptr;
+    outRecord.assign(bytes, bytes + payload.size());
+}
+
+
+void TaskSpill::release(size_t recordSize)
+{
+    m_releasedBytes += TASK_LOG_RECORD_HEADER_SIZE + recordSize;
+    if (m_liveRecordCount > 0 && --m_liveRecordCount == 0) {
+        clear();
+    }
+}
+
+
+void TaskSpill::clear()
+{
+    m_unwritten.clear();
+    m_liveRecordCount = 0;
+    m_releasedBytes = 0;
+    if (m_file && m_size > 0) {
+        if (!truncateFile(m_file, 0)) {
+            fail("Failed to empty the task spill file \"" + m_path + "\"");
+        }
+        m_size = 0;
+    }
+}
+
+
+bool TaskSpill::shouldCompact() const
+{
+    return m_releasedBytes >= TASK_SPILL_MIN_COMPACT_BYTES && m_releasedBytes >= getSize() * TASK_SPILL_COMPACT_DEAD_FRACTION;
+}
+
+
+void TaskSpill::beginCompaction()
+{
+    m_compactFile = openTemporaryFile(m_compactPath);
+    if (!m_compactFile) {
+        fail("Failed to create the task spill file \"" + m_compactPath + "\"");
+    }
+    m_compactSize = 0;
+    m_compactUnwritten.clear();
+}
+
+
+uint64_t TaskSpill::moveRecord(uint64_t offset)
+{
+    read(offset, m_compactRecord);
+
+    uint64_t newOffset = m_compactSize;
+    size_t unwrittenSize = m_compactUnwritten.size();
+    TaskLog::writeRecord(m_compactUnwritten, m_compactRecord);
+    m_compactSize += m_compactUnwritten.size() - unwrittenSize;
+
+    if (m_compactUnwritten.size() >= TASK_SPILL_WRITE_BUFFER_SIZE) {
+        writeOrFail(m_compactFile, m_compactUnwritten, m_compactPath);
+        m_compactUnwritten.clear();
+    }
+    return newOffset;
+}
+
+
+void TaskSpill::finishCompaction()
+{
+    writeOrFail(m_compactFile, m_compactUnwritten, m_compactPath);
+    m_compactUnwritten.clear();
+
+    // Closing the old file deletes it, freeing its name for the next compaction
+    fclose(m_file);
+    m_file = m_compactFile;
+    m_compactFile = nullptr;
+    std::swap(m_path, m_compactPath);
+
+    m_size = m_compactSize;
+    m_unwritten.clear();
+    m_releasedBytes = 0;
+}
+
+
+void TaskSpill::writeBuffered()
+{
+    if (m_unwritten.empty()) { return; }
+
+    writeOrFail(m_file, m_unwritten, m_path);
+    m_size += m_unwritten.size();
+    m_unwritten.clear();
+}
+
+
+void TaskSpill::writeOrFail(FILE* file, const std::vector<uint8_t>& bytes, const std::string& path)
+{
+    if (bytes.empty()) { return; }
+
+    // Reads move the file position, so always go back to the end first
+    if (_fseeki64(file, 0, SEEK_END) != 0 || fwrite(bytes.data(), bytes.size(), 1, file) != 1 || fflush(file) != 0) {
+        fail("Failed to write to the task spill file \"" + path + "\"");
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include "Crust/Array.h"
+
+// Spilled records are buffered in memory until this many bytes are pending, then written to the file in one go
+static const size_t TASK_SPILL_WRITE_BUFFER_SIZE = 1024 * 1024;
+
+// The file is compacted once records that are no longer needed make up this fraction of it, and at least this many
+// bytes. So a compaction copies at most as much as was released since the one before, and the file stays within twice
+// the size of its live records (or that minimum).
+static const double TASK_SPILL_COMPACT_DEAD_FRACTION = 0.5;
+static const uint64_t TASK_SPILL_MIN_COMPACT_BYTES = 64 * 1024 * 1024;
+
+// Compaction writes into a second file named like the first plus this suffix, which then takes the first's place (the
+// next compaction writes into the original name again)
+static const char* const TASK_SPILL_COMPACT_SUFFIX = ".compact";
+
+
+// An append-only file that holds the pending tasks a TaskDatabase has no room for in memory. Each task is appended once
+// as a record (framed like log records), and read back by its offset when the task is paged back in. The space of
+// records that are no longer needed is reclaimed all at once when none are left (the file is just emptied), or else by
+// compaction, which rewrites the live records into a new file and moves their offsets with them.
+//
+// Spilled tasks are still in the log and snapshots, so the file is only a cache: it's never synced to disk, and it's
+// deleted when closed (or when the process dies), since each server process spills into its own file.
+class TaskSpill
+{
+public:
+    TaskSpill();
+    ~TaskSpill();
+    TaskSpill(const TaskSpill&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    bool isOpen() const { return m_file != nullptr; }
+
+    uint64_t append(ArrayView<uint8_t> record); // returns the offset the record is read back from
+    void read(uint64_t offset, std::vector<uint8_t>& outRecord);
+    void release(size_t recordSize); // marks one appended record (of this many bytes, as read back) as no longer needed
+    void clear(); // discards every record
+
+    // The owner of the offsets compacts the file by moving every live record, between beginCompaction() and
+    // finishCompaction(); nothing else may be appended or read meanwhile
+    bool shouldCompact() const;
+    void beginCompaction();
+    uint64_t moveRecord(uint64_t offset); // returns the record's offset in the new file
+    void finishCompaction();
+
+    uint64_t getSize() const { return m_size + m_unwritten.size(); }
+
+private:
+    void writeBuffered();
+    static void writeOrFail(FILE* file, const std::vector<uint8_t>& bytes, const std::string& path);
+
+    FILE* m_file;
+    std::string m_path;
+    uint64_t m_size; // the size of the file itself, not counting m_unwritten
+    std::vector<uint8_t> m_unwritten; // framed records appended after the end of the file
+    uint64_t m_liveRecordCount;
+    uint64_t m_releasedBytes; // of framed records that are no longer needed
+
+    FILE* m_compactFile; // the file being compacted into, if any
+    std::string m_compactPath;
+    uint64_t m_compactSize; // including m_compactUnwritten
+    std::vector<uint8_t> m_compactUnwritten;
+    std::vector<uint8_t> m_compactRecord; // the record being moved, reused for each
+};
@@ -0,0 +1,227 @@
+#include "TaskTrace.h"
+#include "TaskLog.h"
+#include "TaskServer.h"
+#include "Crust/BlobStream.h"
+#include "Crust/Error.h"
+#include "Crust/FormattedText.h"
+#include "Crust/MappedFile.h"
+#include <algorithm>
+#include <thread>
+
+
+TaskTraceWriter::TaskTraceWriter()
+    : m_file(nullptr)
+{
+}
+
+
+TaskTraceWriter::~TaskTraceWriter()
+{
+    close();
+}
+
+
+bool TaskTraceWriter::open(const std::string& path, uint64_t idSeed, std::time_t startTime)
+{
+    close();
+
+    FILE* file = nullptr;
+    if (fopen_s(&file, path.c_str(), "wb") != 0 || !file) { return false; }
+
+    m_file = file;
+    m_path = path;
+    m_lastRequestTime = Clock::now();
+
+    BlobStreamWriter header;
+    header << TASK_TRACE_VERSION << idSeed << (int64_t)startTime;
+    TaskLog::writeRecord(m_buffer, header.data());
+    flush();
+    return isOpen();
+}
+
+
+void TaskTraceWriter::close()
+{
+    flush();
+    if (m_file) {
+        fclose(m_file);
+        m_file = nullptr;
+    }
+}
+
+
+void TaskTraceWriter::append(ArrayView<uint8_t> request)
+{
+    if (!m_file) { return; }
+
+    auto now = Clock::now();
+    uint64_t elapsedUS = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - m_lastRequestTime).count();
+    m_lastRequestTime = now;
+
+    BlobStreamWriter record;
+    record.setCompact(true);
+    record << varInt(elapsedUS) << varInt((uint32_t)request.size()) << request;
+    TaskLog::writeRecord(m_buffer, record.data());
+
+    if (m_buffer.size() >= TASK_TRACE_WRITE_BYTES) {
+        flush();
+    }
+}
+
+
+void TaskTraceWriter::flush()
+{
+    if (!m_file || m_buffer.empty()) {
+        m_buffer.clear();
+        return;
+    }
+
+    // The trace is only a diagnostic, so failing to write it isn't worth taking the server down over
+    if (fwrite(m_buffer.data(), m_buffer.size(), 1, m_file) != 1 || fflush(m_file) != 0) {
+        printWarning("Failed to write the request trace \"" + m_path + "\"; no longer tracing requests.");
+        fclose(m_file);
+        m_file = nullptr;
+    }
+    m_buffer.clear();
+}
+
+
+// The type of a request, looking past the protocol version it may be tagged with
+static bool peekRequestType(ArrayView<uint8_t> requestBytes, TaskRequestType& outType)
+{
+    BlobStreamReader request(requestBytes);
+    uint8_t version;
+    if (!(request >> outType)) { return false; }
+    if (outType == TaskRequestType::Versioned) {
+        return (request >> version) && (request >> outType);
+    }
+    return true;
+}
+
+
+TaskReplay::TaskReplay(bool paced)
+    : m_paced(paced)
+{
+}
+
+
+void TaskReplay::run(const std::string& tracePath)
+{
+    MappedFile file;
+    if (!file.open(tracePath)) {
+        fail("Failed to open the request trace \"" + tracePath + "\"");
+    }
+
+    uint64_t offset = 0;
+    ArrayView<uint8_t> payload;
+    uint8_t version = 0;
+    uint64_t idSeed = 0;
+    int64_t startTime = 0;
+    if (TaskLog::readRecord(file.data(), file.size(), offset, payload)) {
+        BlobStreamReader header(payload);
+        if (!(header >> version) || !(header >> idSeed) || !(header >> startTime)) {
+            version = 0;
+        }
+    }
+    if (version != TASK_TRACE_VERSION) {
+        fail("\"" + tracePath + "\" isn't a request trace this version of Kickoff can read");
+    }
+
+    // The server never binds its port; requests are handed to it directly
+    TaskServer server(0);
+    TaskDatabase& db = server.getDatabase();
+    db.seedIDs(idSeed);
+    db.setVirtualTime((std::time_t)startTime);
+
+    ColoredString("Replaying \"" + tracePath + "\"" + (m_paced ? " at its recorded pace\n" : "\n"), TextColor::Cyan).print();
+
+    uint64_t traceUS = 0;
+    std::time_t lastCleanup = (std::time_t)startTime;
+    auto replayStartTime = Clock::now();
+    while (offset < file.size()) {
+        BlobStreamReader record;
+        uint64_t elapsedUS = 0;
+        ArrayView<uint8_t> request;
+        if (TaskLog::readRecord(file.data(), file.size(), offset, payload)) {
+            record = BlobStreamReader(payload);
+            record.setCompact(true);
+        }
+        if (!(record >> varInt(elapsedUS)) || !record.readView(request)) {
+            printWarning("Ignoring " + std::to_string(file.size() - offset) + " bytes of torn or corrupt records at the end of the trace");
+            break;
+        }
+
+        // Time only moves on between requests, and zombie tasks are cleaned up as often as the server would have
+        traceUS += elapsedUS;
+        std::time_t now = (std::time_t)(startTime + (int64_t)(traceUS / 1000000));
+        db.setVirtualTime(now);
+        if (now - lastCleanup >= SERVER_TASK_CLEANUP_INTERVAL_SECONDS) {
+            db.cleanupZombieTasks(WORKER_HEARTBEAT_TIMEOUT_SECONDS);
+            lastCleanup = now;
+        }
+
+        if (m_paced) {
+            std::this_thread::sleep_until(replayStartTime + std::chrono::microseconds(traceUS));
+        }
+
+        auto requestStartTime = Clock::now();
+        auto reply = server.handleRequest(request);
+        double requestUS = std::chrono::duration<double, std::micro>(Clock::now() - requestStartTime).count();
+
+        TaskRequestType type;
+        if (!peekRequestType(request, type)) { continue; }
+        if ((size_t)type >= m_stats.size()) {
+            m_stats.resize((size_t)type + 1);
+        }
+
+        RequestTypeStats& stats = m_stats[(size_t)type];
+        stats.timesUS.push_back(requestUS);
+        if (*(const TaskReplyType*)&reply[0].data().first() != TaskReplyType::Success) {
+            stats.numFailed++;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - replayStartTime).count();
+    printReport(seconds, traceUS);
+}
+
+
+void TaskReplay::printReport(double seconds, uint64_t traceMicroseconds) const
+{
+    auto formatNumber = [](double value) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.1f", value);
+        return std::string(buf);
+    };
+
+    uint64_t numRequests = 0;
+    for (const auto& stats : m_stats) {
+        numRequests += stats.timesUS.size();
+    }
+
+    TextHeader::make("Replay Results")->print();
+    (ColoredString(std::to_string(numRequests), TextColor::LightGreen) + ColoredString(" requests, spanning ", TextColor::Green) +
+        ColoredString(formatNumber(traceMicroseconds / 1e6), TextColor::LightGreen) + ColoredString(" seconds of trace, replayed in ", TextColor::Green) +
+        ColoredString(formatNumber(seconds), TextColor::LightGreen) + ColoredString(" seconds\n\n", TextColor::Green)).print();
+
+    ColoredString("Microseconds to handle each type of request:\n", TextColor::Cyan).print();
+    for (size_t i = 0; i < m_stats.size(); ++i) {
+        std::vector<double> times = m_stats[i].timesUS;
+        if (times.empty()) { continue; }
+        std::sort(times.begin(), times.end());
+
+        double total = 0.0;
+        for (double time : times) {
+            total += time;
+        }
+        auto percentile = [&](double fraction) { return times[std::min(times.size() - 1, size_t(fraction * (times.size() - 1) + 0.5))]; };
+
+        std::string line = std::string(getRequestTypeName((TaskRequestType)i)) + ": " + std::to_string(times.size()) + " requests";
+        if (m_stats[i].numFailed > 0) {
+            line += " (" + std::to_string(m_stats[i].numFailed) + " failed)";
+        }
+        line += ", mean " + formatNumber(total / times.size()) + ", p50 " + formatNumber(percentile(0.5)) +
+            ", p99 " + formatNumber(percentile(0.99)) + ", max " + formatNumber(times.back()) + "\n";
+        ColoredString(line, TextColor::Green).print();
+    }
+}
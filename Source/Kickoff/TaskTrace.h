@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "Crust/Array.h"
+
+// Version of the trace file format, written in its header record
+static const uint8_t TASK_TRACE_VERSION = 1;
+
+// Traced requests are buffered in memory, and written out once this many bytes have built up
+static const size_t TASK_TRACE_WRITE_BYTES = 256 * 1024;
+
+
+// Records every request a server handles, and when, so the same sequence of requests can be replayed offline (see
+// TaskReplay). A trace is a series of records framed like the task log's (see TaskLog::writeRecord). The first record
+// holds the format version, the seed of the server's task and worker session IDs, and the time tracing started; each
+// of the others holds the microseconds since the previous request (a varint) followed by the bytes of a request.
+//
+// Unlike the task log, a trace is never fsynced; a crash may lose the last requests, which replay simply won't see.
+class TaskTraceWriter
+{
+public:
+    TaskTraceWriter();
+    ~TaskTraceWriter();
+    TaskTraceWriter(const TaskTraceWriter&) = delete;
+
+    bool open(const std::string& path, uint64_t idSeed, std::time_t startTime);
+    void close();
+    bool isOpen() const { return m_file != nullptr; }
+
+    void append(ArrayView<uint8_t> request); // stops tracing (with a warning) if the trace can't be written
+    void flush();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    FILE* m_file;
+    std::string m_path;
+    std::vector<uint8_t> m_buffer;
+    Clock::time_point m_lastRequestTime;
+};
+
+
+// Feeds the requests of a trace to a fresh, in-memory server, and reports how long each type of request took to
+// handle. The database runs on a virtual clock that follows the trace's timestamps, and draws IDs from the traced
+// server's seed, so a trace started on an empty server replays exactly as it originally ran. (A trace of a server that
+// already had tasks replays too, but requests for tasks created before tracing started just fail.)
+class TaskReplay
+{
+public:
+    TaskReplay(bool paced); // paced replays wait out the time between requests, rather than handling them back to back
+
+    void run(const std::string& tracePath);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct RequestTypeStats
+    {
+        RequestTypeStats() : numFailed(0) {}
+
+        std::vector<double> timesUS;
+        uint64_t numFailed;
+    };
+
+    void printReport(double seconds, uint64_t traceMicroseconds) const;
+
+    bool m_paced;
+    std::vector<RequestTypeStats> m_stats; // indexed by TaskRequestType
+};
@@ -4,15 +4,18 @@
 #include "Crust/Error.h"
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
 static const int MIN_PROCESS_POLL_INTERVAL_MS = 100;
 static const int MIN_SERVER_POLL_MS = 1000;
 static const int MAX_WAITING_POLL_INTERVAL_MS = 60 * 1000;
 static const int MAX_RUNNING_POLL_INTERVAL_MS = clamp<int>(MAX_WAITING_POLL_INTERVAL_MS, MIN_PROCESS_POLL_INTERVAL_MS, 1000 * WORKER_HEARTBEAT_TIMEOUT_SECONDS / 2);
 
+typedef std::chrono::steady_clock WorkerClock;
 
-TaskWorker::TaskWorker(TaskClient& client, std::vector<std::string>&& resources)
-    : m_client(client), m_resources(std::move(resources)), m_running(false)
+
+TaskWorker::TaskWorker(TaskClient& client, std::vector<std::string>&& resources, int numSlots)
+    : m_client(client), m_resources(std::move(resources)), m_slots(std::max(numSlots, 1)), m_sessionID(NO_WORKER_SESSION), m_running(false)
 {
 }
 
@@ -38,34 +41,100 @@ void TaskWorker::printResources()
 }
 
 
+void TaskWorker::openSession()
+{
+    m_sessionID = m_client.openWorkerSession(getMachineName(), m_resources).orFail("Failed to open a worker session with the task server.");
+}
+
+
+int TaskWorker::getBusySlotCount() const
+{
+    int count = 0;
+    for (const auto& slot : m_slots) {
+        if (slot.isBusy()) { count++; }
+    }
+    return count;
+}
+
+
 void TaskWorker::run()
 {
-    ColoredString("Starting worker with resources: ", TextColor::Cyan).print();
+    ColoredString("Starting worker with " + std::to_string(m_slots.size()) + " slot(s) and resources: ", TextColor::Cyan).print();
     printResources();
     printf("\n");
     m_running = true;
 
-    int pollIntervalMS = 0;
-    while (m_running)
+    openSession();
+
+    int takePollIntervalMS = 0;
+    int processPollIntervalMS = 0;
+    auto nextTakeTime = WorkerClock::now();
+    auto nextRenewTime = WorkerClock::now() + std::chrono::milliseconds(MIN_SERVER_POLL_MS);
+
+    // Keep going until shut down, and then until all running tasks have completed
+    while (m_running || getBusySlotCount() > 0)
     {
-        if (tryRunOneTask())
+        if (reapFinishedTasks()) {
+            takePollIntervalMS = 0;
+            nextTakeTime = WorkerClock::now();
+        }
+
+        // Fill free slots, backing off if the server doesn't have enough tasks for all of them. Finished tasks are
+        // reported in the same request, so between tasks a slot costs a single round trip.
+        bool wantTasks = m_running && WorkerClock::now() >= nextTakeTime && getBusySlotCount() < (int)m_slots.size();
+        if (wantTasks)
         {
-            pollIntervalMS = 0;
+            bool startedTask = (finishAndStartTasks((int)m_slots.size() - getBusySlotCount()) > 0);
+            bool outOfTasks = (getBusySlotCount() < (int)m_slots.size());
 
-            ColoredString("Requesting next task. Worker resources: ", TextColor::Cyan).print();
-            printResources();
-            printf("\n");
+            if (startedTask) {
+                processPollIntervalMS = 0;
+            }
+            if (outOfTasks) {
+                // While no tasks are ready, wait a little bit before checking again (at slowly increasing intervals)
+                takePollIntervalMS = clamp(takePollIntervalMS, MIN_SERVER_POLL_MS, MAX_WAITING_POLL_INTERVAL_MS);
+                nextTakeTime = WorkerClock::now() + std::chrono::milliseconds(takePollIntervalMS);
+                takePollIntervalMS = (takePollIntervalMS + 1) + (takePollIntervalMS / 4); // slow exponential slowdown
+
+                if (getBusySlotCount() == 0) {
+                    ColoredString("Waiting for task (" + std::to_string(takePollIntervalMS / 1000) + "s)\r", TextColor::Cyan).print();
+                }
+            }
+            else {
+                takePollIntervalMS = 0;
+            }
         }
-        else
-        {
-            ColoredString("Waiting for task (" + std::to_string(pollIntervalMS / 1000) + "s)\r", TextColor::Cyan).print();
-            
-            // While no tasks are ready, sleep for a little bit before checking again (at slowly increasing intervals)
-            pollIntervalMS = clamp(pollIntervalMS, MIN_SERVER_POLL_MS, MAX_WAITING_POLL_INTERVAL_MS);
-            std::this_thread::sleep_for(std::chrono::milliseconds(pollIntervalMS));
-            pollIntervalMS = (pollIntervalMS + 1) + (pollIntervalMS / 4); // slow exponential slowdown
+        else if (!m_finishedTaskIDs.empty()) {
+            finishAndStartTasks(0);
+        }
+
+        // One lease renewal heartbeats every task running in all slots, and reports which of them were canceled
+        if (getBusySlotCount() > 0 && WorkerClock::now() >= nextRenewTime) {
+            renewSession();
+            nextRenewTime = WorkerClock::now() + std::chrono::milliseconds(MIN_SERVER_POLL_MS);
+        }
+
+        // Sleep until either a running process should be checked again, or it's time to ask the server for more tasks
+        auto sleepUntil = nextTakeTime;
+        if (getBusySlotCount() > 0) {
+            processPollIntervalMS = clamp(processPollIntervalMS, MIN_PROCESS_POLL_INTERVAL_MS, MAX_RUNNING_POLL_INTERVAL_MS);
+            auto nextProcessPollTime = WorkerClock::now() + std::chrono::milliseconds(processPollIntervalMS);
+            processPollIntervalMS = (processPollIntervalMS + 1) + (processPollIntervalMS / 2);
+
+            sleepUntil = (m_running && getBusySlotCount() < (int)m_slots.size()) ? std::min(nextTakeTime, nextProcessPollTime) : nextProcessPollTime;
+            sleepUntil = std::min(sleepUntil, nextRenewTime);
+        }
+        else if (!m_running) {
+            break;
         }
+        std::this_thread::sleep_until(sleepUntil);
+    }
+
+    if (!m_finishedTaskIDs.empty()) {
+        finishAndStartTasks(0);
     }
+    m_client.closeWorkerSession(m_sessionID);
+    m_sessionID = NO_WORKER_SESSION;
 }
 
 
@@ -76,51 +145,86 @@ void TaskWorker::shutdown()
 }
 
 
-bool TaskWorker::tryRunOneTask()
+int TaskWorker::finishAndStartTasks(int maxCount)
 {
-    auto optRunInfo = m_client.takeTaskToRun(m_resources);
-    if (!optRunInfo.hasValue())
+    bool unknownSession = false;
+    int numFinished = 0;
+    auto optRunInfos = m_client.finishAndTakeTasksToRun(m_sessionID, m_finishedTaskIDs, maxCount, &unknownSession, &numFinished);
+    if (numFinished < (int)m_finishedTaskIDs.size())
     {
-        return false;
+        printWarning("Failed to mark " + std::to_string(m_finishedTaskIDs.size() - numFinished) + " finished task(s) as finished!");
     }
-    auto& runInfo = optRunInfo.refOrFail("Assert fail");
+    m_finishedTaskIDs.clear();
+
+    if (unknownSession)
+    {
+        printWarning("Worker session expired; opening a new one.");
+        openSession();
+        return 0;
+    }
+    if (!optRunInfos.hasValue())
+    {
+        return 0;
+    }
+
+    auto runInfos = optRunInfos.moveContentsOrFail("Assert fail");
+    size_t nextRunInfo = 0;
+    for (auto& slot : m_slots) {
+        if (nextRunInfo >= runInfos.size()) { break; }
+        if (slot.isBusy()) { continue; }
+        startTask(slot, std::move(runInfos[nextRunInfo++]));
+    }
+    return (int)nextRunInfo;
+}
+
+
+void TaskWorker::startTask(Slot& slot, TaskRunInfo&& runInfo)
+{
+    slot.runInfo = std::move(runInfo);
 
     ProcessStartInfo startInfo;
-    startInfo.commandStr = runInfo.command.get();
+    startInfo.commandStr = slot.runInfo.command;
     startInfo.workingDir = ".";
 
-    ColoredString("Starting task " + toHexString(runInfo.id) + "\n", TextColor::Green).print();
-    Process proc(startInfo);
+    ColoredString("Starting task " + toHexString(slot.runInfo.id) + "\n", TextColor::Green).print();
+    slot.process.reset(new Process(startInfo));
+}
 
-    int pollIntervalSecondsMS = 0;
-    int timeSleptBetweenHeartbeatMS = 0;
 
-    while (proc.isRunning())
-    {
-        // While the process is running, sleep for a little bit before checking again (at slowly increasing intervals)
-        pollIntervalSecondsMS = clamp(pollIntervalSecondsMS, MIN_PROCESS_POLL_INTERVAL_MS, MAX_RUNNING_POLL_INTERVAL_MS);
-        std::this_thread::sleep_for(std::chrono::milliseconds(pollIntervalSecondsMS));
-        timeSleptBetweenHeartbeatMS += pollIntervalSecondsMS;
-        pollIntervalSecondsMS = (pollIntervalSecondsMS + 1) + (pollIntervalSecondsMS / 2);
-
-        // If enough time has passed, send a heartbeat signal while and check if the task was canceled
-        if (timeSleptBetweenHeartbeatMS >= MIN_SERVER_POLL_MS) {
-            timeSleptBetweenHeartbeatMS = 0;
-
-            auto optWasCanceled = m_client.heartbeatAndCheckWasTaskCanceled(runInfo.id);
-            if (optWasCanceled.orDefault(false) == true) {
-                ColoredString("Killing task " + toHexString(runInfo.id) + "\n", TextColor::Red).print();
-                proc.terminate();
-                break;
-            }
-        }
+bool TaskWorker::reapFinishedTasks()
+{
+    bool freedSlot = false;
+    for (auto& slot : m_slots) {
+        if (!slot.isBusy() || slot.process->isRunning()) { continue; }
+
+        slot.process->wait();
+        slot.process.reset();
+        freedSlot = true;
+
+        // The server is told about finished tasks with the next request for more tasks
+        ColoredString("Finished task " + toHexString(slot.runInfo.id) + "\n", TextColor::LightGreen).print();
+        m_finishedTaskIDs.push_back(slot.runInfo.id);
     }
-    proc.wait();
+    return freedSlot;
+}
+
 
-    ColoredString("Finished task " + toHexString(runInfo.id) + "\n", TextColor::LightGreen).print();
-    if (!m_client.markTaskFinished(runInfo.id)) {
-        printWarning("Failed to mark task " + toHexString(runInfo.id) + " as finished!");
+void TaskWorker::renewSession()
+{
+    auto optCanceledTasks = m_client.renewWorkerSession(m_sessionID);
+    if (!optCanceledTasks.hasValue()) {
+        // The server no longer tracks our running tasks; let them run to completion anyway, and reopen the session for the next ones
+        printWarning("Worker session expired while running tasks; opening a new one.");
+        openSession();
+        return;
     }
 
-    return true;
+    for (TaskID canceledID : optCanceledTasks.refOrFail("Assert fail")) {
+        for (auto& slot : m_slots) {
+            if (slot.isBusy() && slot.runInfo.id == canceledID) {
+                ColoredString("Killing task " + toHexString(canceledID) + "\n", TextColor::Red).print();
+                slot.process->terminate();
+            }
+        }
+    }
 }
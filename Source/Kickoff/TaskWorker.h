@@ -2,22 +2,39 @@
 
 #include "TaskDatabase.h"
 #include "TaskServer.h"
+#include "Process.h"
 
 class TaskWorker
 {
 public:
-    TaskWorker(TaskClient& client, std::vector<std::string>&& resources);
+    TaskWorker(TaskClient& client, std::vector<std::string>&& resources, int numSlots = 1);
     ~TaskWorker();
 
     void run();
     void shutdown();
 
 private:
-    bool tryRunOneTask();
+    // Each slot runs at most one task process at a time; all slots share the worker's connection and session
+    struct Slot
+    {
+        TaskRunInfo runInfo;
+        std::unique_ptr<Process> process;
+
+        bool isBusy() const { return (bool)process; }
+    };
+
+    int finishAndStartTasks(int maxCount); // reports finished tasks and fills free slots in a single request; returns how many were started
+    void startTask(Slot& slot, TaskRunInfo&& runInfo);
+    bool reapFinishedTasks(); // returns true if any slot was freed
+    void renewSession();
+    void openSession();
     void printResources();
+    int getBusySlotCount() const;
 
     TaskClient& m_client;
     std::vector<std::string> m_resources;
+    std::vector<Slot> m_slots;
+    std::vector<TaskID> m_finishedTaskIDs; // tasks that finished but haven't been reported to the server yet
+    WorkerSessionID m_sessionID;
     volatile bool m_running;
 };
-